@@ -0,0 +1,58 @@
+#ifndef ARENA_HPP
+#define ARENA_HPP
+
+#include <cstddef>
+#include <new>
+#include <utility>
+#include <vector>
+
+// Bump allocator for objects of one type. Objects are carved out of large
+// blocks and are never freed one by one; they are all destroyed with the arena.
+template <class T>
+class Arena {
+    static const size_t BLOCKSIZE = 4096;   // objects per block
+
+    std::vector<T*> blocks;
+    size_t used;                            // objects used in the last block
+
+    Arena(const Arena &);
+    Arena &operator=(const Arena &);
+
+public:
+    Arena() : used(BLOCKSIZE) {}
+    ~Arena();
+
+    template <class... Args>
+    T *alloc(Args&&... args);
+
+    // Number of objects allocated so far
+    size_t size() const {
+        return blocks.empty() ? 0 : (blocks.size() - 1) * BLOCKSIZE + used;
+    }
+};
+
+template <class T>
+template <class... Args>
+T *Arena<T>::alloc(Args&&... args)
+{
+    if (used == BLOCKSIZE) {
+        blocks.push_back(static_cast<T*>(::operator new(sizeof(T) * BLOCKSIZE)));
+        used = 0;
+    }
+    T *p = new (blocks.back() + used) T(std::forward<Args>(args)...);
+    ++used;
+    return p;
+}
+
+template <class T>
+Arena<T>::~Arena()
+{
+    for (size_t i = 0, max = blocks.size(); i < max; ++i) {
+        size_t n = (i + 1 == max) ? used : BLOCKSIZE;
+        for (size_t j = 0; j < n; ++j)
+            blocks[i][j].~T();
+        ::operator delete(blocks[i]);
+    }
+}
+
+#endif
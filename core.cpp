@@ -1,5 +1,6 @@
 #include "core.hpp"
 #include <iostream>
+#include <unordered_map>
 
 // Operator for comparison: equality
 bool Parameter::operator==(const Parameter& other)
@@ -76,6 +77,62 @@ std::string reg2string(Register reg) {
     }
 }
 
+// Alias descriptors, in the order of enum Register
+static const RegAlias aliastable[UNK + 1] = {
+    // 64-bit registers
+    {RAX, 0, 64},    {RBX, 0, 64},    {RCX, 0, 64},    {RDX, 0, 64},
+    {RSI, 0, 64},    {RDI, 0, 64},    {RSP, 0, 64},    {RBP, 0, 64},
+    {R8, 0, 64},     {R9, 0, 64},     {R10, 0, 64},    {R11, 0, 64},
+    {R12, 0, 64},    {R13, 0, 64},    {R14, 0, 64},    {R15, 0, 64},
+
+    // 32-bit registers
+    {RAX, 0, 32},    {RBX, 0, 32},    {RCX, 0, 32},    {RDX, 0, 32},
+    {RSI, 0, 32},    {RDI, 0, 32},    {RSP, 0, 32},    {RBP, 0, 32},
+    {R8, 0, 32},     {R9, 0, 32},     {R10, 0, 32},    {R11, 0, 32},
+    {R12, 0, 32},    {R13, 0, 32},    {R14, 0, 32},    {R15, 0, 32},
+
+    // 16-bit registers
+    {RAX, 0, 16},    {RBX, 0, 16},    {RCX, 0, 16},    {RDX, 0, 16},
+    {RSI, 0, 16},    {RDI, 0, 16},    {RBP, 0, 16},    {RSP, 0, 16},
+    {R8, 0, 16},     {R9, 0, 16},     {R10, 0, 16},    {R11, 0, 16},
+    {R12, 0, 16},    {R13, 0, 16},    {R14, 0, 16},    {R15, 0, 16},
+
+    // 8-bit registers (low)
+    {RAX, 0, 8},     {RBX, 0, 8},     {RCX, 0, 8},     {RDX, 0, 8},
+    {RSI, 0, 8},     {RDI, 0, 8},     {RBP, 0, 8},     {RSP, 0, 8},
+    {R8, 0, 8},      {R9, 0, 8},      {R10, 0, 8},     {R11, 0, 8},
+    {R12, 0, 8},     {R13, 0, 8},     {R14, 0, 8},     {R15, 0, 8},
+
+    // 8-bit registers (high)
+    {RAX, 8, 8},     {RBX, 8, 8},     {RCX, 8, 8},     {RDX, 8, 8},
+
+    // FPU, segment and unknown registers
+    {UNK, 0, 0}, {UNK, 0, 0}, {UNK, 0, 0}, {UNK, 0, 0}, {UNK, 0, 0}, {UNK, 0, 0},
+    {UNK, 0, 0}, {UNK, 0, 0}, {UNK, 0, 0}, {UNK, 0, 0}, {UNK, 0, 0}, {UNK, 0, 0},
+    {UNK, 0, 0}
+};
+
+const RegAlias &regalias(Register reg)
+{
+    return aliastable[reg];
+}
+
+Register string2reg(const std::string &s)
+{
+    // Built once, also when called from several threads
+    static const std::unordered_map<std::string, Register> regs = []() {
+        std::unordered_map<std::string, Register> m;
+        for (int r = 0; r < UNK; ++r) {
+            if (aliastable[r].parent != UNK)
+                m[reg2string((Register)r)] = (Register)r;
+        }
+        return m;
+    }();
+
+    std::unordered_map<std::string, Register>::const_iterator it = regs.find(s);
+    return it == regs.end() ? UNK : it->second;
+}
+
 void Parameter::show() const
 {
     if (ty == IMM) {
@@ -89,128 +146,20 @@ void Parameter::show() const
     }
 }
 
-bool isReg64(std::string reg) {
-    return (reg == "rax" || reg == "rbx" || reg == "rcx" || reg == "rdx" ||
-            reg == "rsi" || reg == "rdi" || reg == "rsp" || reg == "rbp" ||
-            reg == "r8" || reg == "r9" || reg == "r10" || reg == "r11" ||
-            reg == "r12" || reg == "r13" || reg == "r14" || reg == "r15");
-}
-
-bool isReg32(std::string reg) {
-    return (reg == "eax" || reg == "ebx" || reg == "ecx" || reg == "edx" ||
-            reg == "esi" || reg == "edi" || reg == "esp" || reg == "ebp" ||
-            reg == "r8d" || reg == "r9d" || reg == "r10d" || reg == "r11d" ||
-            reg == "r12d" || reg == "r13d" || reg == "r14d" || reg == "r15d");
-}
-
-bool isReg16(std::string reg) {
-    return (reg == "ax" || reg == "bx" || reg == "cx" || reg == "dx" ||
-            reg == "si" || reg == "di" || reg == "bp" || reg == "sp" ||
-            reg == "r8w" || reg == "r9w" || reg == "r10w" || reg == "r11w" ||
-            reg == "r12w" || reg == "r13w" || reg == "r14w" || reg == "r15w");
-}
-
-bool isReg8(std::string reg) {
-    return (reg == "al" || reg == "bl" || reg == "cl" || reg == "dl" ||
-            reg == "ah" || reg == "bh" || reg == "ch" || reg == "dh" ||
-            reg == "sil" || reg == "dil" || reg == "bpl" || reg == "spl" ||
-            reg == "r8b" || reg == "r9b" || reg == "r10b" || reg == "r11b" ||
-            reg == "r12b" || reg == "r13b" || reg == "r14b" || reg == "r15b");
-}
-
-Register getRegParameter(std::string regname, std::vector<int> &idx)
+// Register parameters are bytes of the 64-bit registers, so that writes
+// and reads of sub-registers depend on each other. A write to a 32-bit
+// register also clears the upper half.
+static Register getRegParameter(std::string regname, std::vector<int> &idx, bool write = false)
 {
-    if (isReg64(regname)) {
-        idx.push_back(0); idx.push_back(1); idx.push_back(2); idx.push_back(3);
-        idx.push_back(4); idx.push_back(5); idx.push_back(6); idx.push_back(7);
-
-        if (regname == "rax") return RAX;
-        if (regname == "rbx") return RBX;
-        if (regname == "rcx") return RCX;
-        if (regname == "rdx") return RDX;
-        if (regname == "rsi") return RSI;
-        if (regname == "rdi") return RDI;
-        if (regname == "rsp") return RSP;
-        if (regname == "rbp") return RBP;
-        if (regname == "r8")  return R8;
-        if (regname == "r9")  return R9;
-        if (regname == "r10") return R10;
-        if (regname == "r11") return R11;
-        if (regname == "r12") return R12;
-        if (regname == "r13") return R13;
-        if (regname == "r14") return R14;
-        if (regname == "r15") return R15;
+    const RegAlias &ra = regalias(string2reg(regname));
+    if (ra.parent == UNK) {
+        std::cout << "Unknown register: " << regname << std::endl;
+        return UNK;
     }
-
-    if (isReg32(regname)) {
-        idx.push_back(0); idx.push_back(1); idx.push_back(2); idx.push_back(3);
-        // Handle 32-bit registers
-        if (regname == "eax") return EAX;
-        if (regname == "ebx") return EBX;
-        if (regname == "ecx") return ECX;
-        if (regname == "edx") return EDX;
-        if (regname == "esi") return ESI;
-        if (regname == "edi") return EDI;
-        if (regname == "esp") return ESP;
-        if (regname == "ebp") return EBP;
-        if (regname == "r8d") return R8D;
-        if (regname == "r9d") return R9D;
-        if (regname == "r10d") return R10D;
-        if (regname == "r11d") return R11D;
-        if (regname == "r12d") return R12D;
-        if (regname == "r13d") return R13D;
-        if (regname == "r14d") return R14D;
-        if (regname == "r15d") return R15D;
-    }
-
-    if (isReg16(regname)) {
-        idx.push_back(0); idx.push_back(1);
-        // Handle 16-bit registers
-        if (regname == "ax") return AX;
-        if (regname == "bx") return BX;
-        if (regname == "cx") return CX;
-        if (regname == "dx") return DX;
-        if (regname == "si") return SI;
-        if (regname == "di") return DI;
-        if (regname == "bp") return BP;
-        if (regname == "sp") return SP;
-        if (regname == "r8w") return R8W;
-        if (regname == "r9w") return R9W;
-        if (regname == "r10w") return R10W;
-        if (regname == "r11w") return R11W;
-        if (regname == "r12w") return R12W;
-        if (regname == "r13w") return R13W;
-        if (regname == "r14w") return R14W;
-        if (regname == "r15w") return R15W;
-    }
-
-    if (isReg8(regname)) {
-        idx.push_back(0);
-        // Handle 8-bit registers
-        if (regname == "al") return AL;
-        if (regname == "bl") return BL;
-        if (regname == "cl") return CL;
-        if (regname == "dl") return DL;
-        if (regname == "ah") return AH;
-        if (regname == "bh") return BH;
-        if (regname == "ch") return CH;
-        if (regname == "dh") return DH;
-        if (regname == "sil") return SIL;
-        if (regname == "dil") return DIL;
-        if (regname == "bpl") return BPL;
-        if (regname == "spl") return SPL;
-        if (regname == "r8b") return R8B;
-        if (regname == "r9b") return R9B;
-        if (regname == "r10b") return R10B;
-        if (regname == "r11b") return R11B;
-        if (regname == "r12b") return R12B;
-        if (regname == "r13b") return R13B;
-        if (regname == "r14b") return R14B;
-        if (regname == "r15b") return R15B;
-    }
-
-    std::cout << "Unknown register: " << regname << std::endl;
-    return UNK;
+    int last = (write && ra.width == 32) ? 64 : ra.offset + ra.width;
+    for (int i = ra.offset / 8; i < last / 8; ++i)
+        idx.push_back(i);
+    return ra.parent;
 }
 
 // Add source parameter: immediate or register
@@ -252,7 +201,7 @@ void Inst::adddst(Parameter::Type t, std::string s)
 {
     if (t == Parameter::REG) {
         std::vector<int> v;
-        Register r = getRegParameter(s, v);
+        Register r = getRegParameter(s, v, true);
         for (int i = 0, max = v.size(); i < max; ++i) {
             Parameter p;
             p.ty = t;
@@ -315,7 +264,7 @@ void Inst::adddst2(Parameter::Type t, std::string s)
 {
     if (t == Parameter::REG) {
         std::vector<int> v;
-        Register r = getRegParameter(s, v);
+        Register r = getRegParameter(s, v, true);
         for (int i = 0, max = v.size(); i < max; ++i) {
             Parameter p;
             p.ty = t;
@@ -338,3 +287,27 @@ void Inst::adddst2(Parameter::Type t, AddrRange a)
         dst2.push_back(p);
     }
 }
+
+// FNV-1a over the instruction addresses
+uint64_t hashAddrSeq(std::list<Inst>::iterator begin, std::list<Inst>::iterator end)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (std::list<Inst>::iterator it = begin; it != end; ++it) {
+        ADDR64 a = it->addrn;
+        for (int i = 0; i < 8; ++i, a >>= 8) {
+            h ^= a & 0xff;
+            h *= 0x100000001b3ULL;
+        }
+    }
+    return h;
+}
+
+bool sameAddrSeq(std::list<Inst>::iterator b1, std::list<Inst>::iterator e1,
+                 std::list<Inst>::iterator b2, std::list<Inst>::iterator e2)
+{
+    for (; b1 != e1 && b2 != e2; ++b1, ++b2) {
+        if (b1->addrn != b2->addrn)
+            return false;
+    }
+    return b1 == e1 && b2 == e2;
+}
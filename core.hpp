@@ -5,6 +5,7 @@
 #include <bitset>
 #include <string>
 #include <vector>
+#include <list>
 #include <utility>
 #include <map>
 
@@ -51,6 +52,13 @@ enum Register {
 };
 
 
+// Where a register lives inside one of the 16 general-purpose registers
+struct RegAlias {
+     Register parent;           // RAX..R15, UNK if it is not a part of one
+     int offset;                // lowest bit
+     int width;                 // width in bits
+};
+
 struct Operand {
      enum Type { IMM, REG, MEM };
      Type ty;
@@ -59,8 +67,9 @@ struct Operand {
      bool issegaddr;
      std::string segreg;             // For seg mem access like fs:[0x1]
      std::string field[5];
+     Register reg[2];                // REG: the register; MEM: base and index
 
-     Operand() : bit(0), issegaddr(false) {}
+     Operand() : bit(0), issegaddr(false) { reg[0] = reg[1] = UNK; }
 };
 
 struct Parameter {
@@ -107,5 +116,13 @@ struct Inst {
 typedef std::pair<std::map<int, int>, std::map<int, int>> FullMap;
 
 std::string reg2string(Register reg);
+Register string2reg(const std::string &s);      // UNK if s is not a register
+const RegAlias &regalias(Register reg);
+
+// Hash of the instruction address sequence in [begin, end). Two executions of
+// the same code path get the same hash.
+uint64_t hashAddrSeq(std::list<Inst>::iterator begin, std::list<Inst>::iterator end);
+bool sameAddrSeq(std::list<Inst>::iterator b1, std::list<Inst>::iterator e1,
+                 std::list<Inst>::iterator b2, std::list<Inst>::iterator e2);
 
 #endif
\ No newline at end of file
@@ -1,26 +1,600 @@
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <string>
 #include <list>
 #include <map>
+#include <unordered_map>
 #include <vector>
 #include <set>
+#include <thread>
+#include <atomic>
+#include <cstdlib>
+#include <cstdio>
+#include <climits>
+#include <unistd.h>
 
 using namespace std;
 
 #include "core.hpp"
 #include "mg-symengine.hpp"
 #include "parser.hpp"
+#include "slice.hpp"
 
 list<Inst> instlist1, instlist2;     // all instructions in the trace
 
+// Command line settings shared by all regions
+struct Options {
+     vector<Register> symregs;           // symbolic inputs, all if both are empty
+     vector<AddrRange> symmems;
+     vector<string> outputs;             // registers, memory ranges, "regs" or "mem"
+     string format;                      // text, cvc or smt
+     bool summaries;
+     bool mba;
+     bool slice;                         // execute only the slice of the outputs
+     int cpdepth, cpsize, cpinterval;    // checkpoint limits, 0 for none
+
+     Options() : format("text"), summaries(false), mba(false), slice(false),
+                 cpdepth(0), cpsize(0), cpinterval(0) {}
+};
+
+// A piece of trace to execute on its own: a whole snippet file, or a range
+// of instructions in a trace that is already loaded
+struct Region {
+     string name;
+     string file;                        // empty for a range
+     list<Inst>::iterator begin, end;
+     string report;
+     bool tracedep;                      // the result used concrete values of the trace
+     int same;                           // earlier region whose result is reused, -1 if none
+     int unmodelled;                     // instructions not modelled by the slicer
+
+     Region() : tracedep(true), same(-1), unmodelled(0) {}
+};
+
+static void usage(const char *prog)
+{
+     fprintf(stderr, "usage: %s [options] <target>\n", prog);
+     fprintf(stderr, "       %s [options] <snippet>...\n", prog);
+     fprintf(stderr, "       %s [options] -r <vmranges.txt> <target>\n", prog);
+     fprintf(stderr, "       %s [options] -l <formula file>\n", prog);
+     fprintf(stderr, "options:\n");
+     fprintf(stderr, "  -i first:last  execute only the instructions with these ids\n");
+     fprintf(stderr, "  -c inputs      symbolic inputs, the rest is taken from the trace:\n");
+     fprintf(stderr, "                 registers and memory ranges, as rax,rsi,0x601000:0x60100f\n");
+     fprintf(stderr, "  -o outputs     registers and memory ranges to report, \"regs\" for all\n");
+     fprintf(stderr, "                 registers, \"mem\" for all memory (default rax)\n");
+     fprintf(stderr, "  -f format      text, cvc or smt (default text)\n");
+     fprintf(stderr, "  -m             simplify mixed boolean-arithmetic in the outputs\n");
+     fprintf(stderr, "  -s             summarize repeated blocks\n");
+     fprintf(stderr, "  -b             execute only the backward slice of the outputs, with\n");
+     fprintf(stderr, "                 the other registers taken from the trace\n");
+     fprintf(stderr, "  -k d:s:n       every n instructions, make formulas deeper than d or\n");
+     fprintf(stderr, "                 larger than s new symbols\n");
+     fprintf(stderr, "  -w file        save all formulas to a formula file\n");
+     fprintf(stderr, "  -l file        report the formulas of a formula file\n");
+     fprintf(stderr, "  -j threads     threads for several regions\n");
+     fprintf(stderr, "  -r file        regions listed by vmextract -r\n");
+}
+
+static vector<string> splitlist(const string &s)
+{
+     vector<string> items;
+     stringstream ss(s);
+     string item;
+     while (getline(ss, item, ','))
+          if (!item.empty())
+               items.push_back(item);
+     return items;
+}
+
+// "first:last" with numbers in any base strtoull accepts
+static bool parserange(const string &s, ADDR64 *first, ADDR64 *last)
+{
+     size_t colon = s.find(':');
+     if (colon == string::npos)
+          return false;
+     char *end1, *end2;
+     string a = s.substr(0, colon), b = s.substr(colon + 1);
+     *first = strtoull(a.c_str(), &end1, 0);
+     *last = strtoull(b.c_str(), &end2, 0);
+     return !a.empty() && !b.empty() && *end1 == 0 && *end2 == 0 && *first <= *last;
+}
+
+// "first:last" instruction ids, which must fit in an int
+static bool parseidrange(const string &s, int *first, int *last)
+{
+     ADDR64 a, b;
+     if (!parserange(s, &a, &b) || b > (ADDR64)INT_MAX)
+          return false;
+     *first = a;
+     *last = b;
+     return true;
+}
+
+static bool parseinputs(const string &s, Options *opt)
+{
+     vector<string> items = splitlist(s);
+     for (size_t i = 0; i < items.size(); ++i) {
+          ADDR64 first, last;
+          if (string2reg(items[i]) != UNK)
+               opt->symregs.push_back(string2reg(items[i]));
+          else if (parserange(items[i], &first, &last))
+               opt->symmems.push_back(AddrRange(first, last));
+          else
+               return false;
+     }
+     return !items.empty();
+}
+
+static bool parseoutputs(const string &s, Options *opt)
+{
+     vector<string> items = splitlist(s);
+     for (size_t i = 0; i < items.size(); ++i) {
+          ADDR64 first, last;
+          if (items[i] != "regs" && items[i] != "mem" && string2reg(items[i]) == UNK &&
+              (!parserange(items[i], &first, &last) || last - first >= 8))
+               return false;
+     }
+     opt->outputs = items;
+     return !items.empty();
+}
+
+// The instructions of [begin, end) the outputs depend on. Their parameters
+// must have been built.
+static vector<bool> slicefor(list<Inst>::iterator begin, list<Inst>::iterator end,
+                             const Options &opt)
+{
+     Inst crit;          // the outputs, as source parameters
+     set<Parameter> wl;
+     for (size_t i = 0; i < opt.outputs.size(); ++i) {
+          const string &o = opt.outputs[i];
+          ADDR64 first, last;
+          if (o == "regs") {
+               for (int r = RAX; r <= R15; ++r)
+                    crit.addsrc(Parameter::REG, reg2string((Register)r));
+          } else if (o == "mem") {
+               for (list<Inst>::iterator it = begin; it != end; ++it) {
+                    for (size_t j = 0; j < it->dst.size(); ++j)
+                         if (it->dst[j].ty == Parameter::MEM)
+                              wl.insert(it->dst[j]);
+                    for (size_t j = 0; j < it->dst2.size(); ++j)
+                         if (it->dst2[j].ty == Parameter::MEM)
+                              wl.insert(it->dst2[j]);
+               }
+          } else if (parserange(o, &first, &last)) {
+               crit.addsrc(Parameter::MEM, AddrRange(first, last));
+          } else {
+               crit.addsrc(Parameter::REG, o);
+          }
+     }
+     wl.insert(crit.src.begin(), crit.src.end());
+
+     vector<bool> inslice;
+     backslice(begin, end, &wl, &inslice);
+     return inslice;
+}
+
+static SEEngine *execute(list<Inst>::iterator begin, list<Inst>::iterator end,
+                         const Options &opt)
+{
+     SEEngine *se = new SEEngine();
+     if (opt.slice)
+          se->setSlice(slicefor(begin, end, opt));
+     if (!opt.symregs.empty() || !opt.symmems.empty())
+          se->setConcolic(opt.symregs, opt.symmems);
+     se->setSummaries(opt.summaries);
+     if (opt.cpinterval > 0)
+          se->setCheckpoints(opt.cpdepth, opt.cpsize, opt.cpinterval);
+     se->initAllRegSymbol(begin, end);
+     se->symexec();
+     return se;
+}
+
+// Print the chosen outputs of an engine in the chosen format
+static void report(SEEngine *se, const Options &opt, ostream &os)
+{
+     // Names for SMT and CVC, titles for text
+     vector<pair<string, Value*> > outs;
+     vector<string> titles;
+     for (size_t i = 0; i < opt.outputs.size(); ++i) {
+          const string &o = opt.outputs[i];
+          ADDR64 first, last;
+          char buf[64];
+          if (o == "regs") {
+               for (int r = RAX; r <= R15; ++r) {
+                    string name = reg2string((Register)r);
+                    outs.push_back(make_pair(name, se->getValue(name)));
+                    titles.push_back("Register " + name + " = ");
+               }
+          } else if (o == "mem") {
+               vector<pair<AddrRange, Value*> > mem;
+               se->getMemValues(&mem);
+               for (size_t j = 0; j < mem.size(); ++j) {
+                    snprintf(buf, sizeof(buf), "mem_%llx_%llx",
+                             (unsigned long long)mem[j].first.first,
+                             (unsigned long long)mem[j].first.second);
+                    outs.push_back(make_pair(string(buf), mem[j].second));
+                    snprintf(buf, sizeof(buf), "Memory [%llx, %llx] = ",
+                             (unsigned long long)mem[j].first.first,
+                             (unsigned long long)mem[j].first.second);
+                    titles.push_back(buf);
+               }
+          } else if (parserange(o, &first, &last)) {
+               snprintf(buf, sizeof(buf), "mem_%llx_%llx",
+                        (unsigned long long)first, (unsigned long long)last);
+               outs.push_back(make_pair(string(buf), se->getMemValue(first, last)));
+               snprintf(buf, sizeof(buf), "Memory [%llx, %llx] = ",
+                        (unsigned long long)first, (unsigned long long)last);
+               titles.push_back(buf);
+          } else {
+               outs.push_back(make_pair(o, se->getValue(o)));
+               titles.push_back("Register " + o + " = ");
+          }
+     }
+
+     // Outputs with no value are reported and left out
+     for (size_t i = 0; i < outs.size(); ) {
+          if (outs[i].second == NULL) {
+               cerr << "Error: " << titles[i] << "no value found!" << endl;
+               outs.erase(outs.begin() + i);
+               titles.erase(titles.begin() + i);
+               continue;
+          }
+          if (opt.mba)
+               outs[i].second = se->simplifyMBA(outs[i].second);
+          ++i;
+     }
+
+     if (opt.format == "smt") {
+          outputSMTOutputs(outs, os);
+          return;
+     }
+     for (size_t i = 0; i < outs.size(); ++i) {
+          if (opt.format == "cvc") {
+               os << outs[i].first << " = ";
+               outputCVC(outs[i].second, "", os);
+               os << endl;
+               continue;
+          }
+          os << titles[i] << endl;
+          traverse(outs[i].second, os);
+          os << endl;
+     }
+}
+
+// Execute one region in its own engine and keep the output in its report
+static void runregion(Region *r, const Options &opt)
+{
+     list<Inst> insts;
+     if (!r->file.empty()) {
+          ifstream infile(r->file.c_str());
+          if (!infile.is_open()) {
+               r->report = "Open file error!\n";
+               return;
+          }
+          parseTrace(&infile, &insts);
+          parseOperand(insts.begin(), insts.end());
+          if (opt.slice)
+               r->unmodelled = buildParameter(insts.begin(), insts.end());
+          r->begin = insts.begin();
+          r->end = insts.end();
+     }
+     if (r->begin == r->end) {
+          r->report = "Empty region\n";
+          return;
+     }
+
+     ostringstream os;
+     SEEngine *se = execute(r->begin, r->end, opt);
+     r->tracedep = se->traceDependent();
+     os << distance(r->begin, r->end) << " instructions, " << se->nodeCount() << " nodes, "
+        << se->unknownCount() << " unknown results";
+     if (opt.slice)
+          os << ", " << se->skippedCount() << " not in the slice, " << r->unmodelled
+             << " not modelled by the slicer";
+     os << endl;
+     report(se, opt, os);
+     delete se;
+     r->report = os.str();
+}
+
+// Iterators of the instructions with ids first and last, in a loaded trace
+static bool findrange(list<Inst> *L, int first, int last,
+                      list<Inst>::iterator *begin, list<Inst>::iterator *end)
+{
+     *begin = *end = L->end();
+     for (list<Inst>::iterator it = L->begin(); it != L->end(); ++it) {
+          if (it->id == first)
+               *begin = it;
+          if (it->id == last && *begin != L->end()) {
+               *end = next(it);
+               return true;
+          }
+     }
+     return false;
+}
+
+// Read "vmN: first last" lines written by vmextract -r
+static bool readranges(const char *file, list<Inst> *L, vector<Region> *regions)
+{
+     ifstream infile(file);
+     if (!infile.is_open())
+          return false;
+
+     unordered_map<int, list<Inst>::iterator> byid;
+     for (list<Inst>::iterator it = L->begin(); it != L->end(); ++it)
+          byid[it->id] = it;
+
+     string name;
+     int first, last;
+     while (infile >> name >> first >> last) {
+          if (byid.count(first) == 0 || byid.count(last) == 0 || last < first) {
+               fprintf(stderr, "Bad range %s %d %d\n", name.c_str(), first, last);
+               continue;
+          }
+          Region r;
+          r.name = name.substr(0, name.find(':'));
+          r.begin = byid[first];
+          r.end = next(byid[last]);
+          regions->push_back(r);
+     }
+     return true;
+}
+
+#define LAYOUTSPAN 32             // bytes compared for each memory access
+
+// The memory layout of a range as the engine sees it: for each byte at an
+// access, the latest earlier access that covered it and which of its bytes.
+// Only the bytes where this stops following on from the byte before are
+// kept, as (access, byte, earlier access, its byte). Ranges with the same
+// instructions and layout give the same register formulas.
+static void memlayout(list<Inst>::iterator begin, list<Inst>::iterator end, vector<int> *layout)
+{
+     unordered_map<ADDR64, pair<int, int> > owner;
+     int n = 0;
+     for (list<Inst>::iterator it = begin; it != end; ++it) {
+          ADDR64 addrs[2] = {it->raddr, it->waddr};
+          for (int k = 0; k < 2; ++k) {
+               if (addrs[k] == 0)
+                    continue;
+               pair<int, int> prev(-1, 0);
+               for (int b = 0; b < LAYOUTSPAN; ++b) {
+                    unordered_map<ADDR64, pair<int, int> >::iterator o = owner.find(addrs[k] + b);
+                    pair<int, int> cur = o == owner.end() ? make_pair(-1, 0) : o->second;
+                    if (cur.first != prev.first || (cur.first >= 0 && cur.second != prev.second + 1)) {
+                         int entry[4] = {n, b, cur.first, cur.second};
+                         layout->insert(layout->end(), entry, entry + 4);
+                    }
+                    prev = cur;
+                    owner[addrs[k] + b] = make_pair(n, b);
+               }
+               ++n;
+          }
+     }
+}
+
+// Results can only be reused if they do not depend on where the range is
+// in the trace: all registers symbolic, no checkpoints or slices, which use
+// concrete values of the trace, and only register outputs
+static bool reusable(const Options &opt)
+{
+     if (!opt.symregs.empty() || !opt.symmems.empty() || opt.cpinterval > 0 || opt.slice)
+          return false;
+     for (size_t i = 0; i < opt.outputs.size(); ++i) {
+          if (opt.outputs[i] != "regs" && string2reg(opt.outputs[i]) == UNK)
+               return false;
+     }
+     return true;
+}
+
+// Point every range at the first earlier range with the same address
+// sequence and memory layout, such as the instances of one VM handler.
+// Layouts are only built for ranges that have such a candidate.
+static void findsame(vector<Region> *regions)
+{
+     unordered_map<uint64_t, vector<int> > byhash;
+     vector<vector<int> > layouts(regions->size());
+     vector<bool> built(regions->size(), false);
+     auto layout = [&](int i) -> const vector<int> & {
+          if (!built[i]) {
+               memlayout((*regions)[i].begin, (*regions)[i].end, &layouts[i]);
+               built[i] = true;
+          }
+          return layouts[i];
+     };
+
+     for (int i = 0; i < (int)regions->size(); ++i) {
+          Region &r = (*regions)[i];
+          if (!r.file.empty() || r.begin == r.end)
+               continue;
+          vector<int> &cand = byhash[hashAddrSeq(r.begin, r.end)];
+          for (size_t j = 0; j < cand.size() && r.same < 0; ++j) {
+               Region &c = (*regions)[cand[j]];
+               if (sameAddrSeq(c.begin, c.end, r.begin, r.end) && layout(cand[j]) == layout(i))
+                    r.same = cand[j];
+          }
+          if (r.same < 0)
+               cand.push_back(i);
+     }
+}
+
+// Run the regions on a pool of threads, each taking the next region when
+// it is done
+static void runpool(const vector<Region*> &todo, int nthread, const Options &opt)
+{
+     atomic<int> nextregion(0);
+     auto worker = [&]() {
+          int n;
+          while ((n = nextregion++) < (int)todo.size())
+               runregion(todo[n], opt);
+     };
+
+     if (nthread < 1) nthread = thread::hardware_concurrency();
+     if (nthread < 1) nthread = 1;
+     if (nthread > (int)todo.size()) nthread = todo.size();
+     vector<thread> threads;
+     for (int i = 0; i < nthread; ++i)
+          threads.push_back(thread(worker));
+     for (int i = 0; i < nthread; ++i)
+          threads[i].join();
+}
+
+// Run every region, executing repeated ranges once when their result does
+// not depend on the trace, then print the reports in region order
+static void runparallel(vector<Region> *regions, int nthread, const Options &opt)
+{
+     if (reusable(opt))
+          findsame(regions);
+
+     vector<Region*> todo;
+     for (size_t i = 0; i < regions->size(); ++i) {
+          if ((*regions)[i].same < 0)
+               todo.push_back(&(*regions)[i]);
+     }
+     runpool(todo, nthread, opt);
+
+     // Results that used the trace are computed again for every range
+     int nreused = 0;
+     todo.clear();
+     for (size_t i = 0; i < regions->size(); ++i) {
+          Region &r = (*regions)[i];
+          if (r.same < 0)
+               continue;
+          if ((*regions)[r.same].tracedep) {
+               r.same = -1;
+               todo.push_back(&r);
+          } else {
+               r.report = (*regions)[r.same].report;
+               ++nreused;
+          }
+     }
+     runpool(todo, nthread, opt);
+
+     for (size_t i = 0; i < regions->size(); ++i) {
+          Region &r = (*regions)[i];
+          cout << "== " << r.name;
+          if (r.same >= 0)
+               cout << " (as " << (*regions)[r.same].name << ")";
+          cout << ": " << r.report << endl;
+     }
+     cout << regions->size() << " regions";
+     if (nreused > 0)
+          cout << ", " << nreused << " results reused";
+     cout << endl;
+}
+
 int main(int argc, char **argv) {
-     if (argc != 2) {
-          fprintf(stderr, "usage: %s <target>\n", argv[0]);
+     Options opt;
+     opt.outputs.push_back("rax");
+     int nthread = 0;
+     const char *rangefile = NULL, *savefile = NULL, *loadfile = NULL;
+     int first = 0, last = 0;
+     bool idrange = false;
+     int c;
+     while ((c = getopt(argc, argv, "i:c:o:f:msbk:w:l:j:r:")) != -1) {
+          bool ok = true;
+          switch (c) {
+          case 'i':
+               ok = idrange = parseidrange(optarg, &first, &last);
+               break;
+          case 'c':
+               ok = parseinputs(optarg, &opt);
+               break;
+          case 'o':
+               ok = parseoutputs(optarg, &opt);
+               break;
+          case 'f':
+               opt.format = optarg;
+               ok = opt.format == "text" || opt.format == "cvc" || opt.format == "smt";
+               break;
+          case 'm':
+               opt.mba = true;
+               break;
+          case 's':
+               opt.summaries = true;
+               break;
+          case 'b':
+               opt.slice = true;
+               break;
+          case 'k':
+               ok = sscanf(optarg, "%d:%d:%d", &opt.cpdepth, &opt.cpsize, &opt.cpinterval) == 3 &&
+                    opt.cpinterval > 0;
+               break;
+          case 'w':
+               savefile = optarg;
+               break;
+          case 'l':
+               loadfile = optarg;
+               break;
+          case 'j':
+               nthread = atoi(optarg);
+               break;
+          case 'r':
+               rangefile = optarg;
+               break;
+          default:
+               ok = false;
+          }
+          if (!ok) {
+               usage(argv[0]);
+               return 1;
+          }
+     }
+
+     // A formula file is reported without executing anything
+     if (loadfile != NULL) {
+          if (optind != argc) {
+               usage(argv[0]);
+               return 1;
+          }
+          SEEngine *se = new SEEngine();
+          if (!se->loadFormulas(loadfile))
+               return 1;
+          report(se, opt, cout);
+          if (savefile != NULL && !se->saveFormulas(savefile))
+               return 1;
+          return 0;
+     }
+
+     bool multi = rangefile != NULL || argc - optind > 1 || nthread > 0;
+     if (optind >= argc || (rangefile != NULL && argc - optind != 1) ||
+         (multi && (idrange || savefile != NULL))) {
+          usage(argv[0]);
           return 1;
      }
 
-     ifstream infile1(argv[1]);
+     // Several snippets, or ranges of one trace: one engine per region
+     if (multi) {
+          vector<Region> regions;
+          if (rangefile != NULL) {
+               ifstream infile1(argv[optind]);
+               if (!infile1.is_open()) {
+                    fprintf(stderr, "Open file error!\n");
+                    return 1;
+               }
+               parseTrace(&infile1, &instlist1);
+               infile1.close();
+               parseOperand(instlist1.begin(), instlist1.end());
+               if (!readranges(rangefile, &instlist1, &regions)) {
+                    fprintf(stderr, "Open file error!\n");
+                    return 1;
+               }
+               // Each region ends where its engine does
+               for (size_t i = 0; opt.slice && i < regions.size(); ++i)
+                    regions[i].unmodelled = buildParameter(regions[i].begin, regions[i].end);
+          } else {
+               for (int i = optind; i < argc; ++i) {
+                    Region r;
+                    r.name = r.file = argv[i];
+                    regions.push_back(r);
+               }
+          }
+          runparallel(&regions, nthread, opt);
+          return 0;
+     }
+
+     ifstream infile1(argv[optind]);
      if (!infile1.is_open()) {
           fprintf(stderr, "Open file error!\n");
           return 1;
@@ -29,12 +603,22 @@ int main(int argc, char **argv) {
      parseTrace(&infile1, &instlist1);
      infile1.close();
 
-     parseOperand(instlist1.begin(), instlist1.end());
+     list<Inst>::iterator begin = instlist1.begin(), end = instlist1.end();
+     if (idrange && !findrange(&instlist1, first, last, &begin, &end)) {
+          fprintf(stderr, "No instructions with ids %d to %d\n", first, last);
+          return 1;
+     }
+     parseOperand(begin, end);
+     if (opt.slice) {
+          int unmodelled = buildParameter(begin, end);
+          if (unmodelled > 0)
+               cerr << unmodelled << " instructions not modelled by the slicer" << endl;
+     }
 
-     SEEngine *se1 = new SEEngine();
-     se1->initAllRegSymol(instlist1.begin(), instlist1.end());
-     se1->symexec();
-     se1->dumpreg("rax");
+     SEEngine *se1 = execute(begin, end, opt);
+     report(se1, opt, cout);
+     if (savefile != NULL && !se1->saveFormulas(savefile))
+          return 1;
 
      return 0;
 }
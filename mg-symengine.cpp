@@ -5,98 +5,97 @@
 #include <vector>
 #include <set>
 #include <map>
+#include <unordered_set>
 #include <queue>
-#include <bitset>
 #include <sstream>
+#include <fstream>
+#include <algorithm>
+#include <random>
+#include <thread>
+#include <atomic>
+#include <cstdlib>
+#include <csignal>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 using namespace std;
 
 #include "core.hpp"
 #include "mg-symengine.hpp"
 
-enum ValueTy {SYMBOL, CONCRETE, HYBRID, UNKNOWN};
-enum OperTy {ADD, MOV, SHL, XOR, SHR};
-typedef pair<int,int> BitRange;
+enum ValueTy {SYMBOL, CONCRETE, UNKNOWN};
 
 // A symbolic or concrete value in a formula
 struct Value {
-     int id;                             // a unique id for each value
+     int id;                             // unique within an engine, in order of creation
      ValueTy valty;
      Operation *opr;
-     string conval;                      // concrete value
-     bitset<64> bsconval;                // concrete set stored as bitset
-     BitRange brange;
-     map<BitRange, Value*> childs;       // a list of child values in a hybrid value
+     ADDR64 conval;                      // concrete value of a leaf
      int len;                            // length of the value
-
-     static int idseed;
+     bool tainted;                       // depends on a chosen input (concolic mode)
 
      Value(ValueTy vty);
      Value(ValueTy vty, int l);
-     Value(ValueTy vty, string con); // constructor for concrete value
-     Value(ValueTy vty, string con, int l);
+     Value(ValueTy vty, ADDR64 con); // constructor for concrete value
+     Value(ValueTy vty, ADDR64 con, int l);
      Value(ValueTy vty, Operation *oper);
      Value(ValueTy vty, Operation *oper, int l);
-     Value(ValueTy vty, bitset<64> bs);
 
      bool isSymbol();
      bool isConcrete();
-     bool isHybrid();
 };
 
-int Value::idseed = 0;
-
-Value::Value(ValueTy vty) : opr(NULL)
+Value::Value(ValueTy vty) : opr(NULL), conval(0)
 {
-     id = ++idseed;
+     id = 0;
+     tainted = false;
      valty = vty;
      len = 64;
 }
 
-Value::Value(ValueTy vty, int l) : opr(NULL)
+Value::Value(ValueTy vty, int l) : opr(NULL), conval(0)
 {
-     id = ++idseed;
+     id = 0;
+     tainted = false;
      valty = vty;
      len = l;
 }
 
-Value::Value(ValueTy vty, string con) : opr(NULL), bsconval(stoull(con, 0, 16))
+Value::Value(ValueTy vty, ADDR64 con) : opr(NULL)
 {
-     id = ++idseed;
+     id = 0;
+     tainted = false;
      valty = vty;
      conval = con;
-     brange.first = 0;
-     brange.second = 63;
      len = 64;
 }
 
-Value::Value(ValueTy vty, string con, int l) : opr(NULL)
+Value::Value(ValueTy vty, ADDR64 con, int l) : opr(NULL)
 {
-     id = ++idseed;
+     id = 0;
+     tainted = false;
      valty = vty;
      conval = con;
      len = l;
 }
 
-Value::Value(ValueTy vty, bitset<64> bs) : opr(NULL)
-{
-     id = ++idseed;
-     valty = vty;
-     bsconval = bs;
-     len = 64;
-}
-
-Value::Value(ValueTy vty, Operation *oper)
+Value::Value(ValueTy vty, Operation *oper) : conval(0)
 {
-     id = ++idseed;
+     id = 0;
+     tainted = false;
      valty = vty;
      opr = oper;
      len = 64;
 }
 
-Value::Value(ValueTy vty, Operation *oper, int l)
+Value::Value(ValueTy vty, Operation *oper, int l) : conval(0)
 {
-     id = ++idseed;
+     id = 0;
+     tainted = false;
      valty = vty;
      opr = oper;
      len = l;
@@ -118,34 +117,28 @@ bool Value::isConcrete()
      else
           return false;
 }
-bool Value::isHybrid()
-{
-     if (this->valty == HYBRID)
-          return true;
-     else
-          return false;
-}
-
 
 string getValueName(Value *v)
 {
      if (v->valty == SYMBOL)
           return "sym" + to_string(v->id);
-     else
-          return v->conval;
+
+     char buf[24];
+     snprintf(buf, sizeof(buf), "0x%llx", (unsigned long long)v->conval);
+     return buf;
 }
 
 // An operation taking several values to calculate a result value
 struct Operation {
-     string opty;
+     OperTy opty;
      Value *val[3];
 
-     Operation(string opt, Value *v1);
-     Operation(string opt, Value *v1, Value *v2);
-     Operation(string opt, Value *v1, Value *v2, Value *v3);
+     Operation(OperTy opt, Value *v1);
+     Operation(OperTy opt, Value *v1, Value *v2);
+     Operation(OperTy opt, Value *v1, Value *v2, Value *v3);
 };
 
-Operation::Operation(string opt, Value *v1)
+Operation::Operation(OperTy opt, Value *v1)
 {
      opty = opt;
      val[0] = v1;
@@ -153,7 +146,7 @@ Operation::Operation(string opt, Value *v1)
      val[2] = NULL;
 }
 
-Operation::Operation(string opt, Value *v1, Value *v2)
+Operation::Operation(OperTy opt, Value *v1, Value *v2)
 {
      opty = opt;
      val[0] = v1;
@@ -161,7 +154,7 @@ Operation::Operation(string opt, Value *v1, Value *v2)
      val[2] = NULL;
 }
 
-Operation::Operation(string opt, Value *v1, Value *v2, Value *v3)
+Operation::Operation(OperTy opt, Value *v1, Value *v2, Value *v3)
 {
      opty = opt;
      val[0] = v1;
@@ -169,74 +162,575 @@ Operation::Operation(string opt, Value *v1, Value *v2, Value *v3)
      val[2] = v3;
 }
 
-Value *buildop1(string opty, Value *v1)
+bool OperKey::operator==(const OperKey &other) const
 {
-     Operation *oper = new Operation(opty, v1);
-     Value *result;
+     return opty == other.opty && val[0] == other.val[0] &&
+          val[1] == other.val[1] && val[2] == other.val[2];
+}
 
-     if (v1->isSymbol())
-          result = new Value(SYMBOL, oper);
-     else
-          result = new Value(CONCRETE, oper);
+size_t OperKeyHash::operator()(const OperKey &k) const
+{
+     size_t h = k.opty;
+     for (int i = 0; i < 3; ++i)
+          h = h * 31 + hash<Value*>()(k.val[i]);
+     return h;
+}
 
-     return result;
+ADDR64 evalAdd(ADDR64 a, ADDR64 b) { return a + b; }
+ADDR64 evalSub(ADDR64 a, ADDR64 b) { return a - b; }
+ADDR64 evalImul(ADDR64 a, ADDR64 b) { return a * b; }
+ADDR64 evalAnd(ADDR64 a, ADDR64 b) { return a & b; }
+ADDR64 evalOr(ADDR64 a, ADDR64 b) { return a | b; }
+ADDR64 evalXor(ADDR64 a, ADDR64 b) { return a ^ b; }
+ADDR64 evalNeg(ADDR64 a, ADDR64 b) { return ~a + 1; }
+ADDR64 evalNot(ADDR64 a, ADDR64 b) { return ~a; }
+ADDR64 evalInc(ADDR64 a, ADDR64 b) { return a + 1; }
+ADDR64 evalDec(ADDR64 a, ADDR64 b) { return a - 1; }
+ADDR64 evalBswap(ADDR64 a, ADDR64 b) { return __builtin_bswap64(a); }
+ADDR64 evalMov(ADDR64 a, ADDR64 b) { return a; }
+
+ADDR64 evalDiv(ADDR64 a, ADDR64 b)
+{
+     if (b == 0) {
+          cerr << "Error: Division by zero." << endl;
+          return 0;
+     }
+     return a / b;
 }
 
-Value *buildop2(string opty, Value *v1, Value *v2)
+ADDR64 evalMod(ADDR64 a, ADDR64 b)
 {
-     Operation *oper = new Operation(opty, v1, v2);
-     Value *result;
-     if (v1->isSymbol() || v2->isSymbol())
-          result = new Value(SYMBOL, oper);
-     else
-          result = new Value(CONCRETE, oper);
+     if (b == 0) {
+          cerr << "Error: Modulus by zero." << endl;
+          return 0;
+     }
+     return a % b;
+}
 
-     return result;
+// Shifts by 64 or more behave as bit-vector shifts: everything is shifted out
+ADDR64 evalShl(ADDR64 a, ADDR64 b) { return b >= 64 ? 0 : a << b; }
+ADDR64 evalShr(ADDR64 a, ADDR64 b) { return b >= 64 ? 0 : a >> b; }
+ADDR64 evalSar(ADDR64 a, ADDR64 b) { return (ADDR64)((int64_t)a >> (b >= 64 ? 63 : b)); }
+
+// Properties of each operator, indexed by OperTy. In CVC an operation is
+// printed as cvcpre, the operands separated by ", ", then cvcpost; in
+// SMT-LIB2 as smtpre, the operands separated by " ", then smtpost.
+struct OperInfo {
+     const char *name;                   // name in formulas, also the mnemonic
+     int arity;
+     ADDR64 (*eval)(ADDR64, ADDR64);
+     const char *cvcpre;
+     const char *cvcpost;
+     const char *smtpre;
+     const char *smtpost;
+};
+
+// bvudiv and bvurem differ from evalDiv and evalMod for a zero divisor,
+// and so do BVUDIV and BVUREM
+#define CVCBSWAP " IN bs[7:0] @ bs[15:8] @ bs[23:16] @ bs[31:24] @ " \
+     "bs[39:32] @ bs[47:40] @ bs[55:48] @ bs[63:56])"
+#define SMTBSWAP ")) (concat ((_ extract 7 0) bs) ((_ extract 15 8) bs) " \
+     "((_ extract 23 16) bs) ((_ extract 31 24) bs) ((_ extract 39 32) bs) " \
+     "((_ extract 47 40) bs) ((_ extract 55 48) bs) ((_ extract 63 56) bs)))"
+
+static const OperInfo operinfo[OPERNUM] = {
+     {"add",   2, evalAdd,   "BVPLUS(64, ", ")", "(bvadd ",  ")"},
+     {"sub",   2, evalSub,   "BVSUB(64, ",  ")", "(bvsub ",  ")"},
+     {"imul",  2, evalImul,  "BVMULT(64, ", ")", "(bvmul ",  ")"},
+     {"div",   2, evalDiv,   "BVUDIV(",     ")", "(bvudiv ", ")"},
+     {"mod",   2, evalMod,   "BVUREM(",     ")", "(bvurem ", ")"},
+     {"and",   2, evalAnd,   "BVAND(",      ")", "(bvand ",  ")"},
+     {"or",    2, evalOr,    "BVOR(",       ")", "(bvor ",   ")"},
+     {"xor",   2, evalXor,   "BVXOR(",      ")", "(bvxor ",  ")"},
+     {"shl",   2, evalShl,   "BVSHL(",      ")", "(bvshl ",  ")"},
+     {"shr",   2, evalShr,   "BVLSHR(",     ")", "(bvlshr ", ")"},
+     {"sar",   2, evalSar,   "BVASHR(",     ")", "(bvashr ", ")"},
+     {"neg",   1, evalNeg,   "BVNEG(",      ")", "(bvneg ",  ")"},
+     {"not",   1, evalNot,   "BVNOT(",      ")", "(bvnot ",  ")"},
+     {"inc",   1, evalInc,   "BVPLUS(64, ", ", 0hex0000000000000001)", "(bvadd ", " #x0000000000000001)"},
+     {"dec",   1, evalDec,   "BVSUB(64, ",  ", 0hex0000000000000001)", "(bvsub ", " #x0000000000000001)"},
+     {"bswap", 1, evalBswap, "(LET bs = ",  CVCBSWAP, "(let ((bs ", SMTBSWAP},
+     {"mov",   1, evalMov,   "",            "",  "",         ""},
+};
+
+OperTy str2opty(const string &s)
+{
+     if (s == "sal")
+          return SHL;
+     for (int i = 0; i < OPERNUM; ++i) {
+          if (s == operinfo[i].name)
+               return (OperTy)i;
+     }
+     return OPERNUM;
 }
 
-// Currently there is no 3-operand operation,
-// it is reserved for future.
-Value *buildop3(string opty, Value *v1, Value *v2, Value *v3)
+const char *opty2str(OperTy opty)
 {
-     Operation *oper = new Operation(opty, v1, v2, v3);
-     Value *result;
+     return opty < OPERNUM ? operinfo[opty].name : "unknown";
+}
 
-     if (v1->isSymbol() || v2->isSymbol() || v3->isSymbol())
-          result = new Value(SYMBOL, oper);
-     else
-          result = new Value(CONCRETE, oper);
+// One instruction of a compiled formula: slot[dst] = opty(slot[a], slot[b])
+struct CodeInst {
+     OperTy opty;
+     int dst, a, b;
+};
 
-     return result;
+// A formula compiled to straight-line code over an array of slots. The
+// first slots hold the inputs, in the order of getInputVector(), then the
+// constants, then one result per operation in topological order.
+struct FormulaCode {
+     vector<Value*> inputs;
+     vector<ADDR64> inmask;      // narrow inputs are zero-extended
+     vector<ADDR64> consts;
+     vector<CodeInst> code;
+     int nslots;
+     int result;                 // slot of the formula's value
+};
+
+// The effect of one straight-line block, compiled from a child engine run on
+// one execution of it. Slots 0-15 hold the registers at entry, then come
+// the memory loads, the constants and one slot per operation. Loads are
+// done before any store, stores are replayed in their original order.
+struct BlockSummary {
+     struct Load { int access; int offset; int nbyte; Value *sym; };
+     struct Store { int access; Value *val; int slot; };
+
+     bool ok;                            // false if the block cannot be summarized
+     list<Inst>::iterator begin, end;    // the execution it was built from
+     vector<MemAccess> accesses;
+     vector<ADDR64> addrs;               // address of each access in that execution
+     vector<Load> loads;
+     vector<Store> stores;
+     vector<ADDR64> consts;
+     vector<CodeInst> code;
+     int regout[16];
+     int nslots;
+};
+
+NodeLayer::NodeLayer() : base(0)
+{
+}
+
+NodeLayer::NodeLayer(const shared_ptr<NodeLayer> &below)
+     : parent(below), base(below->base + below->values.size())
+{
 }
 
+NodeLayer::~NodeLayer()
+{
+}
 
 // ********************************
 //  Class SEEngine Implementation
 // ********************************
 
-// return the concrete value in a register
-ADDR64 SEEngine::getRegConVal(string reg)
-{
-     if (reg == "rax")
-          return ip->ctxreg[0];
-     else if (reg == "rbx")
-          return ip->ctxreg[1];
-     else if (reg == "rcx")
-          return ip->ctxreg[2];
-     else if (reg == "rdx")
-          return ip->ctxreg[3];
-     else if (reg == "rsi")
-          return ip->ctxreg[4];
-     else if (reg == "rdi")
-          return ip->ctxreg[5];
-     else if (reg == "rsp")
-          return ip->ctxreg[6];
-     else if (reg == "rbp")
-          return ip->ctxreg[7];
-     else {
-          cerr << "now only get 64-bit register's concrete value." << endl;
+SEEngine::SEEngine() : lastpageno(0), lastpage(NULL), lastowned(false),
+                       nodes(make_shared<NodeLayer>()), tracedep(false), nunknown(0),
+                       concolic(false), nmismatch(0), summarize(false), building(NULL),
+                       ipno(0), nsummarized(0), nskipped(0), cpdepth(0), cpsize(0),
+                       cpinterval(0),
+                       sincecp(0), nconcretized(0), nmba(0)
+{
+     for (int i = 0; i < 16; ++i)
+          ctx[i] = cpctx[i] = NULL;
+}
+
+SEEngine::~SEEngine()
+{
+     for (auto const &x : codecache)
+          delete x.second;
+     for (auto const &x : summaries) {
+          for (size_t i = 0; i < x.second.size(); ++i)
+               delete x.second[i];
+     }
+}
+
+// A new engine continuing from the state of this one. The nodes made so
+// far go to a frozen layer under both engines, and the memory pages are
+// shared until one of them writes. Compiled code and block summaries are
+// not shared: they are rebuilt by the fork as needed.
+SEEngine *SEEngine::fork()
+{
+     nodes = make_shared<NodeLayer>(nodes);
+     for (auto &x : pages)
+          x.second.owned = false;
+     lastpage = NULL;
+
+     SEEngine *f = new SEEngine();
+     f->nodes = make_shared<NodeLayer>(nodes->parent);
+     for (int i = 0; i < 16; ++i) {
+          f->ctx[i] = ctx[i];
+          f->cpctx[i] = cpctx[i];
+     }
+     f->start = start;
+     f->end = end;
+     f->ip = ip;
+     f->pages = pages;
+     f->meminput = meminput;
+     f->reginput = reginput;
+     f->unknowninput = unknowninput;
+     f->callret = callret;
+     f->warned = warned;
+     f->tracedep = tracedep;
+     f->nunknown = nunknown;
+     f->concolic = concolic;
+     f->symregs = symregs;
+     f->symmems = symmems;
+     f->shadow = shadow;
+     f->nmismatch = nmismatch;
+     f->summarize = summarize;
+     f->slice = slice;
+     f->nskipped = nskipped;
+     f->cpdepth = cpdepth;
+     f->cpsize = cpsize;
+     f->cpinterval = cpinterval;
+     f->sincecp = sincecp;
+     f->cpinput = cpinput;
+     f->nconcretized = nconcretized;
+     return f;
+}
+
+// A fresh symbol, never shared
+Value *SEEngine::buildsym(int len)
+{
+     Value *v = nodes->values.alloc(SYMBOL, len);
+     v->id = nodeCount();
+     return v;
+}
+
+// A concrete leaf, shared by all uses of the same value
+Value *SEEngine::buildconst(ADDR64 con)
+{
+     for (NodeLayer *l = nodes.get(); l != NULL; l = l->parent.get()) {
+          unordered_map<ADDR64, Value*>::iterator it = l->concache.find(con);
+          if (it != l->concache.end())
+               return it->second;
+     }
+
+     Value *v = nodes->values.alloc(CONCRETE, con);
+     v->id = nodeCount();
+     nodes->concache.insert(pair<ADDR64, Value*>(con, v));
+     return v;
+}
+
+// A concrete leaf from a hex immediate in the trace
+Value *SEEngine::buildconst(string con)
+{
+     return buildconst((ADDR64)stoull(con, 0, 16));
+}
+
+// Is v a concrete leaf? Its value is stored in *c.
+static bool isconst(Value *v, ADDR64 *c)
+{
+     if (v == NULL || v->opr != NULL || v->valty != CONCRETE)
+          return false;
+     *c = v->conval;
+     return true;
+}
+
+// Is v the operation opty with a concrete leaf as second operand?
+static bool isopconst(Value *v, OperTy opty, Value **x, ADDR64 *c)
+{
+     if (v == NULL || v->opr == NULL || v->opr->opty != opty)
+          return false;
+     *x = v->opr->val[0];
+     return isconst(v->opr->val[1], c);
+}
+
+static bool iscommutative(OperTy opty)
+{
+     return opty == ADD || opty == IMUL || opty == AND || opty == OR || opty == XOR;
+}
+
+// Bits of v that may be nonzero. Only looks a few levels deep; anything it
+// does not understand may have all bits set.
+static ADDR64 nonzerobits(Value *v, int depth = 6)
+{
+     ADDR64 c;
+     if (isconst(v, &c))
+          return c;
+     if (v != NULL && v->opr == NULL && v->len < 64)
+          return ((ADDR64)1 << v->len) - 1;     // narrow symbols are zero-extended
+     if (v == NULL || v->opr == NULL || depth == 0)
+          return ~(ADDR64)0;
+
+     Operation *op = v->opr;
+     switch (op->opty) {
+     case AND:
+          return nonzerobits(op->val[0], depth - 1) & nonzerobits(op->val[1], depth - 1);
+     case OR:
+     case XOR:
+          return nonzerobits(op->val[0], depth - 1) | nonzerobits(op->val[1], depth - 1);
+     case SHL:
+          if (isconst(op->val[1], &c))
+               return c >= 64 ? 0 : nonzerobits(op->val[0], depth - 1) << c;
+          return ~(ADDR64)0;
+     case SHR:
+          if (isconst(op->val[1], &c))
+               return c >= 64 ? 0 : nonzerobits(op->val[0], depth - 1) >> c;
+          return ~(ADDR64)0;
+     default:
+          return ~(ADDR64)0;
+     }
+}
+
+// Rewrite an operation before it is built. Returns the resulting node if a
+// rule applies; otherwise the key may be put into canonical form (constant
+// operand on the right, other operands ordered by id) and NULL is returned.
+// All values are treated as 64-bit, as elsewhere in the engine.
+Value *SEEngine::simplify(OperKey &key)
+{
+     Value *a = key.val[0], *b = key.val[1];
+     const OperInfo *info = &operinfo[key.opty];
+     ADDR64 ca = 0, cb = 0, c = 0;
+     Value *x;
+
+     if (a == NULL || (info->arity == 2 && b == NULL))
+          return NULL;
+
+     bool aconst = isconst(a, &ca);
+     bool bconst = info->arity == 2 && isconst(b, &cb);
+
+     // Constant folding
+     if (aconst && (info->arity == 1 || bconst)) {
+          if ((key.opty == DIV || key.opty == MOD) && cb == 0)
+               return NULL;
+          return buildconst(info->eval(ca, cb));
+     }
+
+     if (iscommutative(key.opty) &&
+         (aconst || (!bconst && b->id < a->id))) {
+          swap(key.val[0], key.val[1]);
+          swap(a, b);
+          swap(aconst, bconst);
+          swap(ca, cb);
+     }
+
+     switch (key.opty) {
+     case MOV:
+          return a;
+     case NOT:
+          if (a->opr != NULL && a->opr->opty == NOT)
+               return a->opr->val[0];
+          return NULL;
+     case NEG:
+          if (a->opr != NULL && a->opr->opty == NEG)
+               return a->opr->val[0];
+          return NULL;
+     case INC:
+          return buildop2(ADD, a, buildconst(1));
+     case DEC:
+          return buildop2(ADD, a, buildconst(~(ADDR64)0));
+
+     case ADD:
+          if (bconst && cb == 0)
+               return a;
+          if (bconst && isopconst(a, ADD, &x, &c))
+               return buildop2(ADD, x, buildconst(c + cb));
+          if (a->opr != NULL && a->opr->opty == SUB && a->opr->val[1] == b)
+               return a->opr->val[0];                           // (x-y)+y
+          if (b->opr != NULL && b->opr->opty == SUB && b->opr->val[1] == a)
+               return b->opr->val[0];
+          return NULL;
+     case SUB:
+          if (a == b)
+               return buildconst(0);
+          if (bconst)
+               return buildop2(ADD, a, buildconst(-cb));
+          if (aconst && ca == 0)
+               return buildop1(NEG, b);
+          if (a->opr != NULL && a->opr->opty == ADD) {           // (x+y)-y
+               if (a->opr->val[1] == b)
+                    return a->opr->val[0];
+               if (a->opr->val[0] == b)
+                    return a->opr->val[1];
+          }
+          return NULL;
+     case IMUL:
+          if (bconst && cb == 0)
+               return b;
+          if (bconst && cb == 1)
+               return a;
+          if (bconst && isopconst(a, IMUL, &x, &c))
+               return buildop2(IMUL, x, buildconst(c * cb));
+          return NULL;
+
+     case AND:
+          if (a == b)
+               return a;
+          if (bconst) {
+               if (cb == 0)
+                    return b;
+               if ((nonzerobits(a) & ~cb) == 0)                  // mask changes nothing
+                    return a;
+               if (isopconst(a, AND, &x, &c))
+                    return buildop2(AND, x, buildconst(c & cb));
+               // Drop an operand of an or/xor that has no bits under the mask
+               if (a->opr != NULL && (a->opr->opty == OR || a->opr->opty == XOR)) {
+                    if ((nonzerobits(a->opr->val[0]) & cb) == 0)
+                         return buildop2(AND, a->opr->val[1], b);
+                    if ((nonzerobits(a->opr->val[1]) & cb) == 0)
+                         return buildop2(AND, a->opr->val[0], b);
+               }
+          }
+          return NULL;
+     case OR:
+          if (a == b)
+               return a;
+          if (bconst && cb == 0)
+               return a;
+          if (bconst && cb == ~(ADDR64)0)
+               return b;
+          if (bconst && isopconst(a, OR, &x, &c))
+               return buildop2(OR, x, buildconst(c | cb));
+          {
+               // (x & m1) | (x & m2) -> x & (m1 | m2)
+               Value *y;
+               ADDR64 c2;
+               if (isopconst(a, AND, &x, &c) && isopconst(b, AND, &y, &c2) && x == y)
+                    return buildop2(AND, x, buildconst(c | c2));
+          }
+          return NULL;
+     case XOR:
+          if (a == b)
+               return buildconst(0);
+          if (bconst && cb == 0)
+               return a;
+          if (bconst && cb == ~(ADDR64)0)
+               return buildop1(NOT, a);
+          if (bconst && isopconst(a, XOR, &x, &c))
+               return buildop2(XOR, x, buildconst(c ^ cb));
+          if (a->opr != NULL && a->opr->opty == XOR) {           // (x^y)^y
+               if (a->opr->val[1] == b)
+                    return a->opr->val[0];
+               if (a->opr->val[0] == b)
+                    return a->opr->val[1];
+          }
+          if (b->opr != NULL && b->opr->opty == XOR) {
+               if (b->opr->val[1] == a)
+                    return b->opr->val[0];
+               if (b->opr->val[0] == a)
+                    return b->opr->val[1];
+          }
+          return NULL;
+
+     case SHL:
+     case SHR:
+          if (!bconst)
+               return NULL;
+          if (cb == 0)
+               return a;
+          if (cb >= 64)
+               return buildconst(0);
+          if (isopconst(a, key.opty, &x, &c))                   // (x<<c1)<<c2
+               return buildop2(key.opty, x, buildconst(c + cb));
+          if (key.opty == SHR && isopconst(a, SHL, &x, &c) && c == cb)
+               return buildop2(AND, x, buildconst(~(ADDR64)0 >> cb));
+          if (key.opty == SHL && isopconst(a, SHR, &x, &c) && c == cb)
+               return buildop2(AND, x, buildconst(~(ADDR64)0 << cb));
+          // Move masks outside of shifts so that they can merge with others
+          if (isopconst(a, AND, &x, &c)) {
+               ADDR64 m = key.opty == SHL ? c << cb : c >> cb;
+               return buildop2(AND, buildop2(key.opty, x, b), buildconst(m));
+          }
+          return NULL;
+     case SAR:
+          if (!bconst)
+               return NULL;
+          if (cb == 0)
+               return a;
+          if (cb > 63)
+               return buildop2(SAR, a, buildconst(63));
+          return NULL;
+
+     default:
+          return NULL;
+     }
+}
+
+// Return the node for key, creating it only if no identical node exists
+Value *SEEngine::buildop(OperKey &key)
+{
+     Value *simple = simplify(key);
+     if (simple != NULL)
+          return simple;
+
+     for (NodeLayer *l = nodes.get(); l != NULL; l = l->parent.get()) {
+          unordered_map<OperKey, Value*, OperKeyHash>::iterator it = l->opcache.find(key);
+          if (it != l->opcache.end())
+               return it->second;
+     }
+
+     Operation *oper = nodes->opers.alloc(key.opty, key.val[0], key.val[1], key.val[2]);
+     bool sym = false;
+     for (int i = 0; i < 3; ++i) {
+          if (key.val[i] != NULL && key.val[i]->isSymbol())
+               sym = true;
+     }
+     Value *result = nodes->values.alloc(sym ? SYMBOL : CONCRETE, oper);
+     result->id = nodeCount();
+     nodes->opcache.insert(pair<OperKey, Value*>(key, result));
+
+     if (concolic) {
+          for (int i = 0; i < 3; ++i) {
+               if (key.val[i] != NULL && key.val[i]->tainted)
+                    result->tainted = true;
+          }
+          if (result->tainted)
+               computeShadow(result);
+     }
+     return result;
+}
+
+Value *SEEngine::buildop1(OperTy opty, Value *v1)
+{
+     OperKey key = {opty, {v1, NULL, NULL}};
+     return buildop(key);
+}
+
+Value *SEEngine::buildop2(OperTy opty, Value *v1, Value *v2)
+{
+     OperKey key = {opty, {v1, v2, NULL}};
+     return buildop(key);
+}
+
+// Currently there is no 3-operand operation,
+// it is reserved for future.
+Value *SEEngine::buildop3(OperTy opty, Value *v1, Value *v2, Value *v3)
+{
+     OperKey key = {opty, {v1, v2, v3}};
+     return buildop(key);
+}
+
+static ADDR64 widthmask(int bit)
+{
+     return bit >= 64 ? ~(ADDR64)0 : ((ADDR64)1 << bit) - 1;
+}
+
+// return the concrete value in a register before the current instruction.
+// Results computed from it hold only for this trace, so tracedep is set.
+ADDR64 SEEngine::getRegConVal(Register reg)
+{
+     const RegAlias &ra = regalias(reg);
+     if (ra.parent == UNK) {
+          cerr << "getRegConVal: unknown register " << reg2string(reg) << endl;
           return 0;
      }
+     tracedep = true;
+     return (ip->ctxreg[ra.parent] >> ra.offset) & widthmask(ra.width);
+}
+
+// The concrete value of a register after the current instruction. It is only
+// known if the next instruction is inside the execution range.
+bool SEEngine::getNextRegConVal(Register reg, ADDR64 *val)
+{
+     const RegAlias &ra = regalias(reg);
+     list<Inst>::iterator nx = next(ip);
+     if (nx == end || ra.parent == UNK)
+          return false;
+     tracedep = true;
+     *val = (nx->ctxreg[ra.parent] >> ra.offset) & widthmask(ra.width);
+     return true;
 }
 
 // Calculate the address in a memory operand
@@ -247,8 +741,8 @@ ADDR64 SEEngine::calcAddr(Operand *opr)
      switch (opr->tag)
      {
      case 7:                    // addr7 = r1 + r2*n + c
-          r1 = getRegConVal(opr->field[0]);
-          r2 = getRegConVal(opr->field[1]);
+          r1 = getRegConVal(opr->reg[0]);
+          r2 = getRegConVal(opr->reg[1]);
           n  = stoi(opr->field[2]);
           c  = stoull(opr->field[4], 0, 16);
           if (opr->field[3] == "+")
@@ -260,7 +754,7 @@ ADDR64 SEEngine::calcAddr(Operand *opr)
                return 0;
           }
      case 4:                    // addr4 = r1 + c
-          r1 = getRegConVal(opr->field[0]);
+          r1 = getRegConVal(opr->reg[0]);
           c = stoull(opr->field[2], 0, 16);
           if (opr->field[1] == "+")
                return r1 + c;
@@ -271,12 +765,12 @@ ADDR64 SEEngine::calcAddr(Operand *opr)
                return 0;
           }
      case 5:                    // addr5 = r1 + r2*n
-          r1 = getRegConVal(opr->field[0]);
-          r2 = getRegConVal(opr->field[1]);
+          r1 = getRegConVal(opr->reg[0]);
+          r2 = getRegConVal(opr->reg[1]);
           n  = stoi(opr->field[2]);
           return r1 + r2*n;
      case 6:                    // addr6 = r2*n + c
-          r2 = getRegConVal(opr->field[0]);
+          r2 = getRegConVal(opr->reg[1]);
           n = stoi(opr->field[1]);
           c = stoull(opr->field[3], 0, 16);
           if (opr->field[2] == "+")
@@ -288,14 +782,14 @@ ADDR64 SEEngine::calcAddr(Operand *opr)
                return 0;
           }
      case 3:                    // addr3 = r2*n
-          r2 = getRegConVal(opr->field[0]);
+          r2 = getRegConVal(opr->reg[1]);
           n = stoi(opr->field[1]);
           return r2*n;
      case 1:                    // addr1 = c
           c = stoull(opr->field[0], 0, 16);
           return c;
      case 2:                    // addr2 = r1
-          r1 = getRegConVal(opr->field[0]);
+          r1 = getRegConVal(opr->reg[0]);
           return r1;
      default:
           cerr << "unrecognized addr tag" << endl;
@@ -303,293 +797,47 @@ ADDR64 SEEngine::calcAddr(Operand *opr)
      }
 }
 
-bool hasVal(Value *v, int start, int end)
-{
-    BitRange br(start, end);
-    map<BitRange, Value*>::iterator i = v->childs.find(br);
-    if (i == v->childs.end())
-        return false;
-    else
-        return true;
-}
-
-Value* readVal(Value *v, int start, int end)
-{
-    BitRange br(start, end);
-    map<BitRange, Value*>::iterator i = v->childs.find(br);
-    if (i == v->childs.end())
-        return NULL;
-    else
-        return i->second;
-}
-string bs2str(bitset<63> bs, BitRange br){
-     int start = br.first, end = br.second;
-     unsinged long long int ui = 0, step = 1;
-     for (int i = start; i <= end; ++i, step *= 2) {
-          ui += bs[i] * step;
-     }
-     stringstream strs;
-     strs << "0x" << hex << ui;   // the number of bits that should shift right
-     string res(strs.str());
-
-     return res;
-}
-
-
-Value *writeVal(Value *from, Value *to, int start, int end)
-{
-     Value *res = new Value(HYBRID);
-     BitRange brfrom(start, end);
-     if (to->isHybrid()) {
-          map<BitRange, Value*>::iterator i = to->childs.find(brfrom);
-          if (i != to->childs.end()) {
-               i->second = from;
-               return to;
-          } else {
-               cerr << "writeVal: no child in to match the from!" << endl;
-               return NULL;
-          }
-     } else if (from->isSymbol() && to->isConcrete()) {
-          int s1 = to->brange.first;
-          int e1 = to->brange.second;
-          Value *v1 = new Value(CONCRETE, to->bsconval);
-          Value *v2 = new Value(CONCRETE, to->bsconval);
-          v1->brange.first = s1;
-          v1->brange.second = start-1;
-          v1->conval = bs2str(v1->bsconval, v1->brange);
-
-          v2->brange.first = end+1;
-          v2->brange.second = e1;
-          v2->conval = bs2str(v2->bsconval, v2->brange);
-
-          res->childs.insert(pair<BitRange, Value*>(v1->brange, v1));
-          res->childs.insert(pair<BitRange, Value*>(brfrom, from));
-          res->childs.insert(pair<BitRange, Value*>(v2->brange, v2));
-
-
-          return res;
-     } else {
-          cerr << "writeVal: the case is missing!" << endl;
-          return NULL;
-     }
-}
-
-Value* SEEngine::readReg(string &s)
+Value* SEEngine::readReg(Register reg)
 {
-    Value* res;
-
-    if (s == "rax" || s == "rbx" || s == "rcx" || s == "rdx" ||
-        s == "rsi" || s == "rdi" || s == "rsp" || s == "rbp" ||
-        s == "r8"  || s == "r9"  || s == "r10" || s == "r11" ||
-        s == "r12" || s == "r13" || s == "r14" || s == "r15") {
-        return ctx[s];  // Return the full 64-bit register value
-    }
-
-    // Handle 32-bit sub-registers
-    if (s == "eax" || s == "ebx" || s == "ecx" || s == "edx" ||
-        s == "esi" || s == "edi" || s == "esp" || s == "ebp" ||
-        s == "r8d" || s == "r9d" || s == "r10d" || s == "r11d" ||
-        s == "r12d" || s == "r13d" || s == "r14d" || s == "r15d") {
-        return buildop1("and", ctx["r" + s.substr(1)], new Value(CONCRETE, "0xFFFFFFFF"));  // Mask lower 32 bits
-    }
-
-    // Handle 16-bit sub-registers
-    if (s == "ax" || s == "bx" || s == "cx" || s == "dx" ||
-        s == "si" || s == "di" || s == "bp" || s == "sp" ||
-        s == "r8w" || s == "r9w" || s == "r10w" || s == "r11w" ||
-        s == "r12w" || s == "r13w" || s == "r14w" || s == "r15w") {
-        return buildop1("and", ctx["r" + s.substr(1)], new Value(CONCRETE, "0xFFFF"));  // Mask lower 16 bits
-    }
-
-    // Handle 8-bit low sub-registers
-    if (s == "al" || s == "bl" || s == "cl" || s == "dl" ||
-        s == "sil" || s == "dil" || s == "bpl" || s == "spl" ||
-        s == "r8b" || s == "r9b" || s == "r10b" || s == "r11b" ||
-        s == "r12b" || s == "r13b" || s == "r14b" || s == "r15b") {
-        return buildop1("and", ctx["r" + s.substr(1)], new Value(CONCRETE, "0xFF"));  // Mask lower 8 bits
+    const RegAlias &ra = regalias(reg);
+    if (ra.parent == UNK) {
+        cerr << "Unknown register name: " << reg2string(reg) << endl;
+        return nullptr;
     }
 
-    // Handle 8-bit high sub-registers (ah, bh, ch, dh)
-    if (s == "ah" || s == "bh" || s == "ch" || s == "dh") {
-        string rname = "r" + s.substr(0, 1) + "x";  // Get corresponding 64-bit register
-        Value* v0 = buildop1("and", ctx[rname], new Value(CONCRETE, "0xFF00"));  // Mask bits [8:15]
-        return buildop2("shr", v0, new Value(CONCRETE, "8"));  // Shift right by 8 bits
-    }
-
-    cerr << "Unknown register name: " << s << endl;
-    return nullptr;
+    Value *v = ctx[ra.parent];
+    if (ra.width == 64)
+        return v;
+    if (ra.offset != 0)
+        v = buildop2(SHR, v, buildconst(ra.offset));
+    return buildop2(AND, v, buildconst(widthmask(ra.width)));
 }
-void SEEngine::writeReg(string &s, Value *v)
-{
-    if (s == "rax" || s == "rbx" || s == "rcx" || s == "rdx" ||
-        s == "rsi" || s == "rdi" || s == "rsp" || s == "rbp" ||
-        s == "r8"  || s == "r9"  || s == "r10" || s == "r11" ||
-        s == "r12" || s == "r13" || s == "r14" || s == "r15") {
-        ctx[s] = v;  // Directly write the value for 64-bit registers
-        return;
-    }
-
-    // Handle 32-bit sub-registers
-    if (s == "eax" || s == "ebx" || s == "ecx" || s == "edx" ||
-        s == "esi" || s == "edi" || s == "esp" || s == "ebp" ||
-        s == "r8d" || s == "r9d" || s == "r10d" || s == "r11d" ||
-        s == "r12d" || s == "r13d" || s == "r14d" || s == "r15d") {
-        Value *mask = new Value(CONCRETE, "0xFFFFFFFF00000000");  // Mask upper 32 bits
-        Value *regval = buildop2("and", ctx["r" + s.substr(1)], mask);
-        ctx["r" + s.substr(1)] = buildop2("or", regval, v);  // Combine masked register with new value
-        return;
-    }
 
-    // Handle 16-bit sub-registers
-    if (s == "ax" || s == "bx" || s == "cx" || s == "dx" ||
-        s == "si" || s == "di" || s == "bp" || s == "sp" ||
-        s == "r8w" || s == "r9w" || s == "r10w" || s == "r11w" ||
-        s == "r12w" || s == "r13w" || s == "r14w" || s == "r15w") {
-        Value *mask = new Value(CONCRETE, "0xFFFFFFFFFFFF0000");  // Mask upper 48 bits
-        Value *regval = buildop2("and", ctx["r" + s.substr(1)], mask);
-        ctx["r" + s.substr(1)] = buildop2("or", regval, v);  // Combine masked register with new value
+void SEEngine::writeReg(Register reg, Value *v)
+{
+    const RegAlias &ra = regalias(reg);
+    if (ra.parent == UNK) {
+        cerr << "Unknown register name: " << reg2string(reg) << endl;
         return;
     }
 
-    // Handle 8-bit low sub-registers
-    if (s == "al" || s == "bl" || s == "cl" || s == "dl" ||
-        s == "sil" || s == "dil" || s == "bpl" || s == "spl" ||
-        s == "r8b" || s == "r9b" || s == "r10b" || s == "r11b" ||
-        s == "r12b" || s == "r13b" || s == "r14b" || s == "r15b") {
-        Value *mask = new Value(CONCRETE, "0xFFFFFFFFFFFFFF00");  // Mask upper 56 bits
-        Value *regval = buildop2("and", ctx["r" + s.substr(1)], mask);
-        ctx["r" + s.substr(1)] = buildop2("or", regval, v);  // Combine masked register with new value
+    if (ra.width == 64) {
+        ctx[ra.parent] = v;
         return;
     }
-
-    // Handle 8-bit high sub-registers (ah, bh, ch, dh)
-    if (s == "ah" || s == "bh" || s == "ch" || s == "dh") {
-        string rname = "r" + s.substr(0, 1) + "x";  // Get corresponding 64-bit register
-        Value *mask = new Value(CONCRETE, "0xFFFFFFFFFFFF00FF");  // Mask bits [8:15]
-        Value *regval = buildop2("and", ctx[rname], mask);  // Clear bits [8:15]
-        Value *shifted = buildop2("shl", v, new Value(CONCRETE, "8"));  // Shift new value to bits [8:15]
-        ctx[rname] = buildop2("or", regval, shifted);  // Combine masked register with shifted value
+    if (ra.width == 32) {
+        // 32-bit writes clear the upper half
+        ctx[ra.parent] = buildop2(AND, v, buildconst(widthmask(32)));
         return;
     }
 
-    cerr << "Unknown register name: " << s << endl;
-}
-bool SEEngine::issubset(AddrRange ar, AddrRange *superset)
-{
-    for (auto it = mem.begin(); it != mem.end(); ++it) {
-        AddrRange curar = it->first;
-        if (curar.first <= ar.first && curar.second >= ar.second) {
-            superset->first = curar.first;
-            superset->second = curar.second;
-            return true;
-        }
-    }
-    return false;
-}
-bool SEEngine::issuperset(AddrRange ar, AddrRange *subset)
-{
-    for (auto it = mem.begin(); it != mem.end(); ++it) {
-        AddrRange curar = it->first;
-        if (curar.first >= ar.first && curar.second <= ar.second) {
-            subset->first = curar.first;
-            subset->second = curar.second;
-            return true;
-        }
-    }
-    return false;
-}
-bool SEEngine::isnew(AddrRange ar)
-{
-    for (auto it = mem.begin(); it != mem.end(); ++it) {
-        AddrRange curar = it->first;
-        if ((curar.first <= ar.first && curar.second >= ar.first) ||  // Overlaps at the start
-            (curar.first <= ar.second && curar.second >= ar.second)) { // Overlaps at the end
-            return false;
-        }
-    }
-    return true;
-}
-Value* SEEngine::readMem(ADDR64 addr)
-{
-    ADDR64 end = addr + 7;  // 64-bit value spans 8 bytes
-
-    AddrRange ar(addr, end), res;
-
-    if (memfind(ar)) return mem[ar];  // If the exact range exists, return the value
-
-    if (isnew(ar)) {
-        Value *v = new Value(SYMBOL, 8);  // Create a new symbolic value for 8 bytes
-        mem[ar] = v;
-        meminput[v] = ar;
-        return v;
-    } else if (issubset(ar, &res)) {
-        ADDR64 b1 = ar.first, e1 = ar.second;
-        ADDR64 b2 = res.first, e2 = res.second;
-        string mask = "0x";
-
-        for (ADDR64 i = e2; i >= b2; --i) {  // Create a mask for the desired range
-            if (i >= b1 && i <= e1)
-                mask += "ff";
-            else
-                mask += "00";
-        }
-
-        stringstream strs;
-        strs << "0x" << hex << (b1 - b2) * 8;  // Compute shift amount
-        string low0(strs.str());
-
-        Value *v0 = mem[res];
-        Value *v1 = new Value(CONCRETE, mask);
-        Value *v2 = buildop2("and", v0, v1);
-        Value *v3 = new Value(CONCRETE, low0);
-        Value *v4 = buildop2("shr", v2, v3);  // Shift right to extract the value
-
-        return v4;
-    } else {
-        cerr << "readMem64: Partial overlapping symbolic memory access is not implemented yet!" << endl;
-        return NULL;
-    }
-}
-
-void SEEngine::writeMem(ADDR64 addr, Value *v)
-{
-    ADDR64 end = addr + 7;  // 64-bit value spans 8 bytes
-    AddrRange ar(addr, end), res;
-
-    if (memfind(ar) || isnew(ar)) {  // If exact match or new range
-        mem[ar] = v;
-        return;
-    } else if (issuperset(ar, &res)) {  // If the new range is a superset of an existing range
-        mem.erase(res);
-        mem[ar] = v;
-        return;
-    } else if (issubset(ar, &res)) {  // If the new range is a subset of an existing range
-        ADDR64 b1 = ar.first, e1 = ar.second;
-        ADDR64 b2 = res.first, e2 = res.second;
-
-        string mask = "0x";  // Mask to clear bits in the old value
-        for (ADDR64 i = e2; i >= b2; --i) {
-            if (i >= b1 && i <= e1)
-                mask += "00";
-            else
-                mask += "ff";
-        }
-
-        stringstream strs;
-        strs << "0x" << hex << (b1 - b2) * 8;
-        string low0(strs.str());  // Compute shift amount
-
-        Value *v0 = mem[res];
-        Value *v1 = new Value(CONCRETE, mask);
-        Value *v2 = buildop2("and", v0, v1);
-        Value *v3 = new Value(CONCRETE, low0);
-        Value *v4 = buildop2("shl", v, v3);  // Shift left the new value to the correct position
-        Value *v5 = buildop2("or", v2, v4);  // Combine old and new values
-        mem[res] = v5;
-        return;
-    } else {
-        cerr << "writeMem64: Partial overlapping symbolic memory access is not implemented yet!" << endl;
-    }
+    // Clear the bits of the sub-register and merge in the new value
+    ADDR64 mask = widthmask(ra.width) << ra.offset;
+    Value *regval = buildop2(AND, ctx[ra.parent], buildconst(~mask));
+    Value *newval = buildop2(AND, v, buildconst(widthmask(ra.width)));
+    if (ra.offset != 0)
+        newval = buildop2(SHL, newval, buildconst(ra.offset));
+    ctx[ra.parent] = buildop2(OR, regval, newval);
 }
 
 void SEEngine::init(Value *rax, Value *rbx, Value *rcx, Value *rdx,
@@ -600,22 +848,22 @@ void SEEngine::init(Value *rax, Value *rbx, Value *rcx, Value *rdx,
                     list<Inst>::iterator it2)
 {
     // Initialize 64-bit registers
-    ctx["rax"] = rax;
-    ctx["rbx"] = rbx;
-    ctx["rcx"] = rcx;
-    ctx["rdx"] = rdx;
-    ctx["rsi"] = rsi;
-    ctx["rdi"] = rdi;
-    ctx["rsp"] = rsp;
-    ctx["rbp"] = rbp;
-    ctx["r8"]  = r8;
-    ctx["r9"]  = r9;
-    ctx["r10"] = r10;
-    ctx["r11"] = r11;
-    ctx["r12"] = r12;
-    ctx["r13"] = r13;
-    ctx["r14"] = r14;
-    ctx["r15"] = r15;
+    ctx[RAX] = rax;
+    ctx[RBX] = rbx;
+    ctx[RCX] = rcx;
+    ctx[RDX] = rdx;
+    ctx[RSI] = rsi;
+    ctx[RDI] = rdi;
+    ctx[RSP] = rsp;
+    ctx[RBP] = rbp;
+    ctx[R8]  = r8;
+    ctx[R9]  = r9;
+    ctx[R10] = r10;
+    ctx[R11] = r11;
+    ctx[R12] = r12;
+    ctx[R13] = r13;
+    ctx[R14] = r14;
+    ctx[R15] = r15;
 
     // Map register values for input tracking
     reginput[rax] = "rax";
@@ -650,308 +898,2011 @@ void SEEngine::init(list<Inst>::iterator it1,
 void SEEngine::initAllRegSymbol(list<Inst>::iterator it1,
                                 list<Inst>::iterator it2)
 {
-    // Create symbolic values for all 64-bit registers
-    Value *rax = new Value(SYMBOL);
-    Value *rbx = new Value(SYMBOL);
-    Value *rcx = new Value(SYMBOL);
-    Value *rdx = new Value(SYMBOL);
-    Value *rsi = new Value(SYMBOL);
-    Value *rdi = new Value(SYMBOL);
-    Value *rsp = new Value(SYMBOL);
-    Value *rbp = new Value(SYMBOL);
-    Value *r8  = new Value(SYMBOL);
-    Value *r9  = new Value(SYMBOL);
-    Value *r10 = new Value(SYMBOL);
-    Value *r11 = new Value(SYMBOL);
-    Value *r12 = new Value(SYMBOL);
-    Value *r13 = new Value(SYMBOL);
-    Value *r14 = new Value(SYMBOL);
-    Value *r15 = new Value(SYMBOL);
-
-    // Initialize context with symbolic values
-    ctx["rax"] = rax;
-    ctx["rbx"] = rbx;
-    ctx["rcx"] = rcx;
-    ctx["rdx"] = rdx;
-    ctx["rsi"] = rsi;
-    ctx["rdi"] = rdi;
-    ctx["rsp"] = rsp;
-    ctx["rbp"] = rbp;
-    ctx["r8"]  = r8;
-    ctx["r9"]  = r9;
-    ctx["r10"] = r10;
-    ctx["r11"] = r11;
-    ctx["r12"] = r12;
-    ctx["r13"] = r13;
-    ctx["r14"] = r14;
-    ctx["r15"] = r15;
-
-    // Map symbolic values for input tracking
-    reginput[rax] = "rax";
-    reginput[rbx] = "rbx";
-    reginput[rcx] = "rcx";
-    reginput[rdx] = "rdx";
-    reginput[rsi] = "rsi";
-    reginput[rdi] = "rdi";
-    reginput[rsp] = "rsp";
-    reginput[rbp] = "rbp";
-    reginput[r8]  = "r8";
-    reginput[r9]  = "r9";
-    reginput[r10] = "r10";
-    reginput[r11] = "r11";
-    reginput[r12] = "r12";
-    reginput[r13] = "r13";
-    reginput[r14] = "r14";
-    reginput[r15] = "r15";
+    // Create symbolic values for all 64-bit registers. In concolic mode
+    // only the chosen ones are symbolic, the rest start from the trace.
+    for (int i = RAX; i <= R15; ++i) {
+        if (concolic && symregs.find((Register)i) == symregs.end()) {
+            ctx[i] = buildconst(it1->ctxreg[i]);
+            continue;
+        }
+        ctx[i] = buildsym();
+        reginput[ctx[i]] = reg2string((Register)i);
+        if (concolic) {
+            ctx[i]->tainted = true;
+            shadow[ctx[i]] = it1->ctxreg[i];
+        }
+    }
+
+    start = it1;
+    end = it2;
+}
+// ********************************
+//  Symbolic memory
+// ********************************
+
+// The page holding addr, NULL if nothing was stored in it yet. A page to
+// write (create) is first copied if it is shared with a fork.
+MemPage *SEEngine::findPage(ADDR64 addr, bool create)
+{
+    ADDR64 pageno = addr >> PAGEBITS;
+    if (lastpage != NULL && lastpageno == pageno && (lastowned || !create))
+        return lastpage;
+
+    unordered_map<ADDR64, PageRef>::iterator it = pages.find(pageno);
+    if (it != pages.end()) {
+        PageRef &ref = it->second;
+        if (create && !ref.owned) {
+            ref.page = make_shared<MemPage>(*ref.page);
+            ref.owned = true;
+        }
+    } else if (create) {
+        PageRef ref = {make_shared<MemPage>(), true};
+        it = pages.insert(make_pair(pageno, ref)).first;
+    } else {
+        return NULL;
+    }
+
+    lastpageno = pageno;
+    lastpage = it->second.page.get();
+    lastowned = it->second.owned;
+    return lastpage;
+}
+
+MemByte *SEEngine::findByte(ADDR64 addr, bool create)
+{
+    MemPage *page = findPage(addr, create);
+    if (page == NULL)
+        return NULL;
+    if (create)
+        page->dirty = true;
+    return &page->bytes[addr & (PAGESIZE - 1)];
+}
+
+// Bytes [idx, idx+n) of v as the low bytes of a value
+Value *SEEngine::extract(Value *v, int idx, int n)
+{
+    if (idx == 0 && v->len <= n * 8)
+        return v;
+    if (idx != 0)
+        v = buildop2(SHR, v, buildconst(idx * 8));
+    return truncate(v, n * 8);
+}
+
+Value *SEEngine::readMem(ADDR64 addr, int nbyte)
+{
+    MemByte b[8];
+
+    if (nbyte <= 0 || nbyte > 8) {
+        cerr << "readMem: unsupported access size " << nbyte << endl;
+        return NULL;
+    }
+
+    if (building != NULL) {
+        MemAccess ma = {ipno, false, (int64_t)(addr - ip->raddr), nbyte};
+        building->accesses.push_back(ma);
+        building->addrs.push_back(addr);
+    }
+
+    for (int i = 0; i < nbyte; ++i) {
+        MemByte *mb = findByte(addr + i, false);
+        b[i] = mb != NULL ? *mb : MemByte();
+    }
+
+    // Bytes never seen before are inputs, one symbol for each run of them
+    for (int i = 0; i < nbyte; ) {
+        if (b[i].val != NULL) {
+            ++i;
+            continue;
+        }
+        int n = 1;
+        while (i + n < nbyte && b[i + n].val == NULL)
+            ++n;
+        Value *v = buildsym(n * 8);
+        meminput[v] = AddrRange(addr + i, addr + i + n - 1);
+        if (concolic && isSymMem(addr + i, addr + i + n - 1))
+            v->tainted = true;
+        if (building != NULL) {
+            BlockSummary::Load ld = {(int)building->accesses.size() - 1, i, n, v};
+            building->loads.push_back(ld);
+        }
+        for (int j = 0; j < n; ++j) {
+            MemByte *mb = findByte(addr + i + j, true);
+            mb->val = v;
+            mb->idx = j;
+            b[i + j] = *mb;
+        }
+        i += n;
+    }
+
+    // Concatenate runs of consecutive bytes of the same value
+    Value *res = NULL;
+    for (int i = 0; i < nbyte; ) {
+        int n = 1;
+        while (i + n < nbyte && b[i + n].val == b[i].val && b[i + n].idx == b[i].idx + n)
+            ++n;
+        Value *part = extract(b[i].val, b[i].idx, n);
+        if (i != 0)
+            part = buildop2(SHL, part, buildconst(i * 8));
+        res = res == NULL ? part : buildop2(OR, res, part);
+        i += n;
+    }
+    return res;
+}
+
+void SEEngine::writeMem(ADDR64 addr, int nbyte, Value *v)
+{
+    if (nbyte <= 0 || nbyte > 8) {
+        cerr << "writeMem: unsupported access size " << nbyte << endl;
+        return;
+    }
+    if (building != NULL) {
+        MemAccess ma = {ipno, true, (int64_t)(addr - ip->waddr), nbyte};
+        BlockSummary::Store st = {(int)building->accesses.size(), v, 0};
+        building->accesses.push_back(ma);
+        building->addrs.push_back(addr);
+        building->stores.push_back(st);
+    }
+
+    for (int i = 0; i < nbyte; ++i) {
+        MemByte *mb = findByte(addr + i, true);
+        mb->val = v;
+        mb->idx = i;
+    }
+}
+
+// All values in memory, as maximal ranges of consecutive bytes of one value
+void SEEngine::getMemValues(vector<pair<AddrRange, Value*> > *out)
+{
+    vector<ADDR64> pagenos;
+    for (auto const &x : pages)
+        pagenos.push_back(x.first);
+    sort(pagenos.begin(), pagenos.end());
+
+    MemByte cur;
+    ADDR64 begin = 0, prev = 0;
+    for (size_t p = 0; p < pagenos.size(); ++p) {
+        MemPage *page = pages[pagenos[p]].page.get();
+        for (ADDR64 i = 0; i < PAGESIZE; ++i) {
+            MemByte *mb = &page->bytes[i];
+            ADDR64 addr = (pagenos[p] << PAGEBITS) + i;
+            if (mb->val == NULL)
+                continue;
+            if (cur.val != NULL && mb->val == cur.val && addr == prev + 1 &&
+                mb->idx == cur.idx + (int)(addr - begin)) {
+                prev = addr;
+                continue;
+            }
+            if (cur.val != NULL)
+                out->push_back(make_pair(AddrRange(begin, prev),
+                                         extract(cur.val, cur.idx, prev - begin + 1)));
+            cur = *mb;
+            begin = prev = addr;
+        }
+    }
+    if (cur.val != NULL)
+        out->push_back(make_pair(AddrRange(begin, prev),
+                                 extract(cur.val, cur.idx, prev - begin + 1)));
+}
+
+// ********************************
+//  Instruction semantics
+// ********************************
+
+// Fresh symbol for a result the engine cannot model. It is remembered with
+// the line of the instruction so that it is not mistaken for a real input.
+Value *SEEngine::buildunknown()
+{
+     Value *v = buildsym();
+     unknowninput[v] = ip->id;
+     return v;
+}
+
+Value *SEEngine::truncate(Value *v, int bit)
+{
+     if (bit >= 64)
+          return v;
+     return buildop2(AND, v, buildconst(widthmask(bit)));
+}
+
+// Sign-extend the low bit bits of v to 64 bits
+Value *SEEngine::signext(Value *v, int bit)
+{
+     if (bit >= 64)
+          return v;
+     Value *sh = buildconst(64 - bit);
+     return buildop2(SAR, buildop2(SHL, v, sh), sh);
+}
+
+// Value of an operand, masked to its width
+Value *SEEngine::readOpr(Operand *opr)
+{
+     Value *v = NULL;
+     switch (opr->ty) {
+     case Operand::IMM:
+          return buildconst(opr->field[0]);
+     case Operand::REG:
+          v = readReg(opr->reg[0]);
+          break;
+     case Operand::MEM:
+          v = readMem(ip->raddr, opr->bit / 8);
+          break;
+     }
+     return v != NULL ? v : buildunknown();
+}
+
+void SEEngine::writeOpr(Operand *opr, Value *v)
+{
+     switch (opr->ty) {
+     case Operand::REG:
+          writeReg(opr->reg[0], truncate(v, opr->bit));
+          break;
+     case Operand::MEM:
+          writeMem(ip->waddr, opr->bit / 8, truncate(v, opr->bit));
+          break;
+     default:
+          cerr << "[Error] Line " << ip->id << ": write to an immediate operand" << endl;
+     }
+}
+
+// rsp += n
+void SEEngine::adjustsp(int64_t n)
+{
+     ctx[RSP] = buildop2(ADD, ctx[RSP], buildconst((ADDR64)n));
+}
+
+// Symbolic value of the address in a memory operand. Returns NULL for
+// addresses the parser cannot express, such as rip-relative ones.
+Value *SEEngine::buildAddr(Operand *opr)
+{
+     Value *r1, *r2, *c;
+     int n;
+
+     switch (opr->tag) {
+     case 7:                    // addr7 = r1 + r2*n +- c
+          r1 = readReg(opr->reg[0]);
+          r2 = readReg(opr->reg[1]);
+          n = stoi(opr->field[2]);
+          c = buildconst(opr->field[4]);
+          if (opr->field[3] == "-")
+               c = buildop1(NEG, c);
+          return buildop2(ADD, buildop2(ADD, r1, buildop2(IMUL, r2, buildconst(n))), c);
+     case 4:                    // addr4 = r1 +- c
+          r1 = readReg(opr->reg[0]);
+          c = buildconst(opr->field[2]);
+          return buildop2(opr->field[1] == "-" ? SUB : ADD, r1, c);
+     case 5:                    // addr5 = r1 + r2*n
+          r1 = readReg(opr->reg[0]);
+          r2 = readReg(opr->reg[1]);
+          n = stoi(opr->field[2]);
+          return buildop2(ADD, r1, buildop2(IMUL, r2, buildconst(n)));
+     case 6:                    // addr6 = r2*n +- c
+          r2 = readReg(opr->reg[1]);
+          n = stoi(opr->field[1]);
+          c = buildconst(opr->field[3]);
+          return buildop2(opr->field[2] == "-" ? SUB : ADD, buildop2(IMUL, r2, buildconst(n)), c);
+     case 3:                    // addr3 = r2*n
+          r2 = readReg(opr->reg[1]);
+          n = stoi(opr->field[1]);
+          return buildop2(IMUL, r2, buildconst(n));
+     case 1:                    // addr1 = c
+          return buildconst(opr->field[0]);
+     case 2:                    // addr2 = r1
+          return readReg(opr->reg[0]);
+     default:
+          return NULL;
+     }
+}
+
+bool SEEngine::semNop(Inst *in, const InstSem *sem)
+{
+     return true;
+}
+
+bool SEEngine::semMov(Inst *in, const InstSem *sem)
+{
+     if (in->oprnum != 2)
+          return false;
+     writeOpr(in->oprd[0], readOpr(in->oprd[1]));
+     return true;
+}
+
+bool SEEngine::semMovsx(Inst *in, const InstSem *sem)
+{
+     if (in->oprnum != 2)
+          return false;
+     writeOpr(in->oprd[0], signext(readOpr(in->oprd[1]), in->oprd[1]->bit));
+     return true;
+}
+
+bool SEEngine::semLea(Inst *in, const InstSem *sem)
+{
+     if (in->oprnum != 2 || in->oprd[1]->ty != Operand::MEM)
+          return false;
+
+     Value *v = NULL;
+     if (in->oprs[1].find("rip") == string::npos)
+          v = buildAddr(in->oprd[1]);
+     if (v == NULL) {
+          // The address is a constant, read it from the trace
+          ADDR64 con;
+          if (!getNextRegConVal(in->oprd[0]->reg[0], &con))
+               return false;
+          v = buildconst(con);
+     }
+     writeOpr(in->oprd[0], v);
+     return true;
+}
+
+// add, sub, and, or, xor, shifts and the 2/3-operand forms of imul
+bool SEEngine::semBinary(Inst *in, const InstSem *sem)
+{
+     Operand *dst = in->oprd[0];
+     Value *a, *b;
+
+     if (in->oprnum == 3) {
+          a = readOpr(in->oprd[1]);
+          b = readOpr(in->oprd[2]);
+     } else if (in->oprnum == 2) {
+          a = readOpr(dst);
+          b = readOpr(in->oprd[1]);
+     } else if (in->oprnum == 1 && (sem->opty == SHL || sem->opty == SHR || sem->opty == SAR)) {
+          a = readOpr(dst);
+          b = buildconst(1);
+     } else {
+          return false;
+     }
+
+     if (sem->opty == SHL || sem->opty == SHR || sem->opty == SAR) {
+          b = buildop2(AND, b, buildconst(dst->bit == 64 ? 63 : 31));
+          if (sem->opty == SAR)
+               a = signext(a, dst->bit);
+     }
+     writeOpr(dst, buildop2(sem->opty, a, b));
+     return true;
+}
+
+bool SEEngine::semUnary(Inst *in, const InstSem *sem)
+{
+     if (in->oprnum != 1)
+          return false;
+     writeOpr(in->oprd[0], buildop1(sem->opty, readOpr(in->oprd[0])));
+     return true;
+}
+
+// Concrete value of an operand before the instruction, if the trace has it
+bool SEEngine::getOprConVal(Operand *opr, ADDR64 *val)
+{
+     if (opr->ty == Operand::IMM) {
+          *val = stoull(opr->field[0], 0, 16) & widthmask(opr->bit);
+          return true;
+     }
+     if (opr->ty == Operand::REG) {
+          *val = getRegConVal(opr->reg[0]);
+          return true;
+     }
+     return false;
+}
+
+// adc/sbb: the carry flag is not modelled, so it is recovered from the
+// concrete result in the trace
+bool SEEngine::semCarry(Inst *in, const InstSem *sem)
+{
+     if (in->oprnum != 2 || in->oprd[0]->ty != Operand::REG)
+          return false;
+
+     Operand *dst = in->oprd[0], *src = in->oprd[1];
+     ADDR64 c0, c1, res, mask = widthmask(dst->bit);
+     if (!getOprConVal(dst, &c0) || !getOprConVal(src, &c1) ||
+         !getNextRegConVal(dst->reg[0], &res))
+          return false;
+
+     ADDR64 cf = (sem->opty == ADD ? res - c0 - c1 : c0 - c1 - res) & mask;
+     if (cf > 1)
+          return false;
+
+     Value *v = buildop2(sem->opty, readOpr(dst), readOpr(src));
+     writeOpr(dst, buildop2(sem->opty, v, buildconst(cf)));
+     return true;
+}
+
+// rol/ror, sem->opty is SHL for rol and SHR for ror
+bool SEEngine::semRotate(Inst *in, const InstSem *sem)
+{
+     if (in->oprnum != 2 && in->oprnum != 1)
+          return false;
+
+     Operand *dst = in->oprd[0];
+     int w = dst->bit;
+     Value *v = readOpr(dst);
+     Value *n = in->oprnum == 2 ? readOpr(in->oprd[1]) : buildconst(1);
+
+     n = buildop2(AND, n, buildconst(w == 64 ? 63 : 31));
+     if (w < 32)
+          n = buildop2(MOD, n, buildconst(w));
+
+     OperTy back = sem->opty == SHL ? SHR : SHL;
+     Value *hi = buildop2(sem->opty, v, n);
+     Value *lo = buildop2(back, v, buildop2(SUB, buildconst(w), n));
+     writeOpr(dst, buildop2(OR, hi, lo));
+     return true;
+}
+
+bool SEEngine::semBswap(Inst *in, const InstSem *sem)
+{
+     if (in->oprnum != 1 || in->oprd[0]->ty != Operand::REG || in->oprd[0]->bit < 32)
+          return false;
+
+     Value *v = buildop1(BSWAP, readOpr(in->oprd[0]));
+     if (in->oprd[0]->bit == 32)
+          v = buildop2(SHR, v, buildconst(32));
+     writeOpr(in->oprd[0], v);
+     return true;
+}
+
+bool SEEngine::semXchg(Inst *in, const InstSem *sem)
+{
+     if (in->oprnum != 2)
+          return false;
+
+     Value *a = readOpr(in->oprd[0]);
+     Value *b = readOpr(in->oprd[1]);
+     writeOpr(in->oprd[0], b);
+     writeOpr(in->oprd[1], a);
+     return true;
+}
+
+// cmovcc: flags are not modelled, whether the move happened is read from the
+// destination register in the trace
+bool SEEngine::semCmov(Inst *in, const InstSem *sem)
+{
+     if (in->oprnum != 2 || in->oprd[0]->ty != Operand::REG)
+          return false;
+
+     Operand *dst = in->oprd[0];
+     ADDR64 before, after;
+     if (!getNextRegConVal(dst->reg[0], &after))
+          return false;
+     before = getRegConVal(dst->reg[0]);
+
+     if (before != after)
+          writeOpr(dst, readOpr(in->oprd[1]));
+     else
+          writeOpr(dst, readOpr(dst));
+     return true;
+}
+
+// setcc: the result byte is read from the trace
+bool SEEngine::semSetcc(Inst *in, const InstSem *sem)
+{
+     ADDR64 after;
+     if (in->oprnum != 1 || in->oprd[0]->ty != Operand::REG ||
+         !getNextRegConVal(in->oprd[0]->reg[0], &after))
+          return false;
+     writeOpr(in->oprd[0], buildconst(after));
+     return true;
+}
+
+// Names of the accumulator and its high half for each operand size
+static Register accreg(int bit)
+{
+     return bit == 8 ? AL : bit == 16 ? AX : bit == 32 ? EAX : RAX;
+}
+
+static Register hireg(int bit)
+{
+     return bit == 8 ? AH : bit == 16 ? DX : bit == 32 ? EDX : RDX;
+}
+
+// One-operand mul/imul, sem->opty is IMUL for imul and MOV for mul
+bool SEEngine::semMul(Inst *in, const InstSem *sem)
+{
+     if (in->oprnum != 1)
+          return false;
+
+     int w = in->oprd[0]->bit;
+     Value *a = readReg(accreg(w));
+     Value *b = readOpr(in->oprd[0]);
+     if (sem->opty == IMUL) {
+          a = signext(a, w);
+          b = signext(b, w);
+     }
+
+     Value *prod = buildop2(IMUL, a, b);
+     if (w == 8) {
+          writeReg(AX, truncate(prod, 16));
+     } else if (w < 64) {
+          writeReg(accreg(w), truncate(prod, w));
+          writeReg(hireg(w), truncate(buildop2(SHR, prod, buildconst(w)), w));
+     } else {
+          // The high half of a 128-bit product has no operator
+          writeReg(RAX, prod);
+          writeReg(RDX, buildunknown());
+     }
+     return true;
+}
+
+bool SEEngine::semImul(Inst *in, const InstSem *sem)
+{
+     return in->oprnum == 1 ? semMul(in, sem) : semBinary(in, sem);
+}
+
+// Unsigned div. A 128-bit dividend is only handled when rdx is zero.
+bool SEEngine::semDiv(Inst *in, const InstSem *sem)
+{
+     if (in->oprnum != 1)
+          return false;
+
+     int w = in->oprd[0]->bit;
+     Value *divisor = readOpr(in->oprd[0]);
+     Value *dividend;
+
+     if (w == 8) {
+          dividend = readReg(AX);
+     } else if (w < 64) {
+          Value *hi = readReg(hireg(w));
+          dividend = buildop2(OR, buildop2(SHL, hi, buildconst(w)), readReg(accreg(w)));
+     } else {
+          if (getRegConVal(RDX) != 0)
+               return false;
+          dividend = readReg(RAX);
+     }
+
+     Value *q = buildop2(DIV, dividend, divisor);
+     Value *r = buildop2(MOD, dividend, divisor);
+     if (w == 8) {
+          writeReg(AL, q);
+          writeReg(AH, r);
+     } else {
+          writeReg(accreg(w), truncate(q, w));
+          writeReg(hireg(w), truncate(r, w));
+     }
+     return true;
+}
+
+bool SEEngine::semPush(Inst *in, const InstSem *sem)
+{
+     if (in->oprnum != 1)
+          return false;
+
+     Operand *op = in->oprd[0];
+     int nbyte = op->ty == Operand::IMM ? 8 : op->bit / 8;
+     writeMem(in->waddr, nbyte, readOpr(op));
+     adjustsp(-nbyte);
+     return true;
+}
+
+bool SEEngine::semPop(Inst *in, const InstSem *sem)
+{
+     if (in->oprnum != 1)
+          return false;
+
+     int nbyte = in->oprd[0]->bit / 8;
+     Value *v = readMem(in->raddr, nbyte);
+     adjustsp(nbyte);
+     writeOpr(in->oprd[0], v != NULL ? v : buildunknown());
+     return true;
+}
+
+// pushf/popf: the flags are not modelled
+bool SEEngine::semPushf(Inst *in, const InstSem *sem)
+{
+     writeMem(in->waddr, 8, buildunknown());
+     adjustsp(-8);
+     return true;
+}
+
+bool SEEngine::semPopf(Inst *in, const InstSem *sem)
+{
+     adjustsp(8);
+     return true;
+}
+
+// The return address is taken from the matching ret, found when decoding
+bool SEEngine::semCall(Inst *in, const InstSem *sem)
+{
+     unordered_map<int, ADDR64>::iterator it = callret.find(in->id);
+     writeMem(in->waddr, 8, it != callret.end() ? buildconst(it->second) : buildunknown());
+     adjustsp(-8);
+     return true;
+}
+
+bool SEEngine::semRet(Inst *in, const InstSem *sem)
+{
+     int64_t n = 8;
+     if (in->oprnum == 1 && in->oprd[0]->ty == Operand::IMM)
+          n += stoll(in->oprd[0]->field[0], 0, 16);
+     adjustsp(n);
+     return true;
+}
+
+bool SEEngine::semLeave(Inst *in, const InstSem *sem)
+{
+     Value *v = readMem(in->raddr, 8);
+     ctx[RSP] = buildop2(ADD, ctx[RBP], buildconst(8));
+     ctx[RBP] = v != NULL ? v : buildunknown();
+     return true;
+}
+
+// cbw/cwde/cdqe extend the accumulator in place, cwd/cdq/cqo fill the
+// high register with its sign. sem->nbyte is the source size.
+bool SEEngine::semConvert(Inst *in, const InstSem *sem)
+{
+     int w = sem->nbyte * 8;
+     Value *v = signext(readReg(accreg(w)), w);
+     if (sem->opty == SAR)
+          writeReg(hireg(w), truncate(buildop2(SAR, v, buildconst(63)), w));
+     else
+          writeReg(accreg(w * 2), truncate(v, w * 2));
+     return true;
+}
+
+// String instructions. The direction flag is assumed clear, as compilers
+// leave it. cmpsd and movsd also name SSE2 instructions on xmm registers,
+// so only operands at [rsi] and [rdi] or in the accumulator are accepted;
+// anything else has size 0 and is not modelled.
+static bool strform(Inst *in)
+{
+     for (int i = 0; i < in->oprnum; ++i) {
+          Operand *op = in->oprd[i];
+          Register r = regalias(op->reg[0]).parent;
+          if (op->ty == Operand::REG ? r != RAX :
+              op->ty != Operand::MEM || op->reg[1] != UNK || (r != RSI && r != RDI))
+               return false;
+     }
+     return true;
+}
+
+static int strsize(Inst *in, const InstSem *sem)
+{
+     if (!strform(in))
+          return 0;
+     if (sem->nbyte != 0)
+          return sem->nbyte;
+     return in->oprnum > 0 ? in->oprd[0]->bit / 8 : 0;
+}
+
+bool SEEngine::semLods(Inst *in, const InstSem *sem)
+{
+     int n = strsize(in, sem);
+     if (n == 0)
+          return false;
+     Value *v = readMem(in->raddr, n);
+     writeReg(accreg(n * 8), v != NULL ? v : buildunknown());
+     ctx[RSI] = buildop2(ADD, ctx[RSI], buildconst(n));
+     return true;
+}
+
+bool SEEngine::semStos(Inst *in, const InstSem *sem)
+{
+     int n = strsize(in, sem);
+     if (n == 0)
+          return false;
+     writeMem(in->waddr, n, readReg(accreg(n * 8)));
+     ctx[RDI] = buildop2(ADD, ctx[RDI], buildconst(n));
+     return true;
+}
+
+bool SEEngine::semMovs(Inst *in, const InstSem *sem)
+{
+     int n = strsize(in, sem);
+     if (n == 0)
+          return false;
+     Value *v = readMem(in->raddr, n);
+     writeMem(in->waddr, n, v != NULL ? v : buildunknown());
+     ctx[RSI] = buildop2(ADD, ctx[RSI], buildconst(n));
+     ctx[RDI] = buildop2(ADD, ctx[RDI], buildconst(n));
+     return true;
+}
+
+// scas/cmps only compare, but still advance the pointers
+bool SEEngine::semCmps(Inst *in, const InstSem *sem)
+{
+     int n = strsize(in, sem);
+     if (n == 0)
+          return false;
+     if (sem->opty == SUB)
+          ctx[RSI] = buildop2(ADD, ctx[RSI], buildconst(n));
+     ctx[RDI] = buildop2(ADD, ctx[RDI], buildconst(n));
+     return true;
+}
+
+// loop: rcx -= 1, the branch itself is decided by the trace
+bool SEEngine::semLoop(Inst *in, const InstSem *sem)
+{
+     ctx[RCX] = buildop2(ADD, ctx[RCX], buildconst(~(ADDR64)0));
+     return true;
+}
+
+const InstSem SEEngine::semtable[] = {
+     {"nop",     &SEEngine::semNop,     OPERNUM, 0, 0},
+     {"cmp",     &SEEngine::semNop,     OPERNUM, 0, 0},
+     {"test",    &SEEngine::semNop,     OPERNUM, 0, 0},
+     {"bt",      &SEEngine::semNop,     OPERNUM, 0, 0},
+     {"jmp",     &SEEngine::semNop,     OPERNUM, 0, 0},
+     {"jcxz",    &SEEngine::semNop,     OPERNUM, 0, SEM_TRACEDEP},
+     {"jecxz",   &SEEngine::semNop,     OPERNUM, 0, SEM_TRACEDEP},
+     {"jrcxz",   &SEEngine::semNop,     OPERNUM, 0, SEM_TRACEDEP},
+     {"loop",    &SEEngine::semLoop,    OPERNUM, 0, SEM_TRACEDEP},
+     {"clc",     &SEEngine::semNop,     OPERNUM, 0, 0},
+     {"stc",     &SEEngine::semNop,     OPERNUM, 0, 0},
+     {"cmc",     &SEEngine::semNop,     OPERNUM, 0, 0},
+     {"cld",     &SEEngine::semNop,     OPERNUM, 0, 0},
+     {"mov",     &SEEngine::semMov,     MOV,  0, 0},
+     {"movabs",  &SEEngine::semMov,     MOV,  0, 0},
+     {"movzx",   &SEEngine::semMov,     MOV,  0, 0},
+     {"movsx",   &SEEngine::semMovsx,   MOV,  0, 0},
+     {"movsxd",  &SEEngine::semMovsx,   MOV,  0, 0},
+     {"lea",     &SEEngine::semLea,     ADD,  0, 0},
+     {"add",     &SEEngine::semBinary,  ADD,  0, 0},
+     {"sub",     &SEEngine::semBinary,  SUB,  0, 0},
+     {"and",     &SEEngine::semBinary,  AND,  0, 0},
+     {"or",      &SEEngine::semBinary,  OR,   0, 0},
+     {"xor",     &SEEngine::semBinary,  XOR,  0, 0},
+     {"shl",     &SEEngine::semBinary,  SHL,  0, 0},
+     {"sal",     &SEEngine::semBinary,  SHL,  0, 0},
+     {"shr",     &SEEngine::semBinary,  SHR,  0, 0},
+     {"sar",     &SEEngine::semBinary,  SAR,  0, 0},
+     {"adc",     &SEEngine::semCarry,   ADD,  0, SEM_TRACEDEP},
+     {"sbb",     &SEEngine::semCarry,   SUB,  0, SEM_TRACEDEP},
+     {"rol",     &SEEngine::semRotate,  SHL,  0, 0},
+     {"ror",     &SEEngine::semRotate,  SHR,  0, 0},
+     {"inc",     &SEEngine::semUnary,   INC,  0, 0},
+     {"dec",     &SEEngine::semUnary,   DEC,  0, 0},
+     {"neg",     &SEEngine::semUnary,   NEG,  0, 0},
+     {"not",     &SEEngine::semUnary,   NOT,  0, 0},
+     {"bswap",   &SEEngine::semBswap,   BSWAP, 0, 0},
+     {"xchg",    &SEEngine::semXchg,    MOV,  0, 0},
+     {"imul",    &SEEngine::semImul,    IMUL, 0, 0},
+     {"mul",     &SEEngine::semMul,     MOV,  0, 0},
+     {"div",     &SEEngine::semDiv,     DIV,  0, SEM_TRACEDEP},
+     {"push",    &SEEngine::semPush,    MOV,  0, 0},
+     {"pop",     &SEEngine::semPop,     MOV,  0, 0},
+     {"pushfq",  &SEEngine::semPushf,   MOV,  0, 0},
+     {"popfq",   &SEEngine::semPopf,    MOV,  0, 0},
+     {"call",    &SEEngine::semCall,    MOV,  0, 0},
+     {"ret",     &SEEngine::semRet,     MOV,  0, 0},
+     {"leave",   &SEEngine::semLeave,   MOV,  0, 0},
+     {"cbw",     &SEEngine::semConvert, MOV,  1, 0},
+     {"cwde",    &SEEngine::semConvert, MOV,  2, 0},
+     {"cdqe",    &SEEngine::semConvert, MOV,  4, 0},
+     {"cwd",     &SEEngine::semConvert, SAR,  2, 0},
+     {"cdq",     &SEEngine::semConvert, SAR,  4, 0},
+     {"cqo",     &SEEngine::semConvert, SAR,  8, 0},
+     {"lods",    &SEEngine::semLods,    MOV,  0, SEM_STRING},
+     {"lodsb",   &SEEngine::semLods,    MOV,  1, SEM_STRING},
+     {"lodsw",   &SEEngine::semLods,    MOV,  2, SEM_STRING},
+     {"lodsd",   &SEEngine::semLods,    MOV,  4, SEM_STRING},
+     {"lodsq",   &SEEngine::semLods,    MOV,  8, SEM_STRING},
+     {"stos",    &SEEngine::semStos,    MOV,  0, SEM_STRING},
+     {"stosb",   &SEEngine::semStos,    MOV,  1, SEM_STRING},
+     {"stosw",   &SEEngine::semStos,    MOV,  2, SEM_STRING},
+     {"stosd",   &SEEngine::semStos,    MOV,  4, SEM_STRING},
+     {"stosq",   &SEEngine::semStos,    MOV,  8, SEM_STRING},
+     {"movs",    &SEEngine::semMovs,    MOV,  0, SEM_STRING},
+     {"movsb",   &SEEngine::semMovs,    MOV,  1, SEM_STRING},
+     {"movsw",   &SEEngine::semMovs,    MOV,  2, SEM_STRING},
+     {"movsd",   &SEEngine::semMovs,    MOV,  4, SEM_STRING},
+     {"movsq",   &SEEngine::semMovs,    MOV,  8, SEM_STRING},
+     {"scasb",   &SEEngine::semCmps,    MOV,  1, SEM_STRING},
+     {"scasw",   &SEEngine::semCmps,    MOV,  2, SEM_STRING},
+     {"scasd",   &SEEngine::semCmps,    MOV,  4, SEM_STRING},
+     {"scasq",   &SEEngine::semCmps,    MOV,  8, SEM_STRING},
+     {"cmpsb",   &SEEngine::semCmps,    SUB,  1, SEM_STRING},
+     {"cmpsw",   &SEEngine::semCmps,    SUB,  2, SEM_STRING},
+     {"cmpsd",   &SEEngine::semCmps,    SUB,  4, SEM_STRING},
+     {"cmpsq",   &SEEngine::semCmps,    SUB,  8, SEM_STRING},
+};
+
+// Condition codes of jcc, cmovcc and setcc
+static const char *condcodes[] = {
+     "o", "no", "b", "c", "nae", "nb", "nc", "ae", "z", "e", "nz", "ne",
+     "be", "na", "nbe", "a", "s", "ns", "p", "pe", "np", "po",
+     "l", "nge", "nl", "ge", "le", "ng", "nle", "g"
+};
+
+// Semantics of a mnemonic, NULL if it is not modelled
+const InstSem *SEEngine::findsem(const string &mnem)
+{
+     // Built once; engines on several threads may get here at the same time
+     static const unordered_map<string, const InstSem*> semmap = []() {
+          unordered_map<string, const InstSem*> m;
+          for (size_t i = 0; i < sizeof(semtable) / sizeof(semtable[0]); ++i)
+               m[semtable[i].mnem] = &semtable[i];
+
+          // The names point into this table, so it is filled before use
+          static vector<string> condnames;
+          static vector<InstSem> condsem;
+          int ncc = sizeof(condcodes) / sizeof(condcodes[0]);
+          for (int i = 0; i < ncc; ++i) {
+               condnames.push_back(string("j") + condcodes[i]);
+               condnames.push_back(string("cmov") + condcodes[i]);
+               condnames.push_back(string("set") + condcodes[i]);
+          }
+          for (int i = 0; i < ncc; ++i) {
+               InstSem j = {condnames[3*i].c_str(), &SEEngine::semNop, OPERNUM, 0, 0};
+               InstSem cmov = {condnames[3*i+1].c_str(), &SEEngine::semCmov, MOV, 0, SEM_TRACEDEP};
+               InstSem set = {condnames[3*i+2].c_str(), &SEEngine::semSetcc, MOV, 0, SEM_TRACEDEP};
+               condsem.push_back(j);
+               condsem.push_back(cmov);
+               condsem.push_back(set);
+          }
+          for (size_t i = 0; i < condsem.size(); ++i)
+               m[condsem[i].mnem] = &condsem[i];
+          return m;
+     }();
+
+     unordered_map<string, const InstSem*>::const_iterator it = semmap.find(mnem);
+     return it == semmap.end() ? NULL : it->second;
+}
+
+// rep/repe/repne prefixed string instructions: the trace has one entry per
+// iteration, each of which also decrements rcx
+bool SEEngine::semRep(Inst *in, const InstSem *sem)
+{
+     if (in->oprs.empty())
+          return false;
+
+     string mnem = in->oprs[0].substr(0, in->oprs[0].find(' '));
+     const InstSem *s = findsem(mnem);
+     if (s == NULL || !(s->flags & SEM_STRING) || s->nbyte == 0)
+          return false;
+
+     if (!(this->*(s->exec))(in, s))
+          return false;
+     ctx[RCX] = buildop2(ADD, ctx[RCX], buildconst(~(ADDR64)0));
+     return true;
+}
+
+const InstSem SEEngine::repsem = {"rep", &SEEngine::semRep, MOV, 0, SEM_STRING | SEM_TRACEDEP};
+
+// Results of an instruction that cannot be modelled become fresh symbols:
+// every register the trace shows changing, and the memory it writes
+void SEEngine::havoc(Inst *in)
+{
+     if (warned.insert(in->opcstr).second)
+          cerr << "Warning: Line " << in->id << ": instruction '" << in->opcstr
+               << "' is not modelled, its results become fresh symbols" << endl;
+
+     list<Inst>::iterator nx = next(ip);
+     if (nx != end) {
+          for (int i = 0; i < 16; ++i) {
+               if (nx->ctxreg[i] != in->ctxreg[i])
+                    ctx[i] = buildunknown();
+          }
+     } else if (in->oprnum > 0 && in->oprd[0]->ty == Operand::REG) {
+          writeReg(in->oprd[0]->reg[0], buildunknown());
+     }
+
+     if (in->waddr != 0) {
+          int nbyte = 8;
+          if (in->oprnum > 0 && in->oprd[0]->ty == Operand::MEM && in->oprd[0]->bit > 0)
+               nbyte = in->oprd[0]->bit / 8;
+          for (int i = 0; i < nbyte; i += 8)
+               writeMem(in->waddr + i, min(8, nbyte - i), buildunknown());
+     }
+}
+
+// Look up the semantics of each instruction once, and find the return
+// address of each call from its matching ret
+void SEEngine::decode(vector<const InstSem*> *sems)
+{
+     vector<pair<ADDR64, int> > calls;          // stack slot, call id
+
+     sems->clear();
+     for (list<Inst>::iterator it = start; it != end; ++it) {
+          const InstSem *s = findsem(it->opcstr);
+          if (s == NULL && it->opcstr.compare(0, 3, "rep") == 0)
+               s = &repsem;
+          sems->push_back(s);
+
+          if (it->opcstr == "call") {
+               calls.push_back(make_pair(it->waddr, it->id));
+          } else if (it->opcstr == "ret") {
+               ADDR64 sp = it->ctxreg[6];
+               while (!calls.empty() && calls.back().first < sp)
+                    calls.pop_back();
+               list<Inst>::iterator nx = next(it);
+               if (!calls.empty() && calls.back().first == sp && nx != end) {
+                    callret[calls.back().second] = nx->addrn;
+                    calls.pop_back();
+               }
+          }
+     }
+}
+
+// Control transfers end a block
+static bool endsblock(const Inst &in)
+{
+     return in.opcstr[0] == 'j' || in.opcstr == "call" || in.opcstr == "ret" ||
+          in.opcstr.compare(0, 4, "loop") == 0;
+}
 
-    start = it1;
-    end = it2;
+// An instruction outside the slice: the registers it changed get their
+// values in the trace after it
+void SEEngine::skip(list<Inst>::iterator it)
+{
+    list<Inst>::iterator nx = next(it);
+    ++nskipped;
+    if (nx == end)
+        return;
+    for (int r = 0; r < 16; ++r) {
+        if (it->ctxreg[r] != nx->ctxreg[r]) {
+            ctx[r] = buildconst(nx->ctxreg[r]);
+            tracedep = true;
+        }
+    }
 }
-set<string> noeffectinst = {
-    "test", "jmp", "jz", "jbe", "jo", "jno", "js", "jns", "je", "jne",
-    "jnz", "jb", "jnae", "jc", "jnb", "jae", "jnc", "jna", "ja", "jnbe", "jl",
-    "jnge", "jge", "jnl", "jle", "jng", "jg", "jnle", "jp", "jpe", "jnp", "jpo",
-    "jcxz", "jecxz", "ret", "cmp", "call", 
-    
-    // 64-bit specific mnemonics
-    "jmpq", "retq", "callq", "cmpq", 
-    "jzq", "jeq", "jnzq", "jneq", 
-    "jgeq", "jleq", "jgq", "jlq", 
-    "jbeq", "jaq", "jnae", "jnaeq", "jaeq", "jbq"
-};
 
+#define MINBLOCK 4          // shorter blocks are cheaper to execute than to summarize
+#define MAXVARIANTS 4       // summaries per block for different memory aliasing
 
 int SEEngine::symexec()
 {
-    for (list<Inst>::iterator it = start; it != end; ++it) {
+    vector<const InstSem*> sems;
+    decode(&sems);
+
+    int i = 0;
+    bool blockstart = true;
+    for (list<Inst>::iterator it = start; it != end; ++it, ++i) {
+        if (!slice.empty() && !slice[i]) {
+            skip(it);
+            blockstart = endsblock(*it);
+            continue;
+        }
+        if (blockstart && summarize && !concolic && slice.empty()) {
+            list<Inst>::iterator e = it;
+            int n = 1;
+            while (!endsblock(*e) && next(e) != end) {
+                ++e;
+                ++n;
+            }
+            ++e;
+            if (n >= MINBLOCK && runsummary(it, e)) {
+                advance(it, n - 1);
+                i += n - 1;
+                ip = it;
+                sincecp += n;
+                if (cpinterval > 0 && sincecp >= cpinterval)
+                    checkpoint();
+                continue;
+            }
+        }
+        blockstart = endsblock(*it);
+
         ip = it;
+        ipno = i;
+        const InstSem *sem = sems[i];
+
+        if (sem != NULL && (sem->flags & SEM_TRACEDEP))
+            tracedep = true;
+        if (sem == NULL || !(this->*(sem->exec))(&*it, sem)) {
+            havoc(&*it);
+            ++nunknown;
+        }
+        if (concolic)
+            concretize();
+        if (cpinterval > 0 && ++sincecp >= cpinterval)
+            checkpoint();
+    }
+    return 0;
+}
+
+// ********************************
+//  Block summaries
+// ********************************
+
+static void postorder(Value *root, vector<Value*> *order);
+
+// Run the block [b, e) in a child engine with symbolic registers and memory,
+// and compile its effect. The summary is not ok if the block used the trace
+// or had unmodelled instructions, as then it only holds for this execution.
+BlockSummary *SEEngine::buildsummary(list<Inst>::iterator b, list<Inst>::iterator e)
+{
+    BlockSummary *s = new BlockSummary();
+    s->begin = b;
+    s->end = e;
+
+    SEEngine child;
+    child.building = s;
+    child.initAllRegSymbol(b, e);
+    Value *regin[16];
+    copy(child.ctx, child.ctx + 16, regin);
+    child.symexec();
+    child.building = NULL;
+
+    s->ok = !child.tracedep && child.nunknown == 0;
+    if (!s->ok)
+        return s;
+
+    // Inputs first, then constants and operations in topological order
+    unordered_map<Value*, int> slot;
+    for (int i = 0; i < 16; ++i)
+        slot[regin[i]] = i;
+    for (size_t i = 0; i < s->loads.size(); ++i)
+        slot[s->loads[i].sym] = 16 + i;
+    int n = 16 + s->loads.size();
+
+    vector<Value*> roots(child.ctx, child.ctx + 16);
+    for (size_t i = 0; i < s->stores.size(); ++i)
+        roots.push_back(s->stores[i].val);
+
+    vector<Value*> order, ops;
+    for (size_t r = 0; r < roots.size(); ++r) {
+        order.clear();
+        postorder(roots[r], &order);
+        for (size_t i = 0; i < order.size(); ++i) {
+            Value *v = order[i];
+            if (slot.count(v))
+                continue;
+            if (v->opr == NULL && v->valty != CONCRETE) {
+                s->ok = false;          // a symbol that is not an input
+                return s;
+            }
+            if (v->opr == NULL) {
+                s->consts.push_back(v->conval);
+                slot[v] = n++;
+            } else {
+                ops.push_back(v);
+                slot[v] = -1;           // numbered after the constants
+            }
+        }
+    }
+    for (size_t i = 0; i < ops.size(); ++i)
+        slot[ops[i]] = n++;
+    for (size_t i = 0; i < ops.size(); ++i) {
+        Operation *op = ops[i]->opr;
+        CodeInst ci;
+        ci.opty = op->opty;
+        ci.dst = slot[ops[i]];
+        ci.a = slot[op->val[0]];
+        ci.b = op->val[1] != NULL ? slot[op->val[1]] : -1;
+        s->code.push_back(ci);
+    }
+    s->nslots = n;
+
+    for (int i = 0; i < 16; ++i)
+        s->regout[i] = slot[child.ctx[i]];
+    for (size_t i = 0; i < s->stores.size(); ++i) {
+        s->stores[i].slot = slot[s->stores[i].val];
+        s->stores[i].val = NULL;
+    }
+    for (size_t i = 0; i < s->loads.size(); ++i)
+        s->loads[i].sym = NULL;
+    return s;
+}
+
+// Apply s to the execution [b, e) of its block. This fails, leaving the
+// engine untouched, if the memory accesses overlap differently than in the
+// execution s was built from.
+bool SEEngine::instantiate(BlockSummary *s, list<Inst>::iterator b, list<Inst>::iterator e)
+{
+    vector<Inst*> insts;
+    for (list<Inst>::iterator it = b; it != e; ++it)
+        insts.push_back(&*it);
+
+    size_t na = s->accesses.size();
+    vector<ADDR64> addrs(na);
+    for (size_t i = 0; i < na; ++i) {
+        const MemAccess &ma = s->accesses[i];
+        Inst *in = insts[ma.inst];
+        addrs[i] = (ma.write ? in->waddr : in->raddr) + ma.offset;
+    }
+    for (size_t i = 0; i < na; ++i) {
+        for (size_t j = i + 1; j < na; ++j) {
+            bool o1 = s->addrs[i] < s->addrs[j] + s->accesses[j].nbyte &&
+                s->addrs[j] < s->addrs[i] + s->accesses[i].nbyte;
+            bool o2 = addrs[i] < addrs[j] + s->accesses[j].nbyte &&
+                addrs[j] < addrs[i] + s->accesses[i].nbyte;
+            if (o1 != o2 || (o1 && s->addrs[j] - s->addrs[i] != addrs[j] - addrs[i]))
+                return false;
+        }
+    }
+
+    vector<Value*> slots(s->nslots);
+    copy(ctx, ctx + 16, slots.begin());
+    int n = 16;
+    for (size_t i = 0; i < s->loads.size(); ++i) {
+        const BlockSummary::Load &ld = s->loads[i];
+        slots[n++] = readMem(addrs[ld.access] + ld.offset, ld.nbyte);
+    }
+    for (size_t i = 0; i < s->consts.size(); ++i)
+        slots[n++] = buildconst(s->consts[i]);
+    for (size_t i = 0; i < s->code.size(); ++i) {
+        const CodeInst &ci = s->code[i];
+        slots[ci.dst] = ci.b < 0 ? buildop1(ci.opty, slots[ci.a]) :
+            buildop2(ci.opty, slots[ci.a], slots[ci.b]);
+    }
+
+    for (size_t i = 0; i < s->stores.size(); ++i) {
+        const BlockSummary::Store &st = s->stores[i];
+        writeMem(addrs[st.access], s->accesses[st.access].nbyte, slots[st.slot]);
+    }
+    for (int i = 0; i < 16; ++i)
+        ctx[i] = slots[s->regout[i]];
+    ++nsummarized;
+    return true;
+}
+
+// Execute the block [b, e) by a summary if possible. A summary is built the
+// second time a block is seen, and again for other memory aliasing.
+bool SEEngine::runsummary(list<Inst>::iterator b, list<Inst>::iterator e)
+{
+    uint64_t h = hashAddrSeq(b, e);
+    if (blockseen[h]++ == 0)
+        return false;
+
+    vector<BlockSummary*> &sums = summaries[h];
+    for (size_t i = 0; i < sums.size(); ++i) {
+        if (!sameAddrSeq(sums[i]->begin, sums[i]->end, b, e))
+            continue;
+        if (!sums[i]->ok)
+            return false;
+        if (instantiate(sums[i], b, e))
+            return true;
+    }
+    if (sums.size() >= MAXVARIANTS)
+        return false;
+
+    BlockSummary *s = buildsummary(b, e);
+    sums.push_back(s);
+    return s->ok && instantiate(s, b, e);
+}
+
+// ********************************
+//  Checkpoints
+// ********************************
+
+// Every interval instructions, formulas deeper than maxdepth or with more
+// than maxsize nodes become fresh symbols. A limit of 0 is not checked.
+void SEEngine::setCheckpoints(int maxdepth, int maxsize, int interval)
+{
+    cpdepth = maxdepth;
+    cpsize = maxsize;
+    cpinterval = interval;
+    sincecp = 0;
+}
+
+// Length of the longest path from v to a leaf, memoized for all nodes
+int SEEngine::formulaDepth(Value *v)
+{
+    unordered_map<Value*, int>::iterator it = depthmemo.find(v);
+    if (it != depthmemo.end())
+        return it->second;
+
+    vector<Value*> order;
+    postorder(v, &order);
+    for (size_t i = 0; i < order.size(); ++i) {
+        Value *u = order[i];
+        if (depthmemo.count(u))
+            continue;
+        int d = 0;
+        if (u->opr != NULL) {
+            for (int j = 0; j < 3; ++j) {
+                if (u->opr->val[j] != NULL)
+                    d = max(d, depthmemo[u->opr->val[j]] + 1);
+            }
+        }
+        depthmemo[u] = d;
+    }
+    return depthmemo[v];
+}
+
+// Number of distinct nodes in v, counting stops after limit
+static int formulaSize(Value *v, int limit)
+{
+    vector<Value*> stack(1, v);
+    unordered_set<Value*> seen;
+    seen.insert(v);
+    while (!stack.empty() && (int)seen.size() <= limit) {
+        Value *u = stack.back();
+        stack.pop_back();
+        if (u->opr == NULL)
+            continue;
+        for (int j = 0; j < 3; ++j) {
+            if (u->opr->val[j] != NULL && seen.insert(u->opr->val[j]).second)
+                stack.push_back(u->opr->val[j]);
+        }
+    }
+    return seen.size();
+}
+
+// The value to keep for v at a checkpoint: v itself, or a fresh symbol
+// standing for it if it is over a limit
+Value *SEEngine::checkpointValue(Value *v)
+{
+    if (v == NULL || v->opr == NULL || cpwithin.count(v))
+        return v;
+    if ((cpdepth <= 0 || formulaDepth(v) <= cpdepth) &&
+        (cpsize <= 0 || formulaSize(v, cpsize) <= cpsize)) {
+        cpwithin.insert(v);
+        return v;
+    }
+
+    Value *s = buildsym(v->len);
+    cpinput[s] = v;
+    if (concolic && v->tainted) {
+        s->tainted = true;
+        shadow[s] = shadow[v];
+    }
+    return s;
+}
+
+#define CONSTCHECK 4096
+#define CONSTBITS 16
+
+static int symwidth(Value *v);
+
+// Whether v gives c for every input. Random and corner-case inputs rule
+// out most formulas; the rest are proven on all inputs, which is only done
+// when the inputs have at most CONSTBITS bits together.
+bool SEEngine::isConstant(Value *v, ADDR64 c)
+{
+    vector<Value*> inv = getInputVector(v);
+    int n = 64, nin = inv.size(), nbit = 0;
+    for (int j = 0; j < nin; ++j)
+        nbit += symwidth(inv[j]);
+    if (nbit > CONSTBITS)
+        return false;
+
+    vector<ADDR64> input((size_t)n * nin), out;
+    mt19937_64 rng(v->id);
+    for (int k = 0; k < n * nin; ++k) {
+        int sel = rng() % 4;
+        input[k] = sel == 0 ? 0 : sel == 1 ? ~0ULL : rng() >> (rng() % 64);
+    }
+    conexecBatch(v, input, n, &out);
+    if (count(out.begin(), out.end(), c) != n)
+        return false;
+
+    n = 1 << nbit;
+    input.assign((size_t)n * nin, 0);
+    for (int k = 0; k < n; ++k) {
+        for (int j = 0, shift = 0; j < nin; shift += symwidth(inv[j]), ++j)
+            input[(size_t)k * nin + j] = ((ADDR64)k >> shift) & ((1ULL << symwidth(inv[j])) - 1);
+    }
+    conexecBatch(v, input, n, &out);
+    return count(out.begin(), out.end(), c) == n;
+}
+
+// Apply the limits to the registers and memory. A register that changed
+// since the last checkpoint and gives the value in the trace for every
+// input is replaced by that constant.
+void SEEngine::checkpoint()
+{
+    sincecp = 0;
+    list<Inst>::iterator nx = next(ip);
+
+    for (int i = RAX; i <= R15; ++i) {
+        Value *v = ctx[i];
+        if (v == NULL || v == cpctx[i])
+            continue;
+        if (v->opr != NULL && nx != end && formulaSize(v, CONSTCHECK) < CONSTCHECK &&
+            isConstant(v, nx->ctxreg[i])) {
+            ctx[i] = cpctx[i] = buildconst(nx->ctxreg[i]);
+            ++nconcretized;
+            continue;
+        }
+        ctx[i] = cpctx[i] = checkpointValue(v);
+    }
+
+    // Every byte of a replaced value refers to the same fresh symbol
+    unordered_map<Value*, Value*> repl;
+    Value *last = NULL, *lastrepl = NULL;
+    for (auto &x : pages) {
+        PageRef &ref = x.second;
+        if (!ref.page->dirty)
+            continue;
+        if (!ref.owned) {
+            ref.page = make_shared<MemPage>(*ref.page);
+            ref.owned = true;
+            lastpage = NULL;
+        }
+        MemPage *page = ref.page.get();
+        page->dirty = false;
+        for (int i = 0; i < PAGESIZE; ++i) {
+            Value *v = page->bytes[i].val;
+            if (v == NULL || v->opr == NULL)
+                continue;
+            if (v != last) {
+                unordered_map<Value*, Value*>::iterator it = repl.find(v);
+                if (it == repl.end())
+                    it = repl.insert(make_pair(v, checkpointValue(v))).first;
+                last = v;
+                lastrepl = it->second;
+            }
+            page->bytes[i].val = lastrepl;
+        }
+    }
+}
+
+// v with every checkpoint symbol replaced by the formula it stands for,
+// through any number of checkpoints
+Value *SEEngine::expand(Value *v)
+{
+    if (v == NULL || cpinput.empty())
+        return v;
+
+    // Post-order walk in which a checkpoint symbol has its formula as child
+    unordered_map<Value*, Value*> done;
+    vector<pair<Value*, int> > stack;
+    stack.push_back(make_pair(v, 0));
+    while (!stack.empty()) {
+        Value *u = stack.back().first;
+        int &next = stack.back().second;
+        if (done.count(u)) {
+            stack.pop_back();
+            continue;
+        }
+
+        unordered_map<Value*, Value*>::iterator cp = cpinput.find(u);
+        Value *child = NULL;
+        if (cp != cpinput.end() && next == 0)
+            child = cp->second;
+        else if (cp == cpinput.end() && u->opr != NULL && next < 3)
+            child = u->opr->val[next];
+        if (child != NULL || (u->opr != NULL && cp == cpinput.end() && next < 3)) {
+            ++next;
+            if (child != NULL && !done.count(child))
+                stack.push_back(make_pair(child, 0));
+            continue;
+        }
+
+        Value *res;
+        if (cp != cpinput.end()) {
+            res = done[cp->second];
+        } else if (u->opr == NULL) {
+            res = u;
+        } else {
+            Operation *op = u->opr;
+            if (op->val[1] == NULL)
+                res = buildop1(op->opty, done[op->val[0]]);
+            else if (op->val[2] == NULL)
+                res = buildop2(op->opty, done[op->val[0]], done[op->val[1]]);
+            else
+                res = buildop3(op->opty, done[op->val[0]], done[op->val[1]], done[op->val[2]]);
+        }
+        done[u] = res;
+        stack.pop_back();
+    }
+    return done[v];
+}
+
+// ********************************
+//  MBA simplification
+// ********************************
+
+// Linear mixed boolean-arithmetic expressions of up to MBAMAXVAR variables
+// and MBAMAXSIZE operations are replaced by the smallest equivalent linear
+// expression of a table. Two linear MBA expressions are equal iff they are
+// equal on the inputs in {0, 1}^n, so the table is searched by these values
+// and a match needs no further check.
+#define MBAMAXVAR 3
+#define MBAMAXSIZE 64
+#define MBAMAXOPS 3                  // operations in a table expression
+#define MBAPERSIG 4                  // table expressions kept per signature
+
+// One operation of a straight-line program. Operands index the values of
+// the program: its variables, then its constants, then earlier steps.
+struct MBAStep {
+    OperTy opty;
+    int a, b;                        // b is -1 for unary operators
+};
+
+struct MBAProg {
+    int nvar;
+    vector<ADDR64> consts;
+    vector<MBAStep> steps;
+    int result;                      // index of the value computed
+};
 
-        // Skip no-effect instructions (jumps, comparisons without side effects, etc.)
-        if (noeffectinst.find(it->opcstr) != noeffectinst.end()) continue;
+static bool ismba(OperTy opty)
+{
+    switch (opty) {
+    case ADD: case SUB: case IMUL: case AND: case OR: case XOR:
+    case NOT: case NEG:
+        return true;
+    default:
+        return false;
+    }
+}
 
-        switch (it->oprnum) {
-        case 0: 
-            // Handle zero-operand instructions (e.g., nop)
+// Whether p is linear MBA: a sum of constant multiples of bitwise
+// expressions, whose operands are variables, 0 and ~0
+static bool mbalinear(const MBAProg &p)
+{
+    enum {BITWISE, CONST, LINEAR, NONLINEAR};
+    int first = p.nvar + p.consts.size();
+    vector<int> kind(first + p.steps.size());
+    vector<ADDR64> val(kind.size());
+    for (int i = 0; i < p.nvar; ++i)
+        kind[i] = BITWISE;
+    for (size_t i = 0; i < p.consts.size(); ++i) {
+        kind[p.nvar + i] = CONST;
+        val[p.nvar + i] = p.consts[i];
+    }
+    for (size_t i = 0; i < p.steps.size(); ++i) {
+        const MBAStep &st = p.steps[i];
+        int a = kind[st.a], b = st.b < 0 ? CONST : kind[st.b];
+        int &k = kind[first + i];
+        if (a == CONST && b == CONST) {
+            k = CONST;
+            val[first + i] = operinfo[st.opty].eval(val[st.a], st.b < 0 ? 0 : val[st.b]);
+            continue;
+        }
+        if (a == NONLINEAR || b == NONLINEAR) {
+            k = NONLINEAR;
+            continue;
+        }
+        switch (st.opty) {
+        case NOT:
+            k = a;
+            break;
+        case NEG: case ADD: case SUB:
+            k = LINEAR;
+            break;
+        case IMUL:
+            k = a == CONST || b == CONST ? LINEAR : NONLINEAR;
+            break;
+        default: {
+            // A constant in a bitwise operation must be the same in every bit
+            bool ba = a == BITWISE || (a == CONST && (val[st.a] == 0 || val[st.a] == ~0ULL));
+            bool bb = b == BITWISE || (b == CONST && (val[st.b] == 0 || val[st.b] == ~0ULL));
+            k = ba && bb ? BITWISE : NONLINEAR;
             break;
+        }
+        }
+    }
+    return kind[p.result] != NONLINEAR;
+}
 
-        case 1: { 
-            // Handle one-operand instructions (e.g., push, pop, inc, dec, neg, not)
-            Operand *op0 = it->oprd[0];
-            Value *v0, *res, *temp;
-            int nbyte;
-
-            if (it->opcstr == "push") {
-                if (op0->ty == Operand::IMM) {
-                    v0 = new Value(CONCRETE, op0->field[0]);
-                    writeMem(it->waddr, 4, v0);
-                } else if (op0->ty == Operand::REG) {
-                    nbyte = op0->bit / 8;
-                    temp = readReg(op0->field[0]);
-                    writeMem(it->waddr, nbyte, temp);
-                } else if (op0->ty == Operand::MEM) {
-                    nbyte = op0->bit / 8;
-                    v0 = readMem(it->raddr, nbyte);
-                    writeMem(it->waddr, nbyte, v0);
-                } else {
-                    cerr << "push error: unsupported operand type!" << endl;
-                    return 1;
-                }
-            } else if (it->opcstr == "pop") {
-                if (op0->ty == Operand::REG) {
-                    nbyte = op0->bit / 8;
-                    temp = readMem(it->raddr, nbyte);
-                    writeReg(op0->field[0], temp);
-                } else if (op0->ty == Operand::MEM) {
-                    nbyte = op0->bit / 8;
-                    temp = readMem(it->raddr, nbyte);
-                    writeMem(it->waddr, nbyte, temp);
-                } else {
-                    cerr << "pop error: unsupported operand type!" << endl;
-                    return 1;
-                }
-            } else if (it->opcstr == "inc" || it->opcstr == "dec" || it->opcstr == "neg" || it->opcstr == "not") {
-                if (op0->ty == Operand::REG) {
-                    v0 = readReg(op0->field[0]);
-                    res = buildop1(it->opcstr, v0);
-                    writeReg(op0->field[0], res);
-                } else if (op0->ty == Operand::MEM) {
-                    nbyte = op0->bit / 8;
-                    v0 = readMem(it->raddr, nbyte);
-                    res = buildop1(it->opcstr, v0);
-                    writeMem(it->waddr, nbyte, res);
-                } else {
-                    cerr << "[Error] Line " << it->id << ": unknown 1-op instruction!" << endl;
-                    return 1;
+static ADDR64 runprog(const MBAProg &p, const ADDR64 *x)
+{
+    ADDR64 val[MBAMAXVAR + 2 * MBAMAXSIZE + 1];
+    int n = 0;
+    for (int i = 0; i < p.nvar; ++i)
+        val[n++] = x[i];
+    for (size_t i = 0; i < p.consts.size(); ++i)
+        val[n++] = p.consts[i];
+    for (size_t i = 0; i < p.steps.size(); ++i) {
+        const MBAStep &st = p.steps[i];
+        val[n++] = operinfo[st.opty].eval(val[st.a], st.b < 0 ? 0 : val[st.b]);
+    }
+    return val[p.result];
+}
+
+// Values on the 2^nvar inputs in {0, 1}^nvar, less the value at 0, so that
+// expressions differing by a constant have the same signature
+static vector<ADDR64> mbasignature(const MBAProg &p, ADDR64 *base)
+{
+    vector<ADDR64> sig(1 << p.nvar);
+    ADDR64 x[MBAMAXVAR];
+    for (int k = 0; k < (int)sig.size(); ++k) {
+        for (int i = 0; i < p.nvar; ++i)
+            x[i] = (k >> i) & 1;
+        sig[k] = runprog(p, x);
+    }
+    *base = sig[0];
+    for (size_t k = 0; k < sig.size(); ++k)
+        sig[k] -= *base;
+    return sig;
+}
+
+// Table of the linear expressions of nvar variables with up to MBAMAXOPS
+// operations, smallest first for each signature
+typedef map<vector<ADDR64>, vector<MBAProg> > MBATable;
+
+static void addcand(MBATable *table, const MBAProg &p)
+{
+    if (!mbalinear(p))
+        return;
+    ADDR64 base;
+    vector<MBAProg> &cands = (*table)[mbasignature(p, &base)];
+    if (cands.size() < MBAPERSIG)
+        cands.push_back(p);
+}
+
+static const MBATable &mbatable(int nvar)
+{
+    static const OperTy unops[] = {NOT, NEG};
+    static const OperTy binops[] = {ADD, SUB, IMUL, AND, OR, XOR};
+
+    auto build = [](int nvar) {
+        MBATable table;
+        vector<vector<MBAProg> > bysize(MBAMAXOPS + 1);
+        for (int i = 0; i < nvar; ++i) {
+            MBAProg p;
+            p.nvar = nvar;
+            p.result = i;
+            bysize[0].push_back(p);
+            addcand(&table, p);
+        }
+        // Sizes up to MBAMAXOPS - 1 are kept to build larger expressions,
+        // the largest only go into the table
+        for (int size = 1; size <= MBAMAXOPS; ++size) {
+            vector<MBAProg> &out = bysize[size];
+            for (size_t i = 0; i < bysize[size - 1].size(); ++i) {
+                for (OperTy op : unops) {
+                    MBAProg p = bysize[size - 1][i];
+                    p.steps.push_back(MBAStep{op, p.result, -1});
+                    p.result = nvar + p.steps.size() - 1;
+                    if (size < MBAMAXOPS)
+                        out.push_back(p);
+                    addcand(&table, p);
                 }
-            } else if (it->opcstr == "bswap") {
-                if (op0->ty == Operand::REG) {
-                    v0 = readReg(op0->field[0]);
-                    res = buildop1("bswap", v0);
-                    writeReg(op0->field[0], res);
-                } else {
-                    cerr << "bswap error: unsupported operand type!" << endl;
-                    return 1;
+            }
+            for (int ls = 0; ls < size; ++ls) {
+                const vector<MBAProg> &left = bysize[ls], &right = bysize[size - 1 - ls];
+                for (size_t i = 0; i < left.size(); ++i) {
+                    for (size_t j = 0; j < right.size(); ++j) {
+                        for (OperTy op : binops) {
+                            // Right operand steps follow the left ones
+                            MBAProg p = left[i];
+                            int shift = p.steps.size();
+                            const MBAProg &r = right[j];
+                            for (size_t k = 0; k < r.steps.size(); ++k) {
+                                MBAStep st = r.steps[k];
+                                if (st.a >= nvar) st.a += shift;
+                                if (st.b >= nvar) st.b += shift;
+                                p.steps.push_back(st);
+                            }
+                            int rres = r.result >= nvar ? r.result + shift : r.result;
+                            p.steps.push_back(MBAStep{op, p.result, rres});
+                            p.result = nvar + p.steps.size() - 1;
+                            if (size < MBAMAXOPS)
+                                out.push_back(p);
+                            addcand(&table, p);
+                        }
+                    }
                 }
+            }
+        }
+        return table;
+    };
+
+    // Each table is built on first use
+    switch (nvar) {
+    case 1: { static const MBATable t1 = build(1); return t1; }
+    case 2: { static const MBATable t2 = build(2); return t2; }
+    default: { static const MBATable t3 = build(3); return t3; }
+    }
+}
+
+// The MBA program computing v, with the largest subexpressions that are not
+// MBA operations as variables. False if v has too many of either.
+static bool mbaprog(Value *v, MBAProg *p, vector<Value*> *vars)
+{
+    unordered_map<Value*, int> index;
+    map<ADDR64, int> constidx;
+    vector<pair<Value*, int> > stack;
+    vector<Value*> order;            // operations in post-order
+
+    // First pass: variables in order of first use, constants, operations
+    stack.push_back(make_pair(v, 0));
+    index[v] = -1;
+    while (!stack.empty()) {
+        Value *u = stack.back().first;
+        int &next = stack.back().second;
+        int arity = operinfo[u->opr->opty].arity;
+        if (next < arity) {
+            Value *c = u->opr->val[next++];
+            if (index.count(c))
+                continue;
+            if (c->opr == NULL && c->valty == CONCRETE) {
+                if (!constidx.count(c->conval))
+                    constidx[c->conval] = -1;
+                index[c] = -2;
+            } else if (c->opr != NULL && ismba(c->opr->opty)) {
+                if ((int)order.size() + (int)stack.size() >= MBAMAXSIZE)
+                    return false;
+                index[c] = -1;
+                stack.push_back(make_pair(c, 0));
             } else {
-                cerr << "Error: Unsupported one-operand instruction " << it->opcstr << endl;
-                return 1;
+                if ((int)vars->size() == MBAMAXVAR)
+                    return false;
+                index[c] = vars->size();
+                vars->push_back(c);
             }
-            break;
+            continue;
+        }
+        order.push_back(u);
+        stack.pop_back();
+    }
+
+    p->nvar = vars->size();
+    p->consts.clear();
+    p->steps.clear();
+    for (auto &x : constidx) {
+        x.second = p->nvar + p->consts.size();
+        p->consts.push_back(x.first);
+    }
+    int first = p->nvar + p->consts.size();
+    for (size_t i = 0; i < order.size(); ++i)
+        index[order[i]] = first + i;
+
+    for (size_t i = 0; i < order.size(); ++i) {
+        Operation *op = order[i]->opr;
+        int arg[2] = {-1, -1};
+        for (int j = 0; j < operinfo[op->opty].arity; ++j) {
+            Value *c = op->val[j];
+            arg[j] = index[c] == -2 ? constidx[c->conval] : index[c];
+        }
+        p->steps.push_back(MBAStep{op->opty, arg[0], arg[1]});
+    }
+    p->result = first + order.size() - 1;
+    return true;
+}
+
+// A key equal for programs that are equal up to the choice of variables
+static string mbakey(const MBAProg &p)
+{
+    ostringstream os;
+    os << p.nvar;
+    for (size_t i = 0; i < p.consts.size(); ++i)
+        os << ' ' << p.consts[i];
+    for (size_t i = 0; i < p.steps.size(); ++i)
+        os << ';' << p.steps[i].opty << ',' << p.steps[i].a << ',' << p.steps[i].b;
+    return os.str();
+}
+
+// Build a table expression on the given variables, plus a constant
+Value *SEEngine::buildprog(const MBAProg &p, const vector<Value*> &vars, ADDR64 c)
+{
+    vector<Value*> val(vars);
+    for (size_t i = 0; i < p.consts.size(); ++i)
+        val.push_back(buildconst(p.consts[i]));
+    for (size_t i = 0; i < p.steps.size(); ++i) {
+        const MBAStep &st = p.steps[i];
+        if (st.b < 0)
+            val.push_back(buildop1(st.opty, val[st.a]));
+        else
+            val.push_back(buildop2(st.opty, val[st.a], val[st.b]));
+    }
+    Value *r = val[p.result];
+    return c == 0 ? r : buildop2(ADD, r, buildconst(c));
+}
+
+// The smallest equivalent of v in the table, NULL if there is none. The
+// result for each program is kept, so repeated code is only checked once.
+Value *SEEngine::reduceMBA(Value *v)
+{
+    MBAProg p;
+    vector<Value*> vars;
+    if (!mbaprog(v, &p, &vars) || p.steps.size() < 2 || !mbalinear(p))
+        return NULL;
+
+    string key = mbakey(p);
+    unordered_map<string, pair<const MBAProg*, ADDR64> >::iterator it = mbacache.find(key);
+    if (it == mbacache.end()) {
+        pair<const MBAProg*, ADDR64> found(NULL, 0);
+        ADDR64 base;
+        vector<ADDR64> sig = mbasignature(p, &base);
+        if (p.nvar == 0) {
+            found.second = base;
+        } else {
+            const MBATable &table = mbatable(p.nvar);
+            MBATable::const_iterator cands = table.find(sig);
+            for (size_t i = 0; cands != table.end() && i < cands->second.size() &&
+                     found.first == NULL; ++i) {
+                const MBAProg &cand = cands->second[i];
+                ADDR64 cbase;
+                mbasignature(cand, &cbase);
+                if (cand.steps.size() + (base != cbase) < p.steps.size())
+                    found = make_pair(&cand, base - cbase);
+            }
+        }
+        it = mbacache.insert(make_pair(key, found)).first;
+    }
+
+    if (p.nvar == 0)
+        return buildconst(it->second.second);
+    if (it->second.first == NULL)
+        return NULL;
+    return buildprog(*it->second.first, vars, it->second.second);
+}
+
+// v with its MBA subexpressions replaced by simpler equivalents
+Value *SEEngine::simplifyMBA(Value *v)
+{
+    if (v == NULL)
+        return NULL;
+
+    vector<Value*> order;
+    postorder(v, &order);
+    for (size_t i = 0; i < order.size(); ++i) {
+        Value *u = order[i];
+        if (mbamemo.count(u))
+            continue;
+        Value *r = u;
+        if (u->opr != NULL) {
+            OperKey key;
+            key.opty = u->opr->opty;
+            bool changed = false;
+            for (int j = 0; j < 3; ++j) {
+                key.val[j] = u->opr->val[j] == NULL ? NULL : mbamemo[u->opr->val[j]];
+                changed |= key.val[j] != u->opr->val[j];
+            }
+            if (changed)
+                r = buildop(key);
+        }
+        if (r->opr != NULL && ismba(r->opr->opty)) {
+            Value *s = reduceMBA(r);
+            if (s != NULL) {
+                r = s;
+                ++nmba;
+            }
+        }
+        mbamemo[u] = r;
+        if (!mbamemo.count(r))
+            mbamemo[r] = r;
+    }
+    return mbamemo[v];
+}
+
+// ********************************
+//  Concolic mode
+// ********************************
+
+// Only the chosen registers and memory ranges are symbolic. Everything else
+// is replaced by its concrete value from the trace after each instruction,
+// so formulas keep only the parts that depend on the chosen inputs.
+void SEEngine::setConcolic(const vector<Register> &regs, const vector<AddrRange> &mems)
+{
+    concolic = true;
+    symregs.clear();
+    for (size_t i = 0; i < regs.size(); ++i) {
+        if (regalias(regs[i]).parent != UNK)
+            symregs.insert(regalias(regs[i]).parent);
+    }
+    symmems = mems;
+}
+
+bool SEEngine::isSymMem(ADDR64 b, ADDR64 e)
+{
+    for (size_t i = 0; i < symmems.size(); ++i) {
+        if (symmems[i].first <= e && b <= symmems[i].second)
+            return true;
+    }
+    return false;
+}
+
+// Concrete value of a tainted node from the values of its operands
+void SEEngine::computeShadow(Value *v)
+{
+    Operation *op = v->opr;
+    ADDR64 c[2] = {0, 0};
+    for (int i = 0; i < 2; ++i) {
+        Value *x = op->val[i];
+        if (x == NULL)
+            continue;
+        if (x->opr == NULL && x->valty == CONCRETE) {
+            c[i] = x->conval;
+            continue;
+        }
+        unordered_map<Value*, ADDR64>::iterator it = shadow.find(x);
+        if (it == shadow.end())
+            return;
+        c[i] = it->second;
+    }
+    shadow[v] = operinfo[op->opty].eval(c[0], c[1]);
+}
+
+// After an instruction: registers that do not depend on the chosen inputs
+// take their value from the trace, the others are checked against it
+void SEEngine::concretize()
+{
+    list<Inst>::iterator nx = next(ip);
+    if (nx == end)
+        return;
+
+    for (int i = RAX; i <= R15; ++i) {
+        Value *v = ctx[i];
+        ADDR64 con = nx->ctxreg[i];
+
+        if (v != NULL && v->tainted) {
+            unordered_map<Value*, ADDR64>::iterator it = shadow.find(v);
+            if (it == shadow.end()) {
+                if (v->opr == NULL)
+                    shadow[v] = con;            // learn the value of a loaded input
+            } else if (it->second != con) {
+                if (++nmismatch <= 10)
+                    cerr << "Warning: Line " << ip->id << ": " << reg2string((Register)i)
+                         << " is 0x" << hex << con << " in the trace but 0x" << it->second
+                         << " in the formula" << dec << endl;
+            }
+            continue;
+        }
+
+        if (v != NULL && v->opr == NULL && v->valty == CONCRETE && v->conval != con &&
+            ++nmismatch <= 10)
+            cerr << "Warning: Line " << ip->id << ": " << reg2string((Register)i)
+                 << " does not match the trace" << endl;
+        if (v != NULL && v->opr == NULL && v->valty == SYMBOL && meminput.count(v))
+            bindMem(v, con);
+        ctx[i] = buildconst(con);
+    }
+}
+
+// A register holding a loaded symbol of memory that is not an input gives
+// its value: the bytes still holding the symbol take that value, so later
+// uses neither keep the symbol nor lose the check against the trace
+void SEEngine::bindMem(Value *v, ADDR64 con)
+{
+    AddrRange r = meminput[v];
+    Value *c = buildconst(con);
+    for (ADDR64 a = r.first; a <= r.second; ++a) {
+        MemByte *mb = findByte(a, false);
+        if (mb != NULL && mb->val == v)
+            findByte(a, true)->val = c;
+    }
+}
+
+// All nodes reachable from root in post-order, operands before their users.
+// Shared nodes are listed once; iterative so deep formulas cannot overflow the stack.
+static void postorder(Value *root, vector<Value*> *order)
+{
+    vector<pair<Value*, int> > stack;
+    unordered_set<Value*> seen;
+    stack.push_back(make_pair(root, 0));
+    seen.insert(root);
+    while (!stack.empty()) {
+        Value *v = stack.back().first;
+        int &next = stack.back().second;
+        if (v->opr != NULL && next < 3) {
+            Value *child = v->opr->val[next++];
+            if (child != NULL && seen.insert(child).second)
+                stack.push_back(make_pair(child, 0));
+            continue;
+        }
+        order->push_back(v);
+        stack.pop_back();
+    }
+}
+
+// Operations of a post-ordered formula that are used more than once
+static void sharednodes(const vector<Value*> &order, vector<Value*> *shared)
+{
+    unordered_map<Value*, int> uses;
+    for (size_t i = 0; i < order.size(); ++i) {
+        Operation *op = order[i]->opr;
+        if (op == NULL) continue;
+        for (int j = 0; j < 3; ++j) {
+            if (op->val[j] != NULL && op->val[j]->opr != NULL)
+                ++uses[op->val[j]];
         }
+    }
+    for (size_t i = 0; i < order.size(); ++i) {
+        unordered_map<Value*, int>::iterator it = uses.find(order[i]);
+        if (it != uses.end() && it->second > 1)
+            shared->push_back(order[i]);
+    }
+}
+
+// Output syntax of printexpr()
+enum ExprStyle {PLAIN, CVC, SMT};
+
+// Width of a symbol as declared to a solver
+static int symwidth(Value *v)
+{
+    return v->len > 0 && v->len < 64 ? v->len : 64;
+}
+
+// A symbol as a 64-bit term. Narrow symbols, such as memory inputs, are
+// zero-extended, which the simplifier and compiled code assume as well.
+static string symterm(Value *v, ExprStyle style, const string &postfix)
+{
+    string name = "sym" + to_string(v->id) + postfix;
+    int ext = 64 - symwidth(v);
+    if (ext == 0 || style == PLAIN)
+        return name;
+    if (style == SMT)
+        return "((_ zero_extend " + to_string(ext) + ") " + name + ")";
+    return "(0bin" + string(ext, '0') + " @ " + name + ")";
+}
+
+// Print one expression; nodes in 'named' other than root are printed by name
+static void printexpr(Value *root, const unordered_set<Value*> &named, ExprStyle style,
+                      const string &postfix, ostream &os)
+{
+    vector<pair<Value*, int> > stack;
+    stack.push_back(make_pair(root, -1));
+    while (!stack.empty()) {
+        Value *v = stack.back().first;
+        int &next = stack.back().second;
+        Operation *op = v->opr;
+        const OperInfo *info = op != NULL ? &operinfo[op->opty] : NULL;
 
-        case 2: {
-            // Handle two-operand instructions (e.g., mov, add, sub, and, or, xor)
-            Operand *op0 = it->oprd[0];
-            Operand *op1 = it->oprd[1];
-            Value *v0, *v1, *res;
-            int nbyte;
-
-            if (it->opcstr == "mov") {
-                if (op0->ty == Operand::REG) {
-                    v1 = (op1->ty == Operand::IMM) ? new Value(CONCRETE, op1->field[0]) : readReg(op1->field[0]);
-                    writeReg(op0->field[0], v1);
-                } else if (op0->ty == Operand::MEM) {
-                    v1 = (op1->ty == Operand::IMM) ? new Value(CONCRETE, op1->field[0]) : readReg(op1->field[0]);
-                    writeMem(it->waddr, op0->bit / 8, v1);
-                } else {
-                    cerr << "mov error: unsupported operand type!" << endl;
-                    return 1;
-                }
-            } else if (it->opcstr == "add" || it->opcstr == "sub" || it->opcstr == "and" || 
-                       it->opcstr == "or" || it->opcstr == "xor" || it->opcstr == "shl" || it->opcstr == "shr") {
-                if (op0->ty == Operand::REG) {
-                    v0 = readReg(op0->field[0]);
-                    v1 = (op1->ty == Operand::IMM) ? new Value(CONCRETE, op1->field[0]) : readReg(op1->field[0]);
-                    res = buildop2(it->opcstr, v0, v1);
-                    writeReg(op0->field[0], res);
-                } else if (op0->ty == Operand::MEM) {
-                    nbyte = op0->bit / 8;
-                    v0 = readMem(it->raddr, nbyte);
-                    v1 = (op1->ty == Operand::IMM) ? new Value(CONCRETE, op1->field[0]) : readReg(op1->field[0]);
-                    res = buildop2(it->opcstr, v0, v1);
-                    writeMem(it->waddr, nbyte, res);
+        if (next < 0) {
+            if (op != NULL && v != root && named.count(v)) {
+                os << "t" << v->id << postfix;
+                stack.pop_back();
+                continue;
+            }
+            if (op == NULL) {
+                if (v->valty == CONCRETE && style != PLAIN) {
+                    char buf[32];
+                    snprintf(buf, sizeof(buf), style == CVC ? "0hex%016llx" : "#x%016llx",
+                             (unsigned long long)v->conval);
+                    os << buf;
+                } else if (v->valty == CONCRETE) {
+                    os << getValueName(v);
                 } else {
-                    cerr << "Error: Unsupported operand type in " << it->opcstr << " instruction!" << endl;
-                    return 1;
+                    os << symterm(v, style, postfix);
                 }
-            } else if (it->opcstr == "cmp") {
-                // cmp: compare op0 and op1 (sets flags, no result stored)
-                v0 = (op0->ty == Operand::REG) ? readReg(op0->field[0]) : readMem(it->raddr, op0->bit / 8);
-                v1 = (op1->ty == Operand::REG) ? readReg(op1->field[0]) : readMem(it->raddr, op1->bit / 8);
-                res = buildop2("sub", v0, v1); // Subtraction to set flags (dummy result)
-            } else if (it->opcstr == "test") {
-                // test: logical AND op0 and op1 (sets flags, no result stored)
-                v0 = (op0->ty == Operand::REG) ? readReg(op0->field[0]) : readMem(it->raddr, op0->bit / 8);
-                v1 = (op1->ty == Operand::REG) ? readReg(op1->field[0]) : readMem(it->raddr, op1->bit / 8);
-                res = buildop2("and", v0, v1); // AND operation to set flags (dummy result)
-            } else {
-                cerr << "Error: Unsupported two-operand instruction " << it->opcstr << endl;
-                return 1;
-            }
-            break;
-        }
-
-        case 3: {
-            // Handle three-operand instructions (e.g., imul reg, reg, imm)
-            Operand *op0 = it->oprd[0];
-            Operand *op1 = it->oprd[1];
-            Operand *op2 = it->oprd[2];
-            Value *v1, *v2, *res;
-
-            if (it->opcstr == "imul") {
-                v1 = readReg(op1->field[0]);
-                v2 = new Value(CONCRETE, op2->field[0]);
-                res = buildop2("imul", v1, v2);
-                writeReg(op0->field[0], res);
-            } else {
-                cerr << "Error: Unsupported three-operand instruction " << it->opcstr << endl;
-                return 1;
+                stack.pop_back();
+                continue;
             }
-            break;
+            if (style == CVC)
+                os << info->cvcpre;
+            else if (style == SMT)
+                os << info->smtpre;
+            else
+                os << "(" << info->name << " ";
+            next = 0;
         }
 
-        default:
-            cerr << "Error: Instruction with unsupported operand count!" << endl;
-            return 1;
+        if (next < info->arity && op->val[next] != NULL) {
+            if (next > 0)
+                os << (style == CVC ? ", " : " ");
+            Value *child = op->val[next++];
+            stack.push_back(make_pair(child, -1));
+            continue;
         }
+        os << (style == CVC ? info->cvcpost : style == SMT ? info->smtpost : ")");
+        stack.pop_back();
     }
-    return 0;
 }
 
-// Recursively traverse each operand of v and print it as a parenthesized formula
-void traverse(Value *v)
+// Print v as a parenthesized formula. Subterms used more than once are
+// printed once as "tN = ..." lines ahead of the formula and referred to by name.
+void traverse(Value *v, ostream &os)
 {
     if (v == NULL) return;
 
-    Operation *op = v->opr;
-    if (op == NULL) {
-        if (v->valty == CONCRETE) {
-            cout << v->conval;
-        } else {
-            cout << "sym" << v->id;
-        }
-    } else {
-        cout << "(" << op->opty << " ";
-        traverse(op->val[0]);
-        cout << " ";
-        traverse(op->val[1]);
-        cout << ")";
+    vector<Value*> order, shared;
+    postorder(v, &order);
+    sharednodes(order, &shared);
+    unordered_set<Value*> named(shared.begin(), shared.end());
+
+    for (size_t i = 0; i < shared.size(); ++i) {
+        os << "t" << shared[i]->id << " = ";
+        printexpr(shared[i], named, PLAIN, "", os);
+        os << endl;
     }
+    printexpr(v, named, PLAIN, "", os);
 }
 
-// Recursively traverse for showing SE results, including hybrid values
-void traverse2(Value *v)
+// Value of a register given by name, NULL if there is no such register
+Value *SEEngine::getValue(string s)
 {
-    if (v == NULL) return;
-
-    Operation *op = v->opr;
-    if (op == NULL) {
-        if (v->valty == CONCRETE) {
-            cout << v->conval;
-        } else if (v->valty == SYMBOL) {
-            cout << "sym" << v->id << " ";
-        } else if (v->valty == HYBRID) {
-            cout << "[" << "hyb" << v->id << " ";
-            for (auto &child : v->childs) {
-                cout << "[" << child.first.first << "," << child.first.second << "]:";
-                traverse2(child.second);
-            }
-            cout << "]";
-        } else {
-            cout << "unknown type" << endl;
-            return;
-        }
-    } else {
-        cout << "(" << op->opty << " ";
-        traverse2(op->val[0]);
-        cout << " ";
-        traverse2(op->val[1]);
-        cout << ")";
-    }
+    Register reg = string2reg(s);
+    if (regalias(reg).parent == UNK || ctx[regalias(reg).parent] == NULL)
+        return NULL;
+    return readReg(reg);
 }
+
 void SEEngine::outputFormula(string reg)
 {
-    if (ctx.find(reg) == ctx.end()) {
+    Value *v = getValue(reg);
+    if (v == NULL) {
         cerr << "Error: Register " << reg << " not found!" << endl;
         return;
     }
 
-    Value *v = ctx[reg];
     cout << reg << " = sym" << v->id << " =" << endl;
-    traverse(v);
+    traverse(v, cout);
     cout << endl;
 }
-void SEEngine::dumpreg(string reg)
+void SEEngine::dumpreg(string reg, ostream &os)
 {
-    if (ctx.find(reg) == ctx.end()) {
+    Value *v = getValue(reg);
+    if (v == NULL) {
         cerr << "Error: Register " << reg << " not found!" << endl;
         return;
     }
 
-    Value *v = ctx[reg];
-    cout << "Register " << reg << " = " << endl;
-    traverse2(v);
-    cout << endl;
+    os << "Register " << reg << " = " << endl;
+    traverse(v, os);
+    os << endl;
 }
 vector<Value*> SEEngine::getAllOutput()
 {
@@ -959,24 +2910,17 @@ vector<Value*> SEEngine::getAllOutput()
     Value *v;
 
     // Symbols in general-purpose registers
-    vector<string> registers = {
-        "eax", "ebx", "ecx", "edx",    // 32-bit registers
-        "rax", "rbx", "rcx", "rdx",    // 64-bit registers
-        "esi", "edi", "esp", "ebp",    // Other 32-bit registers
-        "rsi", "rdi", "rsp", "rbp"     // Corresponding 64-bit registers
-    };
-
-    for (const auto &reg : registers) {
-        if (ctx.find(reg) != ctx.end()) {
-            v = ctx[reg];
-            if (v->opr != NULL) {
-                outputs.push_back(v);
-            }
+    for (int i = RAX; i <= R15; ++i) {
+        v = ctx[i];
+        if (v != NULL && v->opr != NULL) {
+            outputs.push_back(v);
         }
     }
 
     // Symbols in memory
-    for (auto const &x : mem) {
+    vector<pair<AddrRange, Value*> > memvals;
+    getMemValues(&memvals);
+    for (auto const &x : memvals) {
         v = x.second;
         if (v->opr != NULL) {
             outputs.push_back(v);
@@ -987,15 +2931,9 @@ vector<Value*> SEEngine::getAllOutput()
 }
 void SEEngine::printAllRegFormulas()
 {
-    vector<string> registers = {
-        "eax", "ebx", "ecx", "edx",    // 32-bit registers
-        "esi", "edi", "esp", "ebp",    // Other 32-bit registers
-        "rax", "rbx", "rcx", "rdx",    // 64-bit registers
-        "rsi", "rdi", "rsp", "rbp"     // Other 64-bit registers
-    };
-
-    for (const auto &reg : registers) {
-        if (ctx.find(reg) != ctx.end()) {
+    for (int i = RAX; i <= R15; ++i) {
+        string reg = reg2string((Register)i);
+        if (ctx[i] != NULL) {
             cout << reg << ": ";
             outputFormula(reg);
             printInputSymbols(reg);
@@ -1005,17 +2943,19 @@ void SEEngine::printAllRegFormulas()
 }
 void SEEngine::printAllMemFormulas()
 {
-    if (mem.empty()) {
+    vector<pair<AddrRange, Value*> > memvals;
+    getMemValues(&memvals);
+    if (memvals.empty()) {
         cout << "No symbolic values in memory." << endl;
         return;
     }
 
-    for (auto const &x : mem) {
+    for (auto const &x : memvals) {
         AddrRange ar = x.first;
         Value *v = x.second;
-        printf("Memory [%x, %x]: ", ar.first, ar.second);
+        printf("Memory [%llx, %llx]: ", (unsigned long long)ar.first, (unsigned long long)ar.second);
         cout << "sym" << v->id << " =" << endl;
-        traverse(v);
+        traverse(v, cout);
         cout << endl;
     }
 }
@@ -1026,41 +2966,24 @@ set<Value*> *getInputs(Value *output)
         return new set<Value*>;
     }
 
-    queue<Value*> que;
     set<Value*> *inputset = new set<Value*>;
-    set<Value*> visited;  // To track visited nodes and avoid infinite loops
-
-    que.push(output);
-    visited.insert(output);
-
-    while (!que.empty()) {
-        Value *v = que.front();
-        Operation *op = v->opr;
-        que.pop();
-
-        if (op == NULL) {
-            if (v->valty == SYMBOL)
-                inputset->insert(v);
-        } else {
-            for (int i = 0; i < 3; ++i) {
-                if (op->val[i] != NULL && visited.find(op->val[i]) == visited.end()) {
-                    que.push(op->val[i]);
-                    visited.insert(op->val[i]);
-                }
-            }
-        }
+    vector<Value*> order;
+    postorder(output, &order);
+    for (size_t i = 0; i < order.size(); ++i) {
+        if (order[i]->opr == NULL && order[i]->valty == SYMBOL)
+            inputset->insert(order[i]);
     }
 
     return inputset;
 }
 void SEEngine::printInputSymbols(string output)
 {
-    if (ctx.find(output) == ctx.end()) {
+    Value *v = getValue(output);
+    if (v == NULL) {
         cerr << "Error: Register '" << output << "' not found in context." << endl;
         return;
     }
 
-    Value *v = ctx[output];
     set<Value*> *insyms = getInputs(v);
 
     if (insyms->empty()) {
@@ -1092,8 +3015,13 @@ void SEEngine::printformula(Value *v)
             printf("[%llx, %llx]\n", it1->second.first, it1->second.second);  // 64-bit addresses
         } else {
             map<Value*, string>::iterator it2 = reginput.find(*it);
+            map<Value*, int>::iterator it3 = unknowninput.find(*it);
             if (it2 != reginput.end()) {
                 cout << it2->second << endl;
+            } else if (it3 != unknowninput.end()) {
+                cout << "result of line " << it3->second << endl;
+            } else if (cpinput.count(*it)) {
+                cout << "checkpoint of sym" << cpinput[*it]->id << endl;
             } else {
                 cout << "Unknown input source." << endl;
             }
@@ -1102,82 +3030,163 @@ void SEEngine::printformula(Value *v)
 
     cout << endl;
     cout << "sym" << v->id << " =" << endl;
-    traverse(v);
+    traverse(v, cout);
     cout << endl;
 
     delete insyms;
 }
+// The value of memory [addr1, addr2], NULL if nothing was stored there
+Value *SEEngine::getMemValue(ADDR64 addr1, ADDR64 addr2)
+{
+    bool found = false;
+    for (ADDR64 a = addr1; a <= addr2 && !found; ++a)
+        found = findByte(a, false) != NULL && findByte(a, false)->val != NULL;
+    if (!found || addr2 < addr1 || addr2 - addr1 >= 8)
+        return NULL;
+    return readMem(addr1, addr2 - addr1 + 1);
+}
+
 void SEEngine::printMemFormula(ADDR64 addr1, ADDR64 addr2)
 {
-    AddrRange ar(addr1, addr2);
-    if (mem.find(ar) == mem.end()) {
-        cerr << "Error: No value found for the memory range [" << hex << addr1 << ", " << addr2 << "]." << endl;
+    Value *v = getMemValue(addr1, addr2);
+    if (v == NULL) {
+        cerr << "Error: No value found for the memory range [" << hex << addr1 << ", " << addr2 << "]." << dec << endl;
         return;
     }
-
-    Value *v = mem[ar];
     printformula(v);
 }
-ADDR64 eval(Value *v, map<Value*, ADDR64> *inmap)
+// ********************************
+//  Compiled formulas
+// ********************************
+
+// Compile f once; later calls return the cached code
+FormulaCode *SEEngine::compile(Value *f)
 {
-    if (v == NULL) {
-        cerr << "Error: Value is NULL." << endl;
-        return 0;
+    unordered_map<Value*, FormulaCode*>::iterator cit = codecache.find(f);
+    if (cit != codecache.end())
+        return cit->second;
+
+    FormulaCode *fc = new FormulaCode();
+    unordered_map<Value*, int> slot;
+    vector<Value*> leaves, ops;
+
+    vector<Value*> order;
+    postorder(f, &order);
+    for (size_t i = 0; i < order.size(); ++i) {
+        if (order[i]->opr == NULL)
+            leaves.push_back(order[i]);
+        else
+            ops.push_back(order[i]);
     }
 
-    Operation *op = v->opr;
-    if (op == NULL) {
-        if (v->valty == CONCRETE) {
-            return stoul(v->conval, 0, 16);
-        } else {
-            return (*inmap)[v];
+    for (size_t i = 0; i < leaves.size(); ++i) {
+        if (leaves[i]->valty != CONCRETE)
+            fc->inputs.push_back(leaves[i]);
+    }
+    sort(fc->inputs.begin(), fc->inputs.end());      // same order as getInputs()
+    for (size_t i = 0; i < fc->inputs.size(); ++i) {
+        slot[fc->inputs[i]] = i;
+        int len = fc->inputs[i]->len;
+        fc->inmask.push_back(len > 0 && len < 64 ? ((ADDR64)1 << len) - 1 : ~(ADDR64)0);
+    }
+
+    int n = fc->inputs.size();
+    for (size_t i = 0; i < leaves.size(); ++i) {
+        if (leaves[i]->valty == CONCRETE) {
+            slot[leaves[i]] = n++;
+            fc->consts.push_back(leaves[i]->conval);
         }
-    } else {
-        ADDR64 op0 = 0, op1 = 0;
-
-        if (op->val[0] != NULL) op0 = eval(op->val[0], inmap);
-        if (op->val[1] != NULL) op1 = eval(op->val[1], inmap);
-
-        if (op->opty == "add") {
-            return op0 + op1;
-        } else if (op->opty == "sub") {
-            return op0 - op1;
-        } else if (op->opty == "imul") {
-            return op0 * op1;
-        } else if (op->opty == "div") {
-            if (op1 == 0) {
-                cerr << "Error: Division by zero." << endl;
-                return 0;
-            }
-            return op0 / op1;
-        } else if (op->opty == "mod") {
-            if (op1 == 0) {
-                cerr << "Error: Modulus by zero." << endl;
-                return 0;
-            }
-            return op0 % op1;
-        } else if (op->opty == "xor") {
-            return op0 ^ op1;
-        } else if (op->opty == "and") {
-            return op0 & op1;
-        } else if (op->opty == "or") {
-            return op0 | op1;
-        } else if (op->opty == "shl") {
-            return op0 << op1;
-        } else if (op->opty == "shr") {
-            return op0 >> op1;
-        } else if (op->opty == "neg") {
-            return ~op0 + 1;
-        } else if (op->opty == "inc") {
-            return op0 + 1;
-        } else if (op->opty == "dec") {
-            return op0 - 1;
-        } else {
-            cerr << "Error: Unsupported instruction '" << op->opty << "' encountered during evaluation." << endl;
-            return 0;
+    }
+    for (size_t i = 0; i < ops.size(); ++i) {
+        Operation *op = ops[i]->opr;
+        CodeInst ci;
+        ci.opty = op->opty;
+        ci.dst = n;
+        ci.a = slot[op->val[0]];
+        ci.b = op->val[1] != NULL ? slot[op->val[1]] : ci.a;
+        fc->code.push_back(ci);
+        slot[ops[i]] = n++;
+    }
+    fc->nslots = n;
+    fc->result = slot[f];
+
+    codecache[f] = fc;
+    return fc;
+}
+
+// Run compiled code on one input vector
+ADDR64 runCode(FormulaCode *fc, const ADDR64 *input)
+{
+    vector<ADDR64> slots(fc->nslots);
+    size_t nin = fc->inputs.size();
+    for (size_t j = 0; j < nin; ++j)
+        slots[j] = input[j] & fc->inmask[j];
+    copy(fc->consts.begin(), fc->consts.end(), slots.begin() + nin);
+
+    for (size_t i = 0, max = fc->code.size(); i < max; ++i) {
+        const CodeInst &ci = fc->code[i];
+        slots[ci.dst] = operinfo[ci.opty].eval(slots[ci.a], slots[ci.b]);
+    }
+    return slots[fc->result];
+}
+
+#define LANES 64
+
+// Apply one operation to a block of lanes. The loops have no calls or
+// branches in them, so the compiler can vectorize them.
+static void runLanes(OperTy opty, ADDR64 *d, const ADDR64 *a, const ADDR64 *b, int n)
+{
+    switch (opty) {
+    case ADD:   for (int i = 0; i < n; ++i) d[i] = a[i] + b[i]; break;
+    case SUB:   for (int i = 0; i < n; ++i) d[i] = a[i] - b[i]; break;
+    case IMUL:  for (int i = 0; i < n; ++i) d[i] = a[i] * b[i]; break;
+    case AND:   for (int i = 0; i < n; ++i) d[i] = a[i] & b[i]; break;
+    case OR:    for (int i = 0; i < n; ++i) d[i] = a[i] | b[i]; break;
+    case XOR:   for (int i = 0; i < n; ++i) d[i] = a[i] ^ b[i]; break;
+    case NEG:   for (int i = 0; i < n; ++i) d[i] = ~a[i] + 1; break;
+    case NOT:   for (int i = 0; i < n; ++i) d[i] = ~a[i]; break;
+    case INC:   for (int i = 0; i < n; ++i) d[i] = a[i] + 1; break;
+    case DEC:   for (int i = 0; i < n; ++i) d[i] = a[i] - 1; break;
+    case MOV:   for (int i = 0; i < n; ++i) d[i] = a[i]; break;
+    case SHL:   for (int i = 0; i < n; ++i) d[i] = b[i] >= 64 ? 0 : a[i] << b[i]; break;
+    case SHR:   for (int i = 0; i < n; ++i) d[i] = b[i] >= 64 ? 0 : a[i] >> b[i]; break;
+    case SAR:
+        for (int i = 0; i < n; ++i)
+            d[i] = (ADDR64)((int64_t)a[i] >> (b[i] >= 64 ? 63 : b[i]));
+        break;
+    case DIV:   for (int i = 0; i < n; ++i) d[i] = b[i] == 0 ? 0 : a[i] / b[i]; break;
+    case MOD:   for (int i = 0; i < n; ++i) d[i] = b[i] == 0 ? 0 : a[i] % b[i]; break;
+    case BSWAP: for (int i = 0; i < n; ++i) d[i] = __builtin_bswap64(a[i]); break;
+    default:    for (int i = 0; i < n; ++i) d[i] = 0; break;
+    }
+}
+
+// Run compiled code on n input vectors. input[k * nin + j] is input j of
+// vector k; out[k] receives its result.
+void runCodeBatch(FormulaCode *fc, const ADDR64 *input, int n, ADDR64 *out)
+{
+    size_t nin = fc->inputs.size();
+    vector<ADDR64> slots((size_t)fc->nslots * LANES);
+
+    for (int base = 0; base < n; base += LANES) {
+        int lanes = min(LANES, n - base);
+        for (size_t j = 0; j < nin; ++j) {
+            for (int k = 0; k < lanes; ++k)
+                slots[j * LANES + k] = input[(size_t)(base + k) * nin + j] & fc->inmask[j];
+        }
+        for (size_t j = 0; j < fc->consts.size(); ++j)
+            fill_n(&slots[(nin + j) * LANES], lanes, fc->consts[j]);
+
+        for (size_t i = 0, max = fc->code.size(); i < max; ++i) {
+            const CodeInst &ci = fc->code[i];
+            runLanes(ci.opty, &slots[(size_t)ci.dst * LANES], &slots[(size_t)ci.a * LANES],
+                     &slots[(size_t)ci.b * LANES], lanes);
         }
+        copy(&slots[(size_t)fc->result * LANES], &slots[(size_t)fc->result * LANES] + lanes,
+             out + base);
     }
 }
+
 // Given inputs, concrete compute the output value of a formula
 ADDR64 SEEngine::conexec(Value *f, map<Value*, ADDR64> *inmap)
 {
@@ -1186,21 +3195,187 @@ ADDR64 SEEngine::conexec(Value *f, map<Value*, ADDR64> *inmap)
         return 0;
     }
 
-    set<Value*> *inputsym = getInputs(f);
-    set<Value*> inmapkeys;
-    for (map<Value*, ADDR64>::iterator it = inmap->begin(); it != inmap->end(); ++it) {
-        inmapkeys.insert(it->first);
+    FormulaCode *fc = compile(f);
+    if (inmap->size() != fc->inputs.size()) {
+        cerr << "Error: Mismatch in number of input symbols and parameters." << endl;
+        return 0;
     }
 
-    if (inmapkeys != *inputsym) {
-        cerr << "Error: Mismatch in number of input symbols and parameters." << endl;
-        delete inputsym;
+    vector<ADDR64> input(fc->inputs.size());
+    for (size_t i = 0; i < fc->inputs.size(); ++i) {
+        map<Value*, ADDR64>::iterator it = inmap->find(fc->inputs[i]);
+        if (it == inmap->end()) {
+            cerr << "Error: Mismatch in number of input symbols and parameters." << endl;
+            return 0;
+        }
+        input[i] = it->second;
+    }
+    return runCode(fc, input.data());
+}
+
+// Compute f for n input vectors at once. Inputs are in the order of
+// getInputVector(f): input[k * ninputs + j] is input j of vector k.
+void SEEngine::conexecBatch(Value *f, const vector<ADDR64> &input, int n, vector<ADDR64> *out)
+{
+    FormulaCode *fc = compile(f);
+    out->resize(n);
+    if (input.size() < (size_t)n * fc->inputs.size()) {
+        cerr << "Error: Too few inputs for " << n << " vectors." << endl;
+        return;
+    }
+    runCodeBatch(fc, input.data(), n, out->data());
+}
+
+// Input values likely to expose differences: zero, all ones, sign and
+// carry boundaries of each operand size
+static const ADDR64 cornervals[] = {
+    0, ~0ULL, 1, 2, 0xff, 0x80, 0xffff, 0x8000, 0xffffffff, 0x80000000,
+    0x7fffffffffffffffULL, 0x8000000000000000ULL
+};
+
+// The k-th test value: corner cases first, then random values of varying bit density
+static ADDR64 testval(int k, mt19937_64 &rng)
+{
+    int ncorner = sizeof(cornervals) / sizeof(cornervals[0]);
+    if (k < 64)
+        return cornervals[rng() % ncorner];
+    switch (k % 4) {
+    case 0:  return rng() & rng();
+    case 1:  return rng() | rng();
+    case 2:  return rng() & 0xff;
+    default: return rng();
+    }
+}
+
+// Bit k of a list of inputs, which is bit k%64 of input k/64
+static inline int getinbit(const ADDR64 *in, int k)
+{
+    return (in[k / 64] >> (k % 64)) & 1;
+}
+
+#define TESTCHUNK 256
+
+// Remove the bit mappings in 'result' that some concrete input refutes.
+// ntest input vectors for f1, corner cases and random values, are run
+// through both formulas with the inputs of f2 set through each mapping's
+// input bit map; a mapping survives only if all its output bits agree
+// every time. Mappings are tested in parallel. Survivors still need a
+// proof, e.g. by checkBitSMT(). Returns the number of mappings removed.
+int refuteBitMaps(SEEngine *se1, Value *f1, SEEngine *se2, Value *f2,
+                  vector<Value*> *inv1, vector<Value*> *inv2, list<FullMap> *result, int ntest)
+{
+    int nin1 = inv1->size(), nin2 = inv2->size();
+    vector<FullMap*> maps;
+    for (list<FullMap>::iterator it = result->begin(); it != result->end(); ++it)
+        maps.push_back(&*it);
+    if (maps.empty() || ntest <= 0)
         return 0;
+
+    // Narrow symbols only take values that fit their width
+    vector<ADDR64> mask1(nin1), mask2(nin2);
+    for (int j = 0; j < nin1; ++j)
+        mask1[j] = symwidth((*inv1)[j]) < 64 ? (1ULL << symwidth((*inv1)[j])) - 1 : ~0ULL;
+    for (int j = 0; j < nin2; ++j)
+        mask2[j] = symwidth((*inv2)[j]) < 64 ? (1ULL << symwidth((*inv2)[j])) - 1 : ~0ULL;
+
+    // f1 sees the same vectors for every mapping
+    mt19937_64 rng(1);
+    vector<ADDR64> in1((size_t)ntest * nin1), out1;
+    for (int k = 0; k < ntest; ++k) {
+        for (int j = 0; j < nin1; ++j)
+            in1[(size_t)k * nin1 + j] = testval(k, rng) & mask1[j];
     }
+    se1->conexecBatch(f1, in1, ntest, &out1);
+
+    // Compile f2 before the workers start, they only read the code cache
+    vector<ADDR64> noinput, nooutput;
+    se2->conexecBatch(f2, noinput, 0, &nooutput);
+
+    vector<char> refuted(maps.size(), 0);
+    atomic<int> nextmap(0);
+    auto worker = [&]() {
+        vector<ADDR64> in2, out2;
+        vector<pair<int,int> > inbits, outbits;
+        int m;
+        while ((m = nextmap++) < (int)maps.size()) {
+            // A bit of f2 mapped from several bits of f1 forces them to be
+            // equal, and a bit beyond the width of its symbol forces them
+            // to zero; vectors that break this prove nothing
+            inbits.clear();
+            set<int> targets;
+            bool injective = true;
+            for (map<int,int>::const_iterator it = maps[m]->first.begin(); it != maps[m]->first.end(); ++it) {
+                if (it->first < nin1 * 64 && it->second < nin2 * 64) {
+                    inbits.push_back(*it);
+                    injective = injective && targets.insert(it->second).second &&
+                                getinbit(mask2.data(), it->second);
+                }
+            }
+            outbits.assign(maps[m]->second.begin(), maps[m]->second.end());
+
+            // Corner cases alone refute most mappings, so they go first
+            mt19937_64 rng(m + 2);
+            for (int base = 0, n; base < ntest && !refuted[m]; base += n) {
+                n = min(base == 0 ? LANES : TESTCHUNK, ntest - base);
+
+                // Unmapped input bits of f2 are free, so they get random values
+                in2.resize((size_t)n * nin2);
+                for (int k = 0; k < n; ++k) {
+                    const ADDR64 *a = &in1[(size_t)(base + k) * nin1];
+                    ADDR64 *b = &in2[(size_t)k * nin2];
+                    for (int j = 0; j < nin2; ++j)
+                        b[j] = testval(base + k, rng);
+                    for (size_t i = 0; i < inbits.size(); ++i) {
+                        ADDR64 bit = 1ULL << (inbits[i].second % 64);
+                        if (getinbit(a, inbits[i].first))
+                            b[inbits[i].second / 64] |= bit;
+                        else
+                            b[inbits[i].second / 64] &= ~bit;
+                    }
+                    for (int j = 0; j < nin2; ++j)
+                        b[j] &= mask2[j];
+                }
+                se2->conexecBatch(f2, in2, n, &out2);
+
+                for (int k = 0; k < n && !refuted[m]; ++k) {
+                    const ADDR64 *a = &in1[(size_t)(base + k) * nin1], *b = &in2[(size_t)k * nin2];
+                    bool valid = true;
+                    for (size_t i = 0; i < inbits.size() && valid && !injective; ++i)
+                        valid = getinbit(a, inbits[i].first) == getinbit(b, inbits[i].second);
+                    if (!valid)
+                        continue;
+                    for (size_t i = 0; i < outbits.size(); ++i) {
+                        if (((out1[base + k] >> outbits[i].first) & 1) !=
+                            ((out2[k] >> outbits[i].second) & 1)) {
+                            refuted[m] = 1;
+                            break;
+                        }
+                    }
+                }
+            }
+        }
+    };
 
-    ADDR64 result = eval(f, inmap);
-    delete inputsym;
-    return result;
+    int nthread = thread::hardware_concurrency();
+    if (nthread < 1) nthread = 1;
+    if (nthread > (int)maps.size()) nthread = maps.size();
+    vector<thread> threads;
+    for (int i = 0; i < nthread; ++i)
+        threads.push_back(thread(worker));
+    for (int i = 0; i < nthread; ++i)
+        threads[i].join();
+
+    int nremoved = 0;
+    list<FullMap>::iterator it = result->begin();
+    for (size_t m = 0; m < maps.size(); ++m) {
+        if (refuted[m]) {
+            it = result->erase(it);
+            ++nremoved;
+        } else {
+            ++it;
+        }
+    }
+    return nremoved;
 }
 // Build a map based on a variable vector and an input vector
 map<Value*, ADDR64> buildinmap(vector<Value*> *vv, vector<ADDR64> *input)
@@ -1237,137 +3412,73 @@ vector<Value*> getInputVector(Value *f)
 
     return vv;
 }
-string sympostfix;
-// Output the calculation of v as a formula in CVC format
-void outputCVC(Value *v, FILE *fp)
+// Output the calculation of v as a formula in CVC format. Subterms used more
+// than once are bound with LET, so the output is linear in the size of the DAG.
+// postfix is appended to every name to keep the two sides of a query apart.
+void outputCVC(Value *v, const string &postfix, ostream &os)
 {
     if (v == NULL) return;
 
-    Operation *op = v->opr;
-    if (op == NULL) {
-        if (v->valty == CONCRETE) {
-            ADDR64 i = stoull(v->conval, 0, 16);  // Use 64-bit address
-            fprintf(fp, "0hex%016llx", i);        // 16 hex digits for 64-bit
-        } else {
-            fprintf(fp, "sym%d%s", v->id, sympostfix.c_str());
-        }
-    } else {
-        if (op->opty == "add") {
-            fprintf(fp, "BVPLUS(64, ");
-            outputCVC(op->val[0], fp);
-            fprintf(fp, ", ");
-            outputCVC(op->val[1], fp);
-            fprintf(fp, ")");
-        } else if (op->opty == "sub") {
-            fprintf(fp, "BVSUB(64, ");
-            outputCVC(op->val[0], fp);
-            fprintf(fp, ", ");
-            outputCVC(op->val[1], fp);
-            fprintf(fp, ")");
-        } else if (op->opty == "imul") {
-            fprintf(fp, "BVMULT(64, ");
-            outputCVC(op->val[0], fp);
-            fprintf(fp, ", ");
-            outputCVC(op->val[1], fp);
-            fprintf(fp, ")");
-        } else if (op->opty == "xor") {
-            fprintf(fp, "BVXOR(");
-            outputCVC(op->val[0], fp);
-            fprintf(fp, ", ");
-            outputCVC(op->val[1], fp);
-            fprintf(fp, ")");
-        } else if (op->opty == "and") {
-            fprintf(fp, "BVAND(");
-            outputCVC(op->val[0], fp);
-            fprintf(fp, ", ");
-            outputCVC(op->val[1], fp);
-            fprintf(fp, ")");
-        } else if (op->opty == "or") {
-            fprintf(fp, "BVOR(");
-            outputCVC(op->val[0], fp);
-            fprintf(fp, ", ");
-            outputCVC(op->val[1], fp);
-            fprintf(fp, ")");
-        } else if (op->opty == "neg") {
-            fprintf(fp, "BVNEG(");
-            outputCVC(op->val[0], fp);
-            fprintf(fp, ")");
-        } else if (op->opty == "shl") {
-            fprintf(fp, "BVSHL(");
-            outputCVC(op->val[0], fp);
-            fprintf(fp, ", ");
-            outputCVC(op->val[1], fp);
-            fprintf(fp, ")");
-        } else if (op->opty == "shr") {
-            fprintf(fp, "BVLSHR(");  // Logical shift right
-            outputCVC(op->val[0], fp);
-            fprintf(fp, ", ");
-            outputCVC(op->val[1], fp);
-            fprintf(fp, ")");
-        } else if (op->opty == "sar") {  // Support for arithmetic shift right
-            fprintf(fp, "BVASHR(");
-            outputCVC(op->val[0], fp);
-            fprintf(fp, ", ");
-            outputCVC(op->val[1], fp);
-            fprintf(fp, ")");
-        } else if (op->opty == "inc") {
-            fprintf(fp, "BVPLUS(64, ");
-            outputCVC(op->val[0], fp);
-            fprintf(fp, ", 0hex0000000000000001)");
-        } else if (op->opty == "dec") {
-            fprintf(fp, "BVSUB(64, ");
-            outputCVC(op->val[0], fp);
-            fprintf(fp, ", 0hex0000000000000001)");
-        } else if (op->opty == "not") {
-            fprintf(fp, "BVNOT(");
-            outputCVC(op->val[0], fp);
-            fprintf(fp, ")");
-        } else {
-            cerr << "Error: Instruction " << op->opty << " is not interpreted in CVC!" << endl;
-        }
+    vector<Value*> order, shared;
+    postorder(v, &order);
+    sharednodes(order, &shared);
+    unordered_set<Value*> named(shared.begin(), shared.end());
+
+    if (!shared.empty())
+        os << "(";
+    for (size_t i = 0; i < shared.size(); ++i) {
+        os << "LET t" << shared[i]->id << postfix << " = ";
+        printexpr(shared[i], named, CVC, postfix, os);
+        os << " IN (" << endl;
     }
+    printexpr(v, named, CVC, postfix, os);
+    for (size_t i = 0; i < shared.size(); ++i)
+        os << ")";
+    if (!shared.empty())
+        os << ")";
 }
 // Output the calculation of the formula 'f' as a CVC formula
 void outputCVCFormula(Value *f)
 {
-    const char *cvcfile = "formula.cvc";
-    FILE *fp = fopen(cvcfile, "w");
-
-    outputCVC(f, fp);
+    ofstream os("formula.cvc");
 
-    fclose(fp);
+    outputCVC(f, "", os);
 }
 
 // Output a CVC formula to check the equivalence of f1 and f2 using the variable mapping in 'm'
 void outputChkEqCVC(Value *f1, Value *f2, map<int,int> *m)
 {
-    const char *cvcfile = "ChkEq.cvc";
-    FILE *fp = fopen(cvcfile, "w");
-
-    // Declare the variables as 64-bit BV (bit vectors)
-    for (map<int,int>::iterator it = m->begin(); it != m->end(); ++it) {
-        fprintf(fp, "sym%da: BV(64);\n", it->first);  // Use 64-bit bit vector
-        fprintf(fp, "sym%db: BV(64);\n", it->second); // Use 64-bit bit vector
-    }
-    fprintf(fp, "\n");
+    ofstream os("ChkEq.cvc");
+
+    vector<Value*> inv1 = getInputVector(f1), inv2 = getInputVector(f2);
+    map<int, Value*> byid1, byid2;
+    for (size_t i = 0; i < inv1.size(); ++i)
+        byid1[inv1[i]->id] = inv1[i];
+    for (size_t i = 0; i < inv2.size(); ++i)
+        byid2[inv2[i]->id] = inv2[i];
+
+    // Declare the variables as bit vectors of their width
+    for (size_t i = 0; i < inv1.size(); ++i)
+        os << "sym" << inv1[i]->id << "a: BV(" << symwidth(inv1[i]) << ");" << endl;
+    for (size_t i = 0; i < inv2.size(); ++i)
+        os << "sym" << inv2[i]->id << "b: BV(" << symwidth(inv2[i]) << ");" << endl;
+    os << endl;
 
     // Assert the equivalence between sym%da and sym%db
     for (map<int,int>::iterator it = m->begin(); it != m->end(); ++it) {
-        fprintf(fp, "ASSERT(sym%da = sym%db);\n", it->first, it->second);
+        if (byid1.count(it->first) && byid2.count(it->second))
+            os << "ASSERT(" << symterm(byid1[it->first], CVC, "a") << " = "
+               << symterm(byid2[it->second], CVC, "b") << ");" << endl;
     }
 
-    fprintf(fp, "\nQUERY(\n");
-    sympostfix = "a";  // Add postfix to differentiate variables
-    outputCVC(f1, fp); // Output formula for f1
-    fprintf(fp, "\n=\n");
-    sympostfix = "b";  // Add postfix to differentiate variables
-    outputCVC(f2, fp); // Output formula for f2
-    fprintf(fp, ");\n");
+    os << endl << "QUERY(" << endl;
+    outputCVC(f1, "a", os);     // postfix differentiates the variables of f1 and f2
+    os << endl << "=" << endl;
+    outputCVC(f2, "b", os);
+    os << ");" << endl;
 
     // Request a counterexample for the equivalence check
-    fprintf(fp, "COUNTEREXAMPLE;\n");
-
-    fclose(fp);
+    os << "COUNTEREXAMPLE;" << endl;
 }
 // Output all bit formulas based on the result of variable mapping
 void outputBitCVC(Value *f1, Value *f2, vector<Value*> *inv1, vector<Value*> *inv2,
@@ -1377,74 +3488,345 @@ void outputBitCVC(Value *f1, Value *f2, vector<Value*> *inv1, vector<Value*> *in
     for (list<FullMap>::iterator it = result->begin(); it != result->end(); ++it) {
         // Create a new formula for each mapping result
         string cvcfile = "formula" + to_string(n++) + ".cvc";
-        FILE *fp = fopen(cvcfile.c_str(), "w");
+        ofstream os(cvcfile.c_str());
 
         map<int, int> *inmap = &(it->first);  // Input variables mapping
         map<int, int> *outmap = &(it->second); // Output variables mapping
 
         // Output bit values of the inputs (64-bit now)
         for (int i = 0, max = 64 * inv1->size(); i < max; ++i) {
-            fprintf(fp, "bit%da: BV(1);\n", i);
+            os << "bit" << i << "a: BV(1);" << endl;
         }
         for (int i = 0, max = 64 * inv2->size(); i < max; ++i) {
-            fprintf(fp, "bit%db: BV(1);\n", i);
+            os << "bit" << i << "b: BV(1);" << endl;
         }
 
         // Output inputs mapping
         for (map<int, int>::iterator it = inmap->begin(); it != inmap->end(); ++it) {
-            fprintf(fp, "ASSERT(bit%da = bit%db);\n", it->first, it->second);
+            os << "ASSERT(bit" << it->first << "a = bit" << it->second << "b);" << endl;
         }
-        fprintf(fp, "\n");
+        os << endl;
 
-        fprintf(fp, "\nQUERY(\n");
+        os << endl << "QUERY(" << endl;
 
         // Concatenate bits into a variable in the formula for input vectors
         for (int i = 0, max = inv1->size(); i < max; ++i) {
-            fprintf(fp, "LET %sa = ", getValueName((*inv1)[i]).c_str());
-            for (int j = 0; j < 63; ++j) { // 64-bit concatenation
-                fprintf(fp, "bit%da@", i*64 + j);
+            os << "LET " << getValueName((*inv1)[i]) << "a = ";
+            for (int j = symwidth((*inv1)[i]) - 1; j > 0; --j) { // bit i*64 lowest
+                os << "bit" << i*64 + j << "a@";
             }
-            fprintf(fp, "bit%da IN (\n", i + 63);
+            os << "bit" << i*64 << "a IN (" << endl;
         }
         for (int i = 0, max = inv2->size(); i < max; ++i) {
-            fprintf(fp, "LET %sb = ", getValueName((*inv2)[i]).c_str());
-            for (int j = 0; j < 63; ++j) { // 64-bit concatenation
-                fprintf(fp, "bit%db@", i*64 + j);
+            os << "LET " << getValueName((*inv2)[i]) << "b = ";
+            for (int j = symwidth((*inv2)[i]) - 1; j > 0; --j) { // bit i*64 lowest
+                os << "bit" << i*64 + j << "b@";
             }
-            fprintf(fp, "bit%db IN (\n", i + 63);
+            os << "bit" << i*64 << "b IN (" << endl;
         }
 
         // Output the calculation formulas for f1 and f2
-        fprintf(fp, "LET out1 = ");
-        sympostfix = "a";
-        outputCVC(f1, fp);
-        fprintf(fp, " IN (\n");
+        os << "LET out1 = ";
+        outputCVC(f1, "a", os);
+        os << " IN (" << endl;
 
-        fprintf(fp, "LET out2 = ");
-        sympostfix = "b";
-        outputCVC(f2, fp);
-        fprintf(fp, " IN (\n");
+        os << "LET out2 = ";
+        outputCVC(f2, "b", os);
+        os << " IN (" << endl;
 
         // Output the final equivalence check
         for (map<int, int>::iterator it = outmap->begin(); it != outmap->end(); ++it) {
-            if (next(it, 1) != outmap->end()) {
-                fprintf(fp, "out1[%d:%d] = out2[%d:%d] AND\n", it->first, it->first, it->second, it->second);
-            } else {
-                fprintf(fp, "out1[%d:%d] = out2[%d:%d]\n", it->first, it->first, it->second, it->second);
-            }
+            os << "out1[" << it->first << ":" << it->first << "] = out2["
+               << it->second << ":" << it->second << "]";
+            os << (next(it, 1) != outmap->end() ? " AND" : "") << endl;
         }
 
         // Closing brackets for LET expressions
         for (int i = 0, n = inv1->size() + inv2->size(); i < n; ++i) {
-            fprintf(fp, ")");
+            os << ")";
         }
-        fprintf(fp, ")));\n");
+        os << ")));" << endl;
 
         // Request a counterexample to check for equivalence
-        fprintf(fp, "COUNTEREXAMPLE;");
+        os << "COUNTEREXAMPLE;";
+    }
+}
+// ********************************
+//  SMT-LIB2 output and solver
+// ********************************
+
+// Define v as the 64-bit constant 'name' in SMT-LIB2. Shared subterms get
+// their own define-fun first, so the output is linear in the size of the DAG.
+void outputSMT(Value *v, const string &name, const string &postfix, ostream &os)
+{
+    if (v == NULL) return;
+
+    vector<Value*> order, shared;
+    postorder(v, &order);
+    sharednodes(order, &shared);
+    unordered_set<Value*> named(shared.begin(), shared.end());
+
+    for (size_t i = 0; i < shared.size(); ++i) {
+        os << "(define-fun t" << shared[i]->id << postfix << " () (_ BitVec 64) ";
+        printexpr(shared[i], named, SMT, postfix, os);
+        os << ")" << endl;
+    }
+    os << "(define-fun " << name << " () (_ BitVec 64) ";
+    printexpr(v, named, SMT, postfix, os);
+    os << ")" << endl;
+}
+
+static void declareSMTInputs(const vector<Value*> &inv, const string &postfix, ostream &os)
+{
+    for (size_t i = 0; i < inv.size(); ++i)
+        os << "(declare-const " << getValueName(inv[i]) << postfix << " (_ BitVec "
+           << symwidth(inv[i]) << "))" << endl;
+}
+
+// Output the formula 'f' in SMT-LIB2 as 'out'
+// Several formulas as define-funs, with their inputs declared and the
+// subterms they share defined once
+void outputSMTOutputs(const vector<pair<string, Value*> > &outs, ostream &os)
+{
+    vector<Value*> order, inputs;
+    unordered_set<Value*> seen;
+    for (size_t i = 0; i < outs.size(); ++i) {
+        vector<Value*> o;
+        postorder(outs[i].second, &o);
+        for (size_t j = 0; j < o.size(); ++j) {
+            if (!seen.insert(o[j]).second)
+                continue;
+            order.push_back(o[j]);
+            if (o[j]->opr == NULL && o[j]->valty == SYMBOL)
+                inputs.push_back(o[j]);
+        }
+    }
+    vector<Value*> shared;
+    sharednodes(order, &shared);
+    unordered_set<Value*> named(shared.begin(), shared.end());
+
+    os << "(set-logic QF_BV)" << endl;
+    declareSMTInputs(inputs, "", os);
+    for (size_t i = 0; i < shared.size(); ++i) {
+        os << "(define-fun t" << shared[i]->id << " () (_ BitVec 64) ";
+        printexpr(shared[i], named, SMT, "", os);
+        os << ")" << endl;
+    }
+    for (size_t i = 0; i < outs.size(); ++i) {
+        os << "(define-fun " << outs[i].first << " () (_ BitVec 64) ";
+        printexpr(outs[i].second, named, SMT, "", os);
+        os << ")" << endl;
+    }
+}
+
+void outputSMTFormula(Value *f)
+{
+    ofstream os("formula.smt2");
+
+    os << "(set-logic QF_BV)" << endl;
+    declareSMTInputs(getInputVector(f), "", os);
+    outputSMT(f, "out", "", os);
+}
+
+// Output an SMT-LIB2 query checking the equivalence of f1 and f2 using the
+// variable mapping in 'm'. The query is unsat if they are equivalent.
+void outputChkEqSMT(Value *f1, Value *f2, map<int,int> *m)
+{
+    ofstream os("ChkEq.smt2");
+
+    vector<Value*> inv1 = getInputVector(f1), inv2 = getInputVector(f2);
+    map<int, Value*> byid1, byid2;
+    for (size_t i = 0; i < inv1.size(); ++i)
+        byid1[inv1[i]->id] = inv1[i];
+    for (size_t i = 0; i < inv2.size(); ++i)
+        byid2[inv2[i]->id] = inv2[i];
+
+    os << "(set-logic QF_BV)" << endl;
+    declareSMTInputs(inv1, "a", os);
+    declareSMTInputs(inv2, "b", os);
+    for (map<int,int>::iterator it = m->begin(); it != m->end(); ++it) {
+        if (byid1.count(it->first) && byid2.count(it->second))
+            os << "(assert (= " << symterm(byid1[it->first], SMT, "a") << " "
+               << symterm(byid2[it->second], SMT, "b") << "))" << endl;
+    }
+
+    outputSMT(f1, "out1", "a", os);
+    outputSMT(f2, "out2", "b", os);
+    os << "(assert (not (= out1 out2)))" << endl;
+    os << "(check-sat)" << endl;
+    os << "(get-model)" << endl;
+}
+
+// Bit k of a list of inputs, which is bit k%64 of input k/64. Bits above
+// the width of a narrow input are zero.
+static string smtinbit(const vector<Value*> &inv, int k, const string &postfix)
+{
+    ostringstream ss;
+    if (k % 64 >= symwidth(inv[k / 64]))
+        return "#b0";
+    ss << "((_ extract " << k % 64 << " " << k % 64 << ") "
+       << getValueName(inv[k / 64]) << postfix << ")";
+    return ss.str();
+}
+
+// The check of one bit mapping, to be run between push and pop
+static void smtmapping(const FullMap &fm, const vector<Value*> &inv1,
+                       const vector<Value*> &inv2, ostream &os)
+{
+    for (map<int,int>::const_iterator it = fm.first.begin(); it != fm.first.end(); ++it) {
+        os << "(assert (= " << smtinbit(inv1, it->first, "a") << " "
+           << smtinbit(inv2, it->second, "b") << "))" << endl;
+    }
+    os << "(assert (not (and true";
+    for (map<int,int>::const_iterator it = fm.second.begin(); it != fm.second.end(); ++it) {
+        os << " (= ((_ extract " << it->first << " " << it->first << ") out1) ((_ extract "
+           << it->second << " " << it->second << ") out2))";
+    }
+    os << ")))" << endl;
+    os << "(check-sat)" << endl;
+}
+
+// A solver running as a child process, talking SMT-LIB2 over pipes
+class SMTProcess {
+public:
+    SMTProcess(const char *cmd);
+    ~SMTProcess();
+    bool running() { return pid > 0; }
+    void send(const string &s);
+    string reply();             // next line of output, empty at end of file
+private:
+    pid_t pid;
+    FILE *to, *from;
+};
+
+SMTProcess::SMTProcess(const char *cmd)
+{
+    int in[2], out[2];
+    pid = -1;
+    to = from = NULL;
+    if (pipe(in) < 0)
+        return;
+    if (pipe(out) < 0) {
+        close(in[0]);
+        close(in[1]);
+        return;
+    }
+
+    pid = fork();
+    if (pid == 0) {
+        dup2(in[0], 0);
+        dup2(out[1], 1);
+        close(in[0]); close(in[1]);
+        close(out[0]); close(out[1]);
+        execl("/bin/sh", "sh", "-c", cmd, (char *)NULL);
+        _exit(127);
+    }
+    close(in[0]);
+    close(out[1]);
+    if (pid < 0) {
+        close(in[1]);
+        close(out[0]);
+        return;
+    }
+    to = fdopen(in[1], "w");
+    from = fdopen(out[0], "r");
+}
+
+SMTProcess::~SMTProcess()
+{
+    if (pid <= 0) return;
+    fclose(to);
+    fclose(from);
+    waitpid(pid, NULL, 0);
+}
+
+void SMTProcess::send(const string &s)
+{
+    fputs(s.c_str(), to);
+    fflush(to);
+}
+
+string SMTProcess::reply()
+{
+    char buf[256];
+    if (fgets(buf, sizeof(buf), from) == NULL)
+        return "";
+    string s(buf);
+    while (!s.empty() && isspace((unsigned char)s.back()))
+        s.erase(s.size() - 1);
+    return s;
+}
+
+// Check every candidate bit mapping in 'result' in one solver context: the
+// inputs and both formulas are asserted once, and each mapping is checked
+// between push and pop. Mappings with a counterexample are removed from
+// 'result'. Returns the number of mappings proven equivalent.
+//
+// The solver command comes from MGSE_SOLVER, e.g. "z3 -in" or "cvc5
+// --incremental". Without a working solver the script is written to
+// bitmaps.smt2 instead, 'result' is left alone and -1 is returned.
+int checkBitSMT(Value *f1, Value *f2, vector<Value*> *inv1, vector<Value*> *inv2,
+                list<FullMap> *result)
+{
+    ostringstream pre;
+    pre << "(set-logic QF_BV)" << endl;
+    declareSMTInputs(*inv1, "a", pre);
+    declareSMTInputs(*inv2, "b", pre);
+    outputSMT(f1, "out1", "a", pre);
+    outputSMT(f2, "out2", "b", pre);
+
+    const char *cmd = getenv("MGSE_SOLVER");
+    if (cmd != NULL && *cmd != '\0') {
+        void (*oldpipe)(int) = signal(SIGPIPE, SIG_IGN);     // the solver may exit early
+        SMTProcess solver(cmd);
+        vector<string> answers;
+        if (solver.running()) {
+            solver.send(pre.str());
+            for (list<FullMap>::iterator it = result->begin(); it != result->end(); ++it) {
+                ostringstream ss;
+                ss << "(push 1)" << endl;
+                smtmapping(*it, *inv1, *inv2, ss);
+                solver.send(ss.str());
+                string ans = solver.reply();
+                while (ans.compare(0, 6, "(error") == 0) {
+                    cerr << "Warning: Solver reported " << ans << endl;
+                    ans = solver.reply();
+                }
+                if (ans.empty())
+                    break;
+                answers.push_back(ans);
+                solver.send("(pop 1)\n");
+            }
+        }
+        signal(SIGPIPE, oldpipe);
+
+        if (answers.size() == result->size()) {
+            int nequal = 0;
+            list<FullMap>::iterator it = result->begin();
+            for (size_t i = 0; i < answers.size(); ++i) {
+                if (answers[i] == "sat") {
+                    it = result->erase(it);
+                    continue;
+                }
+                if (answers[i] == "unsat")
+                    ++nequal;
+                else
+                    cerr << "Warning: Solver answered '" << answers[i] << "'" << endl;
+                ++it;
+            }
+            return nequal;
+        }
+        cerr << "Error: Solver '" << cmd << "' failed, writing bitmaps.smt2 instead." << endl;
+    }
 
-        fclose(fp);
+    ofstream os("bitmaps.smt2");
+    os << pre.str();
+    for (list<FullMap>::iterator it = result->begin(); it != result->end(); ++it) {
+        os << "(push 1)" << endl;
+        smtmapping(*it, *inv1, *inv2, os);
+        os << "(pop 1)" << endl;
     }
+    return -1;
 }
 // Show inputs in memory
 void SEEngine::showMemInput()
@@ -1456,3 +3838,241 @@ void SEEngine::showMemInput()
     }
     cout << endl;
 }
+
+// ********************************
+//  Formula files
+// ********************************
+
+static SavedName savedname(uint32_t node, SavedPlace place, ADDR64 begin, ADDR64 end,
+                           const string &reg)
+{
+    SavedName n;
+    memset(&n, 0, sizeof(n));
+    n.node = node;
+    n.place = place;
+    n.begin = begin;
+    n.end = end;
+    strncpy(n.reg, reg.c_str(), sizeof(n.reg) - 1);
+    return n;
+}
+
+// Write all registers and memory values, the nodes they use and where
+// their input symbols came from
+bool SEEngine::saveFormulas(const string &file)
+{
+    vector<pair<SavedName, Value*> > outputs;
+    for (int i = RAX; i <= R15; ++i) {
+        if (ctx[i] != NULL)
+            outputs.push_back(make_pair(savedname(0, SAVEDREG, 0, 0, reg2string((Register)i)),
+                                        ctx[i]));
+    }
+    vector<pair<AddrRange, Value*> > mem;
+    getMemValues(&mem);
+    for (size_t i = 0; i < mem.size(); ++i) {
+        outputs.push_back(make_pair(savedname(0, SAVEDMEM, mem[i].first.first,
+                                              mem[i].first.second, ""), mem[i].second));
+    }
+
+    // Checkpoint symbols reachable from the outputs, oldest first. The
+    // formula a symbol replaced only refers to older symbols, so saving the
+    // formulas in this order puts each ahead of the symbol standing for it.
+    vector<Value*> cps, stack;
+    unordered_set<Value*> seen;
+    for (size_t i = 0; i < outputs.size(); ++i) {
+        if (seen.insert(outputs[i].second).second)
+            stack.push_back(outputs[i].second);
+    }
+    while (!stack.empty()) {
+        Value *v = stack.back();
+        stack.pop_back();
+        Value *next[3] = {NULL, NULL, NULL};
+        if (v->opr != NULL) {
+            for (int k = 0; k < 3; ++k)
+                next[k] = v->opr->val[k];
+        } else if (cpinput.count(v)) {
+            cps.push_back(v);
+            next[0] = cpinput[v];
+        }
+        for (int k = 0; k < 3; ++k) {
+            if (next[k] != NULL && seen.insert(next[k]).second)
+                stack.push_back(next[k]);
+        }
+    }
+    sort(cps.begin(), cps.end(), [](Value *a, Value *b) { return a->id < b->id; });
+
+    vector<Value*> roots;
+    for (size_t i = 0; i < cps.size(); ++i)
+        roots.push_back(cpinput[cps[i]]);
+    for (size_t i = 0; i < outputs.size(); ++i)
+        roots.push_back(outputs[i].second);
+
+    // Nodes in post-order of all roots, each once
+    unordered_map<Value*, uint32_t> index;
+    vector<SavedNode> nodes;
+    vector<SavedName> inputs;
+    for (size_t i = 0; i < roots.size(); ++i) {
+        vector<Value*> order;
+        postorder(roots[i], &order);
+        for (size_t j = 0; j < order.size(); ++j) {
+            Value *v = order[j];
+            if (index.count(v))
+                continue;
+            SavedNode n;
+            memset(&n, 0, sizeof(n));
+            n.len = v->len;
+            if (v->opr != NULL) {
+                n.kind = SAVEDOP + v->opr->opty;
+                for (int k = 0; k < 3; ++k)
+                    n.arg[k] = v->opr->val[k] == NULL ? 0 : index[v->opr->val[k]] + 1;
+            } else if (v->valty == CONCRETE) {
+                n.kind = SAVEDCONST;
+                n.arg[0] = (uint32_t)v->conval;
+                n.arg[1] = (uint32_t)(v->conval >> 32);
+            } else {
+                n.kind = SAVEDSYM;
+                if (reginput.count(v))
+                    inputs.push_back(savedname(nodes.size(), SAVEDREG, 0, 0, reginput[v]));
+                else if (meminput.count(v))
+                    inputs.push_back(savedname(nodes.size(), SAVEDMEM, meminput[v].first,
+                                               meminput[v].second, ""));
+                else if (unknowninput.count(v))
+                    inputs.push_back(savedname(nodes.size(), SAVEDUNKNOWN,
+                                               unknowninput[v], 0, ""));
+                else if (cpinput.count(v))
+                    inputs.push_back(savedname(nodes.size(), SAVEDCHECKPOINT,
+                                               index[cpinput[v]], 0, ""));
+                else
+                    inputs.push_back(savedname(nodes.size(), SAVEDOTHER, 0, 0, ""));
+            }
+            index[v] = nodes.size();
+            nodes.push_back(n);
+        }
+    }
+    for (size_t i = 0; i < outputs.size(); ++i)
+        outputs[i].first.node = index[outputs[i].second];
+
+    ofstream os(file.c_str(), ios::binary);
+    if (!os.is_open()) {
+        cerr << "Error: Cannot write " << file << endl;
+        return false;
+    }
+    SavedHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, FORMULAMAGIC, 4);
+    h.version = FORMULAVERSION;
+    h.nnode = nodes.size();
+    h.ninput = inputs.size();
+    h.noutput = outputs.size();
+    os.write((const char *)&h, sizeof(h));
+    os.write((const char *)nodes.data(), nodes.size() * sizeof(SavedNode));
+    os.write((const char *)inputs.data(), inputs.size() * sizeof(SavedName));
+    for (size_t i = 0; i < outputs.size(); ++i)
+        os.write((const char *)&outputs[i].first, sizeof(SavedName));
+    return os.good();
+}
+
+// Rebuild the registers, memory and inputs of a formula file in this
+// engine. Nodes are hash-consed with the ones the engine already has.
+bool SEEngine::loadFormulas(const string &file)
+{
+    int fd = open(file.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        cerr << "Error: Cannot read " << file << endl;
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+    size_t size = st.st_size;
+    void *map = size < sizeof(SavedHeader) ? MAP_FAILED :
+        mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        cerr << "Error: " << file << " is not a formula file" << endl;
+        return false;
+    }
+
+    const SavedHeader *h = (const SavedHeader *)map;
+    const SavedNode *nodes = (const SavedNode *)(h + 1);
+    const SavedName *inputs = (const SavedName *)(nodes + h->nnode);
+    const SavedName *outputs = inputs + h->ninput;
+    bool ok = memcmp(h->magic, FORMULAMAGIC, 4) == 0 &&
+        h->version >= 1 && h->version <= FORMULAVERSION &&
+        sizeof(SavedHeader) + (uint64_t)h->nnode * sizeof(SavedNode) +
+        ((uint64_t)h->ninput + h->noutput) * sizeof(SavedName) == size;
+
+    vector<Value*> val;
+    for (uint32_t i = 0; ok && i < h->nnode; ++i) {
+        const SavedNode &n = nodes[i];
+        Value *v;
+        if (n.kind == SAVEDSYM) {
+            v = buildsym(n.len);
+        } else if (n.kind == SAVEDCONST) {
+            v = buildconst(((ADDR64)n.arg[1] << 32) | n.arg[0]);
+        } else {
+            Value *arg[3] = {NULL, NULL, NULL};
+            OperTy opty = (OperTy)(n.kind - SAVEDOP);
+            for (int k = 0; k < 3; ++k) {
+                if (n.arg[k] > i)
+                    ok = false;
+                else if (n.arg[k] != 0)
+                    arg[k] = val[n.arg[k] - 1];
+            }
+            if (n.kind < SAVEDOP || opty >= OPERNUM || arg[0] == NULL ||
+                (operinfo[opty].arity == 2 && arg[1] == NULL)) {
+                ok = false;
+                break;
+            }
+            OperKey key;
+            key.opty = opty;
+            for (int k = 0; k < 3; ++k)
+                key.val[k] = arg[k];
+            v = buildop(key);
+        }
+        val.push_back(v);
+    }
+
+    for (uint32_t i = 0; ok && i < h->ninput; ++i) {
+        const SavedName &n = inputs[i];
+        if (n.node >= h->nnode || nodes[n.node].kind != SAVEDSYM) {
+            ok = false;
+            break;
+        }
+        Value *v = val[n.node];
+        if (n.place == SAVEDREG)
+            reginput[v] = string(n.reg, strnlen(n.reg, sizeof(n.reg)));
+        else if (n.place == SAVEDMEM)
+            meminput[v] = AddrRange(n.begin, n.end);
+        else if (n.place == SAVEDUNKNOWN)
+            unknowninput[v] = n.begin;
+        else if (n.place == SAVEDCHECKPOINT && n.begin < n.node)
+            cpinput[v] = val[n.begin];
+        else if (n.place == SAVEDCHECKPOINT)
+            ok = false;
+    }
+
+    for (uint32_t i = 0; ok && i < h->noutput; ++i) {
+        const SavedName &n = outputs[i];
+        if (n.node >= h->nnode) {
+            ok = false;
+            break;
+        }
+        Value *v = val[n.node];
+        if (n.place == SAVEDREG) {
+            Register reg = string2reg(string(n.reg, strnlen(n.reg, sizeof(n.reg))));
+            if (regalias(reg).parent == UNK)
+                ok = false;
+            else
+                ctx[regalias(reg).parent] = v;
+        } else if (n.place == SAVEDMEM && n.end >= n.begin && n.end - n.begin < 8) {
+            writeMem(n.begin, n.end - n.begin + 1, v);
+        } else {
+            ok = false;
+        }
+    }
+
+    munmap(map, size);
+    if (!ok)
+        cerr << "Error: " << file << " is not a valid formula file" << endl;
+    return ok;
+}
@@ -7,94 +7,400 @@
 #include <vector>
 #include <set>
 #include <iterator>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
 
 using namespace std;
 
+#include "arena.hpp"
+
 struct Operation;
 struct Value;
-struct FullMap;
+struct FormulaCode;
+
+// Operators of formula nodes; operinfo[] in mg-symengine.cpp is indexed by it
+enum OperTy {
+    ADD, SUB, IMUL, DIV, MOD, AND, OR, XOR, SHL, SHR, SAR,
+    NEG, NOT, INC, DEC, BSWAP, MOV,
+    OPERNUM     // number of operators, also returned for unknown names
+};
+
+// Operator of an instruction mnemonic, OPERNUM if it has none
+OperTy str2opty(const string &s);
+const char *opty2str(OperTy opty);
+
+// Key of an operation node for hash-consing: operator and operands
+struct OperKey {
+    OperTy opty;
+    Value *val[3];
+
+    bool operator==(const OperKey &other) const;
+};
+
+struct OperKeyHash {
+    size_t operator()(const OperKey &k) const;
+};
+
+class SEEngine;
+
+// Properties of instruction semantics
+enum SemFlag {
+    SEM_TRACEDEP = 1,           // result or effect is decided by concrete trace values
+    SEM_STRING = 2,             // string instruction, may take a rep prefix
+};
+
+// Semantics of one mnemonic: the handler and its parameters
+struct InstSem {
+    const char *mnem;
+    bool (SEEngine::*exec)(Inst *in, const InstSem *sem);
+    OperTy opty;                // operator of ALU instructions
+    int nbyte;                  // operand size implied by the mnemonic
+    int flags;                  // SemFlag bits
+};
 
 // Alias for 64-bit address ranges
 typedef pair<ADDR64, ADDR64> AddrRange;
 
+#define PAGEBITS 12
+#define PAGESIZE (1 << PAGEBITS)
+
+// A byte of symbolic memory: byte idx of value val, counted from the low end
+struct MemByte {
+    Value *val;
+    int idx;
+
+    MemByte() : val(NULL), idx(0) {}
+};
+
+struct MemPage {
+    MemByte bytes[PAGESIZE];
+    bool dirty;                         // written since the last checkpoint
+
+    MemPage() : dirty(false) {}
+};
+
+// A page of an engine. Pages it does not own are shared with forks, and
+// are copied before they are written.
+struct PageRef {
+    shared_ptr<MemPage> page;
+    bool owned;
+};
+
+// A memory access made while a block summary is built: the index of the
+// instruction in the block, and the offset of the access from that
+// instruction's raddr or waddr
+struct MemAccess {
+    int inst;
+    bool write;
+    int64_t offset;
+    int nbyte;
+};
+
+struct BlockSummary;
+struct MBAProg;
+
+// Formula files written by SEEngine::saveFormulas: a header, the nodes in
+// topological order, then the inputs and the outputs. All records have a
+// fixed size and are 8-byte aligned, so a file can be used in place.
+#define FORMULAMAGIC "MGSE"
+#define FORMULAVERSION 2                // 2 adds SAVEDCHECKPOINT, 1 is still read
+
+struct SavedHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t nnode, ninput, noutput;
+    uint32_t reserved;
+};
+
+enum SavedKind {
+    SAVEDSYM, SAVEDCONST,
+    SAVEDOP                             // SAVEDOP + operator for operations
+};
+
+// arg holds the value of a constant (low half first), or the operands of an
+// operation as node index + 1, 0 for none. Operands come before their users.
+struct SavedNode {
+    uint16_t kind;
+    uint16_t len;
+    uint32_t arg[3];
+};
+
+// An input symbol or an output: a register by name, a memory range, the
+// result of an unmodelled instruction with its line in begin, or a
+// checkpoint symbol with the index of the node it replaced in begin
+enum SavedPlace { SAVEDREG, SAVEDMEM, SAVEDUNKNOWN, SAVEDOTHER, SAVEDCHECKPOINT };
+
+struct SavedName {
+    uint32_t node;
+    uint32_t place;
+    uint64_t begin, end;
+    char reg[8];
+};
+
+// Formula nodes created by an engine since it last forked. The layers below
+// are frozen: they are shared by the forks and no longer change.
+struct NodeLayer {
+    Arena<Value> values;
+    Arena<Operation> opers;
+    unordered_map<OperKey, Value*, OperKeyHash> opcache;
+    unordered_map<ADDR64, Value*> concache;
+    shared_ptr<NodeLayer> parent;
+    size_t base;                        // number of nodes in the layers below
+
+    // Defined where Value and Operation are complete
+    NodeLayer();
+    NodeLayer(const shared_ptr<NodeLayer> &below);
+    ~NodeLayer();
+};
+
 // Symbolic execution engine class
 class SEEngine {
 private:
-    // Context for registers (mapping register names to Value pointers)
-    map<string, Value*> ctx;
+    // Register file, indexed by the 64-bit registers RAX..R15 of enum
+    // Register. Sub-registers are views described by regalias().
+    Value *ctx[16];
     
     // Instruction iterators for execution range
     list<Inst>::iterator start;
     list<Inst>::iterator end;
     list<Inst>::iterator ip;
 
-    // Memory model
-    map<AddrRange, Value*> mem;              // Memory values
+    // Memory model: a table of pages holding, for each byte, the value it
+    // is part of. The page of the last access is cached.
+    unordered_map<ADDR64, PageRef> pages;
+    ADDR64 lastpageno;
+    MemPage *lastpage;
+    bool lastowned;
     map<Value*, AddrRange> meminput;         // Memory input values
     map<Value*, string> reginput;            // Register input values
+    map<Value*, int> unknowninput;           // Results of unmodelled instructions -> line
+
+    // All formula nodes are owned by the engine and its forks. Operation
+    // nodes and concrete leaves are hash-consed, so structurally identical
+    // nodes are shared.
+    shared_ptr<NodeLayer> nodes;
+
+    // Node construction
+    Value* buildsym(int len = 64);
+    Value* buildconst(ADDR64 con);
+    Value* buildconst(string con);
+    Value* simplify(OperKey &key);
+    Value* buildop(OperKey &key);
+    Value* buildop1(OperTy opty, Value *v1);
+    Value* buildop2(OperTy opty, Value *v1, Value *v2);
+    Value* buildop3(OperTy opty, Value *v1, Value *v2, Value *v3);
 
     // Helper functions for memory operations
-    bool memfind(AddrRange ar);
-    bool memfind(ADDR64 b, ADDR64 e);
-    bool isnew(AddrRange ar);
-    bool issubset(AddrRange ar, AddrRange *superset);
-    bool issuperset(AddrRange ar, AddrRange *subset);
+    MemPage* findPage(ADDR64 addr, bool create);
+    MemByte* findByte(ADDR64 addr, bool create);
+    Value* extract(Value *v, int idx, int n);
 
     // Read/write operations for registers and memory
-    Value* readReg(string &s);
-    void writeReg(string &s, Value *v);
+    Value* readReg(Register reg);
+    void writeReg(Register reg, Value *v);
     Value* readMem(ADDR64 addr, int nbyte);
     void writeMem(ADDR64 addr, int nbyte, Value *v);
 
     // Register/concrete value utilities
-    ADDR64 getRegConVal(string reg);
+    ADDR64 getRegConVal(Register reg);
+    bool getNextRegConVal(Register reg, ADDR64 *val);
+    bool getOprConVal(Operand *opr, ADDR64 *val);
     ADDR64 calcAddr(Operand *opr);
 
+    // Instruction semantics, looked up once per instruction before execution
+    static const InstSem semtable[];
+    static const InstSem repsem;
+    static const InstSem *findsem(const string &mnem);
+    unordered_map<int, ADDR64> callret;      // call line -> return address
+    set<string> warned;                      // unmodelled mnemonics reported so far
+    bool tracedep;                           // concrete values from the trace were used
+    int nunknown;                            // unmodelled instructions executed
+
+    // Concolic mode
+    bool concolic;
+    set<Register> symregs;                   // chosen symbolic registers
+    vector<AddrRange> symmems;               // chosen symbolic memory
+    unordered_map<Value*, ADDR64> shadow;    // concrete value of tainted nodes
+    int nmismatch;                           // formulas that disagreed with the trace
+
+    bool isSymMem(ADDR64 b, ADDR64 e);
+    void computeShadow(Value *v);
+    void concretize();
+    void bindMem(Value *v, ADDR64 con);
+
+    void decode(vector<const InstSem*> *sems);
+    void havoc(Inst *in);
+    Value* buildunknown();
+    Value* buildAddr(Operand *opr);
+    Value* truncate(Value *v, int bit);
+    Value* signext(Value *v, int bit);
+    Value* readOpr(Operand *opr);
+    void writeOpr(Operand *opr, Value *v);
+    void adjustsp(int64_t n);
+
+    // Block summaries: the effect of a straight-line block is computed once
+    // by a child engine, then instantiated by substitution each time the
+    // same address sequence runs again
+    bool summarize;
+    unordered_map<uint64_t, vector<BlockSummary*> > summaries;
+    unordered_map<uint64_t, int> blockseen;
+    BlockSummary *building;                  // summary whose accesses are being recorded
+    int ipno;                                // index of ip in the execution range
+    int nsummarized;                         // block executions done by a summary
+
+    BlockSummary* buildsummary(list<Inst>::iterator b, list<Inst>::iterator e);
+    bool instantiate(BlockSummary *s, list<Inst>::iterator b, list<Inst>::iterator e);
+    bool runsummary(list<Inst>::iterator b, list<Inst>::iterator e);
+
+    // Slice-guided execution: only the marked instructions run, and the
+    // registers written by the others take their values from the trace
+    vector<bool> slice;
+    int nskipped;                            // instructions not executed
+
+    void skip(list<Inst>::iterator it);
+
+    // Checkpoints: formulas that grow too deep or too large are replaced by
+    // fresh symbols, remembered so that they can be expanded again
+    int cpdepth, cpsize, cpinterval;         // limits, 0 if not checked
+    int sincecp;                             // instructions since the last checkpoint
+    Value *cpctx[16];                        // registers at the last checkpoint
+    unordered_map<Value*, Value*> cpinput;   // fresh symbol -> formula it replaced
+    unordered_map<Value*, int> depthmemo;
+    unordered_set<Value*> cpwithin;          // formulas known to be within the limits
+    int nconcretized;
+
+    int formulaDepth(Value *v);
+    Value* checkpointValue(Value *v);
+    bool isConstant(Value *v, ADDR64 c);
+    void checkpoint();
+
+    // MBA simplification: results for each node, and for each program
+    // shape the table expression it equals plus a constant
+    unordered_map<Value*, Value*> mbamemo;
+    unordered_map<string, pair<const MBAProg*, ADDR64> > mbacache;
+    int nmba;                                // subexpressions replaced
+
+    Value* buildprog(const MBAProg &p, const vector<Value*> &vars, ADDR64 c);
+    Value* reduceMBA(Value *v);
+
+    // Compiled formulas for concrete evaluation
+    unordered_map<Value*, FormulaCode*> codecache;
+    FormulaCode* compile(Value *f);
+
     // Debugging and output helpers
     void printformula(Value* v);
     
 public:
+    // Instruction handlers, see semtable
+    bool semNop(Inst *in, const InstSem *sem);
+    bool semMov(Inst *in, const InstSem *sem);
+    bool semMovsx(Inst *in, const InstSem *sem);
+    bool semLea(Inst *in, const InstSem *sem);
+    bool semBinary(Inst *in, const InstSem *sem);
+    bool semUnary(Inst *in, const InstSem *sem);
+    bool semCarry(Inst *in, const InstSem *sem);
+    bool semRotate(Inst *in, const InstSem *sem);
+    bool semBswap(Inst *in, const InstSem *sem);
+    bool semXchg(Inst *in, const InstSem *sem);
+    bool semCmov(Inst *in, const InstSem *sem);
+    bool semSetcc(Inst *in, const InstSem *sem);
+    bool semMul(Inst *in, const InstSem *sem);
+    bool semImul(Inst *in, const InstSem *sem);
+    bool semDiv(Inst *in, const InstSem *sem);
+    bool semPush(Inst *in, const InstSem *sem);
+    bool semPop(Inst *in, const InstSem *sem);
+    bool semPushf(Inst *in, const InstSem *sem);
+    bool semPopf(Inst *in, const InstSem *sem);
+    bool semCall(Inst *in, const InstSem *sem);
+    bool semRet(Inst *in, const InstSem *sem);
+    bool semLeave(Inst *in, const InstSem *sem);
+    bool semConvert(Inst *in, const InstSem *sem);
+    bool semLods(Inst *in, const InstSem *sem);
+    bool semStos(Inst *in, const InstSem *sem);
+    bool semMovs(Inst *in, const InstSem *sem);
+    bool semCmps(Inst *in, const InstSem *sem);
+    bool semLoop(Inst *in, const InstSem *sem);
+    bool semRep(Inst *in, const InstSem *sem);
+
     // Constructor initializing register context
-    SEEngine() {
-        ctx = { {"rax", NULL}, {"rbx", NULL}, {"rcx", NULL}, {"rdx", NULL},
-                {"rsi", NULL}, {"rdi", NULL}, {"rsp", NULL}, {"rbp", NULL},
-                {"r8", NULL}, {"r9", NULL}, {"r10", NULL}, {"r11", NULL},
-                {"r12", NULL}, {"r13", NULL}, {"r14", NULL}, {"r15", NULL} };
-    };
+    SEEngine();
+    ~SEEngine();
 
     // Initialization functions
     void init(Value *v1, Value *v2, Value *v3, Value *v4,
               Value *v5, Value *v6, Value *v7, Value *v8,
+              Value *v9, Value *v10, Value *v11, Value *v12,
+              Value *v13, Value *v14, Value *v15, Value *v16,
               list<Inst>::iterator it1,
               list<Inst>::iterator it2);
     void init(list<Inst>::iterator it1,
               list<Inst>::iterator it2);
-    void initAllRegSymol(list<Inst>::iterator it1,
-                         list<Inst>::iterator it2);
+    void initAllRegSymbol(list<Inst>::iterator it1,
+                          list<Inst>::iterator it2);
+    void setConcolic(const vector<Register> &regs, const vector<AddrRange> &mems);
+    int mismatchCount() { return nmismatch; }
+
+    // A new engine in the state of this one. Nodes and memory pages are
+    // shared until written, so forks are cheap and can run on other threads.
+    SEEngine* fork();
+
+    // Number of formula nodes allocated by the engine
+    size_t nodeCount() { return nodes->base + nodes->values.size(); }
 
     // Core symbolic execution function
     int symexec();
+    bool traceDependent() { return tracedep; }
+    int unknownCount() { return nunknown; }
+    void setSummaries(bool on) { summarize = on; }
+    int summarizedCount() { return nsummarized; }
+    void setSlice(const vector<bool> &keep) { slice = keep; }
+    int skippedCount() { return nskipped; }
+    void setCheckpoints(int maxdepth, int maxsize, int interval);
+    int checkpointCount() { return cpinput.size(); }
+    int concretizedCount() { return nconcretized; }
+    Value* expand(Value *v);
+    Value* simplifyMBA(Value *v);
+    int mbaCount() { return nmba; }
 
     // Concrete execution with given input mapping
     ADDR64 conexec(Value *f, map<Value*, ADDR64> *input);
+    void conexecBatch(Value *f, const vector<ADDR64> &input, int n, vector<ADDR64> *out);
 
     // Output and debugging functions
     void outputFormula(string reg);
-    void dumpreg(string reg);
+    void dumpreg(string reg, ostream &os = cout);
     void printAllRegFormulas();
     void printAllMemFormulas();
     void printInputSymbols(string output);
-    Value* getValue(string s) { return ctx[s]; }
+    Value* getValue(string s);
+    Value* getMemValue(ADDR64 addr1, ADDR64 addr2);
+    void getMemValues(vector<pair<AddrRange, Value*> > *out);
     vector<Value*> getAllOutput();
     void showMemInput();
     void printMemFormula(ADDR64 addr1, ADDR64 addr2);
+
+    // Registers and memory with their inputs, in a formula file
+    bool saveFormulas(const string &file);
+    bool loadFormulas(const string &file);
 };
 
 // External functions for CVC and bit-vector handling
+void traverse(Value *v, ostream &os);   // shared subterms are printed once
+void outputCVC(Value *v, const string &postfix, ostream &os);
 void outputCVCFormula(Value *f);
 void outputChkEqCVC(Value *f1, Value *f2, map<int, int> *m);
 void outputBitCVC(Value *f1, Value *f2, vector<Value*> *inv1, vector<Value*> *inv2,
                   list<FullMap> *result);
+void outputSMT(Value *v, const string &name, const string &postfix, ostream &os);
+void outputSMTOutputs(const vector<pair<string, Value*> > &outs, ostream &os);
+void outputSMTFormula(Value *f);
+void outputChkEqSMT(Value *f1, Value *f2, map<int, int> *m);
+int checkBitSMT(Value *f1, Value *f2, vector<Value*> *inv1, vector<Value*> *inv2,
+                list<FullMap> *result);       // -1 if no solver could be run
+int refuteBitMaps(SEEngine *se1, Value *f1, SEEngine *se2, Value *f2,
+                  vector<Value*> *inv1, vector<Value*> *inv2, list<FullMap> *result,
+                  int ntest = 4096);  // returns the number of mappings removed
 map<Value*, ADDR64> buildinmap(vector<Value*> *vv, vector<ADDR64> *input);
 vector<Value*> getInputVector(Value *f); // Get formula f's inputs as a vector
 string getValueName(Value *v);
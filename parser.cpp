@@ -1,5 +1,4 @@
 #include "core.hpp"
-#include "parser.hpp"
 #include <iostream>
 #include <fstream>
 #include <sstream>
@@ -13,6 +12,8 @@
 
 using namespace std;
 
+#include "parser.hpp"
+
 // Create an address operand based on the parsed string
 Operand* createAddrOperand(string s) {
     // Regular expressions for 64-bit addresses and registers
@@ -72,35 +73,42 @@ Operand* createAddrOperand(string s) {
         cout << "Unknown addr operand: " << s << endl;
     }
 
+    // Base and index registers
+    switch (opr->tag) {
+    case 7: case 5:
+        opr->reg[0] = string2reg(opr->field[0]);
+        opr->reg[1] = string2reg(opr->field[1]);
+        break;
+    case 4: case 2:
+        opr->reg[0] = string2reg(opr->field[0]);
+        break;
+    case 6: case 3:
+        opr->reg[1] = string2reg(opr->field[0]);
+        break;
+    }
+
     return opr;
 }
 
 // Create a data operand (immediate or register)
 Operand* createDataOperand(string s) {
     regex immvalue("0x[[:xdigit:]]+");
-    regex reg8("al|ah|bl|bh|cl|ch|dl|dh|sil|dil|bpl|spl|r8b|r9b|r10b|r11b|r12b|r13b|r14b|r15b");
-    regex reg16("ax|bx|cx|dx|si|di|bp|sp|r8w|r9w|r10w|r11w|r12w|r13w|r14w|r15w");
-    regex reg32("eax|ebx|ecx|edx|esi|edi|esp|ebp|r8d|r9d|r10d|r11d|r12d|r13d|r14d|r15d");
-    regex reg64("rax|rbx|rcx|rdx|rsi|rdi|rsp|rbp|r8|r9|r10|r11|r12|r13|r14|r15");
 
     Operand* opr = new Operand();
     smatch m;
-    if (regex_search(s, m, reg64)) {
-        opr->ty = Operand::REG;
-        opr->bit = 64;
-        opr->field[0] = m[0];
-    } else if (regex_search(s, m, reg32)) {
-        opr->ty = Operand::REG;
-        opr->bit = 32;
-        opr->field[0] = m[0];
-    } else if (regex_search(s, m, reg16)) {
-        opr->ty = Operand::REG;
-        opr->bit = 16;
-        opr->field[0] = m[0];
-    } else if (regex_search(s, m, reg8)) {
+
+    // Registers are looked up by their exact name, so that r8d is not
+    // taken for r8 or spl for sp
+    size_t b = s.find_first_not_of(' ');
+    size_t e = s.find_last_not_of(' ');
+    string name = b == string::npos ? "" : s.substr(b, e - b + 1);
+    Register reg = string2reg(name);
+
+    if (reg != UNK) {
         opr->ty = Operand::REG;
-        opr->bit = 8;
-        opr->field[0] = m[0];
+        opr->bit = regalias(reg).width;
+        opr->field[0] = name;
+        opr->reg[0] = reg;
     } else if (regex_search(s, m, immvalue)) {
         opr->ty = Operand::IMM;
         opr->bit = 64;
@@ -121,8 +129,22 @@ Operand* createOperand(string s) {
     regex qwordptr("qword ptr \\[(.*)\\]");
     smatch m;
 
+    regex addr("\\[(.*)\\]");
+
     Operand* opr;
     if (regex_search(s, m, ptr)) {
+        opr = createAddrOperand(m[1]);
+        if (regex_search(s, qwordptr))
+            opr->bit = 64;
+        else if (regex_search(s, dwordptr))
+            opr->bit = 32;
+        else if (regex_search(s, wordptr))
+            opr->bit = 16;
+        else if (regex_search(s, byteptr))
+            opr->bit = 8;
+        else
+            opr->bit = 64;
+    } else if (regex_search(s, m, addr)) {    // lea operands have no size
         opr = createAddrOperand(m[1]);
         opr->bit = 64;
     } else {
@@ -0,0 +1,240 @@
+#include <iostream>
+#include <string>
+#include <list>
+#include <vector>
+#include <set>
+
+using namespace std;
+
+#include "core.hpp"
+#include "slice.hpp"
+
+// Instructions which have no data dependency effect
+static set<string> skipinst = {"test", "jmp", "jz", "jbe", "jo", "jno", "js", "jns", "je", "jne",
+                               "jnz", "jb", "jnae", "jc", "jnb", "jae", "jnc", "jna", "ja", "jnbe", "jl",
+                               "jnge", "jge", "jnl", "jle", "jng", "jg", "jnle", "jp", "jpe", "jnp", "jpo",
+                               "jcxz", "jecxz", "cmp", "nop"};
+
+// Binary operations: the destination is also a source
+static set<string> binaryinst = {"add", "sub", "and", "or", "xor", "adc", "sbb", "shl", "sal",
+                                 "shr", "sar", "rol", "ror", "imul"};
+
+// Unary operations on their only operand
+static set<string> unaryinst = {"inc", "dec", "neg", "not", "bswap"};
+
+// Size of a memory operand in bytes, 8 if the trace did not tell
+static int oprbytes(Operand *op)
+{
+    return op->bit > 0 ? op->bit / 8 : 8;
+}
+
+// The stack pointer update of push, pop, call and ret, as the second
+// destination so that it does not make the data depend on rsp
+static void stackopr(Inst *in)
+{
+    in->addsrc2(Parameter::REG, "rsp");
+    in->adddst2(Parameter::REG, "rsp");
+}
+
+// Parameters read by operand op. A memory operand is read at raddr, or at
+// waddr for instructions that only logged the write.
+static void srcopr(Inst *in, Operand *op, bool second = false)
+{
+    if (op->ty == Operand::MEM) {
+        ADDR64 a = in->raddr != 0 ? in->raddr : in->waddr;
+        AddrRange ar(a, a + oprbytes(op) - 1);
+        second ? in->addsrc2(Parameter::MEM, ar) : in->addsrc(Parameter::MEM, ar);
+    } else if (op->ty == Operand::REG) {
+        second ? in->addsrc2(Parameter::REG, op->field[0]) : in->addsrc(Parameter::REG, op->field[0]);
+    } else {
+        second ? in->addsrc2(Parameter::IMM, op->field[0]) : in->addsrc(Parameter::IMM, op->field[0]);
+    }
+}
+
+// Parameters written by operand op
+static void dstopr(Inst *in, Operand *op, bool second = false)
+{
+    if (op->ty == Operand::MEM) {
+        AddrRange ar(in->waddr, in->waddr + oprbytes(op) - 1);
+        second ? in->adddst2(Parameter::MEM, ar) : in->adddst(Parameter::MEM, ar);
+    } else if (op->ty == Operand::REG) {
+        second ? in->adddst2(Parameter::REG, op->field[0]) : in->adddst(Parameter::REG, op->field[0]);
+    }
+}
+
+// Accumulator and its high half for an operand size in bytes, as used by
+// mul, div and the sign extensions
+static string accreg(int nbyte)
+{
+    return nbyte == 1 ? "al" : nbyte == 2 ? "ax" : nbyte == 4 ? "eax" : "rax";
+}
+
+static string hireg(int nbyte)
+{
+    return nbyte == 1 ? "ah" : nbyte == 2 ? "dx" : nbyte == 4 ? "edx" : "rdx";
+}
+
+// Fill in the parameters of the instructions in [begin, end). Returns the
+// number of instructions whose effect is not modelled here: they read all
+// registers and the memory at raddr, and write what the symbolic engine
+// replaces by fresh symbols, the registers the trace shows changing and
+// the memory at waddr.
+int buildParameter(list<Inst>::iterator begin, list<Inst>::iterator end)
+{
+    int unmodelled = 0;
+
+    for (list<Inst>::iterator it = begin; it != end; ++it) {
+        Inst *in = &*it;
+        const string &opc = in->opcstr;
+        Operand **op = in->oprd;
+
+        in->src.clear();
+        in->dst.clear();
+        in->src2.clear();
+        in->dst2.clear();
+        if (skipinst.count(opc))
+            continue;
+
+        if (in->oprnum == 2 && (opc == "mov" || opc == "movabs" || opc == "movzx" ||
+                                opc == "movsx" || opc == "movsxd")) {
+            srcopr(in, op[1]);
+            dstopr(in, op[0]);
+        } else if (in->oprnum == 2 && opc == "lea") {
+            // only the base and index registers are read
+            for (int i = 0; i < 2; ++i) {
+                if (op[1]->reg[i] != UNK)
+                    in->addsrc(Parameter::REG, reg2string(op[1]->reg[i]));
+            }
+            dstopr(in, op[0]);
+        } else if (in->oprnum == 2 && binaryinst.count(opc)) {
+            // xor reg, reg and sub reg, reg clear the register
+            if (!((opc == "xor" || opc == "sub") && op[0]->ty == Operand::REG &&
+                  op[1]->ty == Operand::REG && op[0]->field[0] == op[1]->field[0])) {
+                srcopr(in, op[0]);
+                srcopr(in, op[1]);
+            }
+            dstopr(in, op[0]);
+        } else if (in->oprnum == 3 && opc == "imul") {
+            srcopr(in, op[1]);
+            srcopr(in, op[2]);
+            dstopr(in, op[0]);
+        } else if (in->oprnum == 1 && unaryinst.count(opc)) {
+            srcopr(in, op[0]);
+            dstopr(in, op[0]);
+        } else if (in->oprnum == 1 && (opc == "mul" || opc == "imul" || opc == "div" || opc == "idiv")) {
+            int nbyte = oprbytes(op[0]);
+            srcopr(in, op[0]);
+            in->addsrc(Parameter::REG, accreg(nbyte));
+            if (opc == "div" || opc == "idiv")
+                in->addsrc(Parameter::REG, nbyte == 1 ? "ax" : hireg(nbyte));
+            in->adddst(Parameter::REG, nbyte == 1 ? "ax" : accreg(nbyte));
+            if (nbyte > 1)
+                in->adddst(Parameter::REG, hireg(nbyte));
+        } else if (in->oprnum == 2 && opc == "xchg") {
+            srcopr(in, op[1]);
+            dstopr(in, op[0]);
+            srcopr(in, op[0], true);
+            dstopr(in, op[1], true);
+        } else if (in->oprnum == 2 && opc.compare(0, 4, "cmov") == 0) {
+            srcopr(in, op[0]);
+            srcopr(in, op[1]);
+            dstopr(in, op[0]);
+        } else if (in->oprnum == 1 && opc.compare(0, 3, "set") == 0) {
+            dstopr(in, op[0]);          // from the flags, which are concrete
+        } else if (in->oprnum == 1 && opc == "push") {
+            int nbyte = op[0]->ty == Operand::IMM ? 8 : oprbytes(op[0]);
+            srcopr(in, op[0]);
+            in->adddst(Parameter::MEM, AddrRange(in->waddr, in->waddr + nbyte - 1));
+            stackopr(in);
+        } else if (in->oprnum == 1 && opc == "pop") {
+            int nbyte = oprbytes(op[0]);
+            in->addsrc(Parameter::MEM, AddrRange(in->raddr, in->raddr + nbyte - 1));
+            dstopr(in, op[0]);
+            stackopr(in);
+        } else if (opc == "call" || opc == "pushfq") {
+            // the return address and the flags are constants
+            in->adddst(Parameter::MEM, AddrRange(in->waddr, in->waddr + 7));
+            stackopr(in);
+        } else if (opc == "ret" || opc == "popfq") {
+            stackopr(in);
+        } else if (opc == "leave") {
+            in->addsrc(Parameter::MEM, AddrRange(in->raddr, in->raddr + 7));
+            in->adddst(Parameter::REG, "rbp");
+            in->addsrc2(Parameter::REG, "rbp");
+            in->adddst2(Parameter::REG, "rsp");
+        } else if (in->oprnum == 0 && (opc == "cbw" || opc == "cwde" || opc == "cdqe")) {
+            int nbyte = opc == "cbw" ? 1 : opc == "cwde" ? 2 : 4;
+            in->addsrc(Parameter::REG, accreg(nbyte));
+            in->adddst(Parameter::REG, accreg(nbyte * 2));
+        } else if (in->oprnum == 0 && (opc == "cwd" || opc == "cdq" || opc == "cqo")) {
+            int nbyte = opc == "cwd" ? 2 : opc == "cdq" ? 4 : 8;
+            in->addsrc(Parameter::REG, accreg(nbyte));
+            in->adddst(Parameter::REG, hireg(nbyte));
+        } else {
+            list<Inst>::iterator nx = next(it);
+            if (nx != end) {
+                for (int r = RAX; r <= R15; ++r) {
+                    if (nx->ctxreg[r] != in->ctxreg[r])
+                        in->adddst(Parameter::REG, reg2string((Register)r));
+                }
+            } else if (in->oprnum > 0 && op[0]->ty == Operand::REG) {
+                dstopr(in, op[0]);
+            }
+            if (in->waddr != 0) {
+                int nbyte = in->oprnum > 0 && op[0]->ty == Operand::MEM ? oprbytes(op[0]) : 8;
+                in->adddst(Parameter::MEM, AddrRange(in->waddr, in->waddr + nbyte - 1));
+            }
+            for (int r = RAX; r <= R15; ++r)
+                in->addsrc(Parameter::REG, reg2string((Register)r));
+            if (in->raddr != 0)
+                in->addsrc(Parameter::MEM, AddrRange(in->raddr, in->raddr + 7));
+            ++unmodelled;
+        }
+    }
+    return unmodelled;
+}
+
+// Remove the parameters in dst from wl, true if any of them was there
+static bool killdst(const vector<Parameter> &dst, set<Parameter> *wl)
+{
+    bool dep = false;
+    for (int i = 0, max = dst.size(); i < max; ++i) {
+        set<Parameter>::iterator sit = wl->find(dst[i]);
+        if (sit != wl->end()) {
+            dep = true;
+            wl->erase(sit);
+        }
+    }
+    return dep;
+}
+
+static void gensrc(vector<Parameter> &src, set<Parameter> *wl)
+{
+    for (int i = 0, max = src.size(); i < max; ++i) {
+        if (!src[i].isIMM())
+            wl->insert(src[i]);
+    }
+}
+
+// Walk [begin, end) backwards from the parameters in wl, and mark in
+// inslice the instructions they depend on. On return wl holds the
+// parameters read before begin.
+void backslice(list<Inst>::iterator begin, list<Inst>::iterator end,
+               set<Parameter> *wl, vector<bool> *inslice)
+{
+    inslice->assign(distance(begin, end), false);
+
+    int i = inslice->size();
+    for (list<Inst>::iterator it = end; it != begin; ) {
+        --it;
+        --i;
+        // dst comes from src and dst2 from src2
+        bool isdep1 = killdst(it->dst, wl);
+        bool isdep2 = killdst(it->dst2, wl);
+        if (isdep1)
+            gensrc(it->src, wl);
+        if (isdep2)
+            gensrc(it->src2, wl);
+        (*inslice)[i] = isdep1 || isdep2;
+    }
+}
@@ -0,0 +1,6 @@
+// Backward slicing over a parsed trace. buildParameter fills the src/dst
+// parameters of each instruction, backslice follows them backwards.
+
+int buildParameter(list<Inst>::iterator begin, list<Inst>::iterator end);
+void backslice(list<Inst>::iterator begin, list<Inst>::iterator end,
+               set<Parameter> *wl, vector<bool> *inslice);
@@ -7,6 +7,10 @@
 #include <stack>
 #include <vector>
 #include <set>
+#include <unordered_map>
+#include <thread>
+#include <atomic>
+#include <algorithm>
 
 using namespace std;
 
@@ -16,13 +20,18 @@ using namespace std;
 list<Inst> instlist;
 
 // Data structures for identify functions
+// A FuncBody is one dynamic instance of a function, i.e. a node of the call tree
 struct FuncBody {
-     int start;
-     int end;
-     int length;                // end - start
-     ADDR64 startAddr;
-     ADDR64 endAddr;
-     int loopn;
+     int start;                 // id of the call instruction
+     int end;                   // id of the ret, or the last instruction run in the function
+     int length;                // instructions run in this instance, callees included
+     int exclusive;             // instructions run in this instance itself
+     ADDR64 startAddr;          // function entry
+     ADDR64 endAddr;            // address of the last instruction
+     int loopn;                 // number of folded loops in this instance
+     int parent;                // index of the caller instance, -1 for roots
+     int depth;
+     bool tailcall;             // entered by a jmp in place of a ret
 };
 
 struct Func {
@@ -70,44 +79,129 @@ void printInstlist(list<Inst> *L, map<string, int> *m)
 
 
 
+// Build the dynamic call tree in one pass over the trace and index the
+// instances by function entry. Calls and rets are matched on the stack
+// pointer: a call made with rsp == sp returns with a ret run at sp - 8.
+// - A ret above the top frame also closes the deeper frames, which never
+//   returned (longjmp, exceptions, or rets from before the trace starts).
+// - A ret below the top frame is a push/ret jump and closes nothing.
+// - A jmp to a known function entry while rsp is back at the return address
+//   slot is a tail call: the callee replaces the current frame.
 map<ADDR64, list<FuncBody *> *> *
-buildFuncList(list<Inst> *L)
+buildFuncList(list<Inst> *L, vector<FuncBody> *calltree)
 {
+     struct Frame {
+          int body;             // index in calltree
+          ADDR64 sp;            // rsp when the function was called
+          int startpos;         // trace position of the call
+          int childlen;         // instructions run in callees
+     };
+
      map<ADDR64, list<FuncBody *> *> *funcmap =
           new map<ADDR64, list<FuncBody *> *>;
-     // list<Func> *funclist = new list<Func>;
-     stack<list<Inst>::iterator> stk;
+     vector<Frame> stk;
+     set<ADDR64> entries;
+     int pos = 0, lastid = 0;
+
+     // close the top frame, its last instruction is at trace position endpos
+     auto closeFrame = [&](int endid, ADDR64 endaddr, int endpos) {
+          Frame &f = stk.back();
+          FuncBody &fb = (*calltree)[f.body];
+          fb.end = endid;
+          fb.endAddr = endaddr;
+          fb.length = endpos - f.startpos + 1;
+          fb.exclusive = fb.length - f.childlen;
+          stk.pop_back();
+          if (!stk.empty())
+               stk.back().childlen += fb.length;
+     };
+     auto openFrame = [&](int startid, ADDR64 entry, ADDR64 sp, int startpos, bool tail) {
+          FuncBody fb;
+          fb.start = startid;
+          fb.end = startid;
+          fb.length = fb.exclusive = 0;
+          fb.startAddr = entry;
+          fb.endAddr = entry;
+          fb.loopn = 0;
+          fb.parent = stk.empty() ? -1 : stk.back().body;
+          fb.depth = stk.size();
+          fb.tailcall = tail;
+          Frame f = {(int)calltree->size(), sp, startpos, 0};
+          calltree->push_back(fb);
+          stk.push_back(f);
+          entries.insert(entry);
+     };
 
-
-     for (list<Inst>::iterator it = L->begin(); it != L->end(); ++it) {
-          // parse the whole instlist to build funclist
+     ADDR64 lastaddr = 0;
+     for (list<Inst>::iterator it = L->begin(); it != L->end(); ++it, ++pos) {
+          // the callee entry is the next executed instruction, the call operand
+          // may be a register or a memory reference
+          list<Inst>::iterator nit = next(it, 1);
+          ADDR64 sp = it->ctxreg[6];
 
           if (it->opcstr == "call") {
-               stk.push(it);
-               // search whether the function is in the function list
-               // if yes, identify whether it is a new function instance
-               // if not, create a new function
-               map<ADDR64, list<FuncBody *> *>::iterator i = funcmap->find(it->addrn);
-               if (i == funcmap->end()) {
-                    ADDR64 calladdr = stoul(it->oprs[0], nullptr, 16);
-                    funcmap->insert(pair<ADDR64, list<FuncBody *> *>(calladdr, NULL));
-               }
+               if (nit != L->end())
+                    openFrame(it->id, nit->addrn, sp, pos, false);
           } else if (it->opcstr == "ret") {
-               if (!stk.empty()) stk.pop();
-          } else {}
+               while (!stk.empty() && stk.back().sp - 8 < sp)
+                    closeFrame(lastid, lastaddr, pos - 1);
+               if (!stk.empty() && stk.back().sp - 8 == sp)
+                    closeFrame(it->id, it->addrn, pos);
+          } else if (it->opcstr == "jmp" && !stk.empty() && nit != L->end() &&
+                     stk.back().sp - 8 == sp && entries.find(nit->addrn) != entries.end()) {
+               Frame f = stk.back();
+               closeFrame(it->id, it->addrn, pos);
+               openFrame(it->id, nit->addrn, f.sp, pos + 1, true);
+          }
+          lastid = it->id;
+          lastaddr = it->addrn;
+     }
+     while (!stk.empty())
+          closeFrame(lastid, lastaddr, pos - 1);
+
+     for (vector<FuncBody>::iterator it = calltree->begin(); it != calltree->end(); ++it) {
+          map<ADDR64, list<FuncBody *> *>::iterator i = funcmap->find(it->startAddr);
+          if (i == funcmap->end())
+               i = funcmap->insert(pair<ADDR64, list<FuncBody *> *>(it->startAddr, new list<FuncBody *>)).first;
+          i->second->push_back(&*it);
      }
 
      return funcmap;
 }
 
+// One line per function: instances, and instructions run with and without callees
 void printFuncmap(map<ADDR64, list<FuncBody *> *> *funcmap)
 {
      map<ADDR64, list<FuncBody *> *>::iterator it;
      for (it = funcmap->begin(); it != funcmap->end(); ++it) {
-          cout << hex << it->first << endl;
+          long long incl = 0, excl = 0;
+          for (list<FuncBody *>::iterator fb = it->second->begin(); fb != it->second->end(); ++fb) {
+               incl += (*fb)->length;
+               excl += (*fb)->exclusive;
+          }
+          cout << hex << it->first << dec << ": " << it->second->size() << " instances, "
+               << incl << " inclusive, " << excl << " exclusive" << endl;
      }
 }
 
+// Write the call tree to calltree.txt, one instance per line indented by depth
+void outputCallTree(vector<FuncBody> *calltree)
+{
+     FILE *fp = fopen("calltree.txt", "w");
+
+     for (vector<FuncBody>::iterator it = calltree->begin(); it != calltree->end(); ++it) {
+          fprintf(fp, "%*s%llx [%d, %d] %d inclusive, %d exclusive", it->depth * 2, "",
+                  (unsigned long long)it->startAddr, it->start, it->end, it->length, it->exclusive);
+          if (it->loopn > 0)
+               fprintf(fp, ", %d loops", it->loopn);
+          if (it->tailcall)
+               fprintf(fp, ", tail call");
+          fprintf(fp, "\n");
+     }
+
+     fclose(fp);
+}
+
 map<string, int> *buildOpcodeMap(list<Inst> *L)
 {
      map<string, int> *instenum = new map<string, int>;
@@ -167,6 +261,188 @@ void peephole(list<Inst> *L)
      }
 }
 
+// A run of identical iterations over the same address sequence
+struct Loop {
+     int start;                 // id of the first instruction
+     int end;                   // id of the last instruction of the last iteration
+     int period;                // instructions per iteration
+     int iterations;
+     ADDR64 startAddr;
+     ADDR64 delta[16];          // per-iteration change of each context register
+     bool linear[16];           // whether delta[i] is the same in all iterations
+};
+
+// The trace with loops folded: a segment is either a straight run of
+// instructions (iterations == 1) or one loop body repeated iterations times
+struct TraceSeg {
+     list<Inst>::iterator begin;
+     int length;                // instructions per iteration
+     int iterations;
+     int loop;                  // index into the loop list, -1 for straight runs
+};
+
+#define MAXLOOPPERIOD 1024
+
+// Find loops in the trace in one forward pass. At each position the candidate
+// period is the distance to the next execution of the same address; the body
+// repeats if the following window has the same Rabin-Karp hash over the
+// instruction addresses (checked in full before folding). Repeats are counted
+// the same way and the whole run is folded into one loop record. A shorter
+// loop starting inside the body wins, so inner loops are folded first.
+// Only exact repeats are found: iterations of a dispatcher loop that run
+// different handlers stay unfolded. The pass works on the whole trace in
+// memory and the segments point into it, so it does not save memory; the
+// result is only written to foldedtrace.txt.
+void foldLoops(list<Inst> *L, vector<Loop> *loops, vector<TraceSeg> *folded)
+{
+     const uint64_t base = 0x100000001b3ULL;
+     vector<list<Inst>::iterator> pos;
+     vector<ADDR64> addrs;
+     for (list<Inst>::iterator it = L->begin(); it != L->end(); ++it) {
+          pos.push_back(it);
+          addrs.push_back(it->addrn);
+     }
+     int n = addrs.size();
+
+     // prefix hashes, window hash of [i, i+len) is h[i+len] - h[i]*pw[len]
+     vector<uint64_t> h(n + 1, 0), pw(MAXLOOPPERIOD + 1, 1);
+     for (int i = 0; i < n; ++i)
+          h[i+1] = h[i] * base + addrs[i];
+     for (int i = 1; i <= MAXLOOPPERIOD; ++i)
+          pw[i] = pw[i-1] * base;
+
+     vector<int> nextocc(n, -1);
+     unordered_map<ADDR64, int> last;
+     for (int i = n - 1; i >= 0; --i) {
+          unordered_map<ADDR64, int>::iterator li = last.find(addrs[i]);
+          if (li != last.end()) {
+               nextocc[i] = li->second;
+               li->second = i;
+          } else {
+               last.insert(pair<ADDR64, int>(addrs[i], i));
+          }
+     }
+
+     int i = 0;
+     while (i < n) {
+          int p = (nextocc[i] < 0) ? 0 : nextocc[i] - i;
+          int iters = 1;
+          if (p > 0 && p <= MAXLOOPPERIOD) {
+               uint64_t body = h[i+p] - h[i] * pw[p];
+               while (i + (iters + 1) * p <= n) {
+                    int b = i + iters * p;
+                    if (h[b+p] - h[b] * pw[p] != body ||
+                        !equal(addrs.begin() + i, addrs.begin() + i + p, addrs.begin() + b))
+                         break;
+                    ++iters;
+               }
+          }
+
+          if (iters >= 2) {
+               int j;
+               for (j = i + 1; j < i + p; ++j) {
+                    int q = (nextocc[j] < 0) ? 0 : nextocc[j] - j;
+                    if (q > 0 && q < p && j + 2 * q <= n &&
+                        h[j+q] - h[j] * pw[q] == h[j+2*q] - h[j+q] * pw[q])
+                         break;
+               }
+               if (j < i + p) {
+                    // leave i .. j-1 as straight instructions
+                    if (folded->empty() || folded->back().loop >= 0)
+                         folded->push_back(TraceSeg{pos[i], 0, 1, -1});
+                    folded->back().length += j - i;
+                    i = j;
+                    continue;
+               }
+          }
+
+          if (iters < 2) {
+               if (!folded->empty() && folded->back().loop < 0)
+                    folded->back().length++;
+               else
+                    folded->push_back(TraceSeg{pos[i], 1, 1, -1});
+               ++i;
+               continue;
+          }
+
+          Loop lp;
+          lp.start = pos[i]->id;
+          lp.end = pos[i + iters * p - 1]->id;
+          lp.period = p;
+          lp.iterations = iters;
+          lp.startAddr = addrs[i];
+          for (int r = 0; r < 16; ++r) {
+               lp.delta[r] = pos[i+p]->ctxreg[r] - pos[i]->ctxreg[r];
+               lp.linear[r] = true;
+          }
+          // the register state after the last iteration is only known if the
+          // trace goes on, so the last delta is checked when it is available
+          for (int k = 1; k < iters; ++k) {
+               int b = i + k * p, nb = b + p;
+               if (nb >= n) break;
+               for (int r = 0; r < 16; ++r) {
+                    if (pos[nb]->ctxreg[r] - pos[b]->ctxreg[r] != lp.delta[r])
+                         lp.linear[r] = false;
+               }
+          }
+
+          folded->push_back(TraceSeg{pos[i], p, iters, (int)loops->size()});
+          loops->push_back(lp);
+          i += iters * p;
+     }
+}
+
+// Write the folded trace to foldedtrace.txt, printing each loop body once
+// with its iteration count and the registers that change by a fixed step
+void outputFoldedTrace(vector<Loop> *loops, vector<TraceSeg> *folded)
+{
+     FILE *fp = fopen("foldedtrace.txt", "w");
+
+     for (vector<TraceSeg>::iterator it = folded->begin(); it != folded->end(); ++it) {
+          if (it->loop < 0) {
+               list<Inst>::iterator ii = it->begin;
+               for (int i = 0; i < it->length; ++i, ++ii) {
+                    fprintf(fp, "%d %s %s\n", ii->id, ii->addr.c_str(), ii->assembly.c_str());
+               }
+               continue;
+          }
+
+          Loop &lp = (*loops)[it->loop];
+          fprintf(fp, "loop%d: %d - %d, %d x %d instructions {", it->loop + 1, lp.start, lp.end,
+                  lp.iterations, lp.period);
+          for (int r = 0; r < 16; ++r) {
+               if (!lp.linear[r] || lp.delta[r] == 0) continue;
+               if ((int64_t)lp.delta[r] < 0)
+                    fprintf(fp, " %s -= %llx;", reg2string((Register)r).c_str(),
+                            (unsigned long long)-lp.delta[r]);
+               else
+                    fprintf(fp, " %s += %llx;", reg2string((Register)r).c_str(),
+                            (unsigned long long)lp.delta[r]);
+          }
+          fprintf(fp, "\n");
+          list<Inst>::iterator ii = it->begin;
+          for (int i = 0; i < it->length; ++i, ++ii) {
+               fprintf(fp, "     %s %s\n", ii->addr.c_str(), ii->assembly.c_str());
+          }
+          fprintf(fp, "}\n");
+     }
+
+     fclose(fp);
+}
+
+// Count the folded loops that start inside each function instance
+void countFuncLoops(vector<FuncBody> *calltree, vector<Loop> *loops)
+{
+     vector<int> starts;
+     for (vector<Loop>::iterator it = loops->begin(); it != loops->end(); ++it) {
+          starts.push_back(it->start);
+     }
+     for (vector<FuncBody>::iterator it = calltree->begin(); it != calltree->end(); ++it) {
+          it->loopn = upper_bound(starts.begin(), starts.end(), it->end) -
+               lower_bound(starts.begin(), starts.end(), it->start);
+     }
+}
+
 struct ctxswitch {
      list<Inst>::iterator begin;
      list<Inst>::iterator end;
@@ -253,26 +529,71 @@ void vmextract(list<Inst> *L)
      }
 }
 
-void outputvm(list<pair<ctxswitch, ctxswitch> > *ctxswh)
+// Write one trace record per instruction in [begin, end), in the tracer's format
+void outputTraceRange(FILE *fp, list<Inst>::iterator begin, list<Inst>::iterator end)
 {
-     int n = 1;
+     for (list<Inst>::iterator ii = begin; ii != end; ++ii) {
+          fprintf(fp, "%s;%s;", ii->addr.c_str(), ii->assembly.c_str());
+          for (int j = 0; j < 16; ++j) {
+               fprintf(fp, "%llx,", (unsigned long long)ii->ctxreg[j]);
+          }
+          fprintf(fp, "%llx,%llx,\n", (unsigned long long)ii->raddr,
+                  (unsigned long long)ii->waddr);
+     }
+}
+
+// Write every paired context switch region to vmN.txt. Regions are written
+// in parallel, one file at a time per thread through a large stdio buffer.
+// With rangeonly, only the instruction id range of each region goes to
+// vmranges.txt and the regions stay in the original trace.
+void outputvm(list<pair<ctxswitch, ctxswitch> > *ctxswh, bool rangeonly)
+{
+     vector<pair<list<Inst>::iterator, list<Inst>::iterator> > regions;
      for (list<pair<ctxswitch,ctxswitch> >::iterator i = ctxswh->begin(); i != ctxswh->end(); ++i) {
-          list<Inst>::iterator i1 = i->first.begin;
-          list<Inst>::iterator i2 = i->second.end;
+          // a restore before the save does not enclose a region
+          if (i->second.begin->id < i->first.begin->id) continue;
+          regions.push_back(pair<list<Inst>::iterator, list<Inst>::iterator>(i->first.begin, i->second.end));
+     }
 
-          string vmfile = "vm" + to_string(n++) + ".txt";
-          FILE *fp = fopen(vmfile.c_str(), "w");
+     if (rangeonly) {
+          FILE *fp = fopen("vmranges.txt", "w");
+          if (fp == NULL) {
+               fprintf(stderr, "Cannot create vmranges.txt\n");
+               return;
+          }
+          for (int n = 0, max = regions.size(); n < max; ++n) {
+               list<Inst>::iterator last = prev(regions[n].second, 1);
+               fprintf(fp, "vm%d: %d %d\n", n + 1, regions[n].first->id, last->id);
+          }
+          fclose(fp);
+          return;
+     }
 
-          for (list<Inst>::iterator ii = i1; ii != i2; ++ii) {
-               fprintf(fp, "%s;%s;", ii->addr.c_str(), ii->assembly.c_str());
-               for (int j = 0; j < 8; ++j) {
-                    fprintf(fp, "%x,", ii->ctxreg[j]);
+     atomic<int> nextregion(0);
+     auto worker = [&]() {
+          vector<char> buf(1 << 20);
+          int n;
+          while ((n = nextregion++) < (int)regions.size()) {
+               string vmfile = "vm" + to_string(n + 1) + ".txt";
+               FILE *fp = fopen(vmfile.c_str(), "w");
+               if (fp == NULL) {
+                    fprintf(stderr, "Cannot create %s\n", vmfile.c_str());
+                    continue;
                }
-               fprintf(fp, "%x,%x\n", ii->raddr, ii->waddr);
+               setvbuf(fp, buf.data(), _IOFBF, buf.size());
+               outputTraceRange(fp, regions[n].first, regions[n].second);
+               fclose(fp);
           }
+     };
 
-          fclose(fp);
-     }
+     int nthread = thread::hardware_concurrency();
+     if (nthread < 1) nthread = 1;
+     if (nthread > (int)regions.size()) nthread = regions.size();
+     vector<thread> threads;
+     for (int i = 0; i < nthread; ++i)
+          threads.push_back(thread(worker));
+     for (int i = 0; i < nthread; ++i)
+          threads[i].join();
 }
 
 
@@ -334,10 +655,36 @@ Edge::Edge(ADDR64 addr1, ADDR64 addr2, int type, int num)
      count = num;
 }
 
+// A VM handler found behind the dispatcher's indirect jump
+struct VMHandler {
+     ADDR64 entry;
+     int count;                 // number of invocations
+     vector<pair<list<Inst>::iterator, list<Inst>::iterator> > instances;
+
+     VMHandler() : entry(0), count(0) {}
+};
+
+// One distinct address sequence taken through a handler. All instances with
+// the same sequence are analyzed once, on the first one.
+struct HandlerVariant {
+     int id;
+     ADDR64 entry;
+     uint64_t hash;             // hashAddrSeq() of the sequence
+     int length;
+     list<Inst>::iterator begin;     // first instance
+     list<Inst>::iterator end;
+     vector<pair<int, int> > instances;   // first and last instruction id of each instance
+};
+
 class CFG {
      vector<BB> bbs;
      vector<Edge> edges;
-     map<ADDR64, int> bbmap;
+     map<ADDR64, int> bbmap;                      // beginaddr -> bb
+     map<ADDR64, int> bbendmap;                   // endaddr -> bb
+     map<pair<ADDR64, ADDR64>, int> edgemap;      // (fromaddr, toaddr) -> edge
+
+     void addBB(const BB &bb);
+     void addEdge(const Edge &e);
 
 public:
      CFG() {}
@@ -348,8 +695,28 @@ public:
      void outputSimpleDot();
      void showTrace(list<Inst> *L);
      void compressCFG();
+     int findDispatcher(list<Inst> *L, FILE *fp);
+     void collectHandlers(list<Inst> *L, int disp, map<ADDR64, VMHandler> *handlers,
+                          map<ADDR64, ADDR64> *table);
 };
 
+// Append a bb and index it by its begin and end address. When several bbs
+// share an address, the index keeps the first one, as the linear search did.
+void CFG::addBB(const BB &bb)
+{
+     int n = bbs.size();
+     bbs.push_back(bb);
+     bbmap.insert(pair<ADDR64, int>(bb.beginaddr, n));
+     bbendmap.insert(pair<ADDR64, int>(bb.endaddr, n));
+}
+
+void CFG::addEdge(const Edge &e)
+{
+     int n = edges.size();
+     edges.push_back(e);
+     edgemap.insert(pair<pair<ADDR64, ADDR64>, int>(pair<ADDR64, ADDR64>(e.fromaddr, e.toaddr), n));
+}
+
 // build CFG based on the trace L
 // use the addrn of the next instruction after a jump as the target address
 // the operand in the jump instruction are only used to decide whether it is
@@ -372,9 +739,9 @@ CFG::CFG(list<Inst> *L)
                                     // 4: newbb
                                     // 0: others
 
-               for (curbb = 0, max = bbs.size(); curbb < max; ++curbb) {
-                    if (bbs[curbb].endaddr == addr2) break;
-               }
+               map<ADDR64, int>::iterator ei = bbendmap.find(addr2);
+               max = bbs.size();
+               curbb = (ei == bbendmap.end()) ? max : ei->second;
 
                if (curbb != max) {
                     if (bbs[curbb].beginaddr == addr1) {
@@ -399,41 +766,35 @@ CFG::CFG(list<Inst> *L)
                     break;
                case 2:
                     bbs[curbb].endaddr = addr1 - 1;
+                    bbendmap.erase(addr2);
+                    bbendmap.insert(pair<ADDR64, int>(addr1 - 1, curbb));
                     tempBB = new BB(addr1, addr2, 2);
-                    bbs.push_back(*tempBB);
+                    addBB(*tempBB);
                     tempEdge = new Edge(bbs[curbb].endaddr, addr1, 2, 1);
-                    edges.push_back(*tempEdge);
+                    addEdge(*tempEdge);
                     break;
                case 3:          // still buggy, but can do now. Need more work.
                {
-                    int i, max;
-                    for (i = 0, max = bbs.size(); i < max; ++i) {
-                         if (bbs[i].beginaddr == addr1) {
-                              break;
-                         }
-                    }
-                    if (i == max) {
+                    if (bbmap.find(addr1) == bbmap.end()) {
                          tempBB = new BB(addr1, bbs[curbb].beginaddr-1, 2);
-                         bbs.push_back(*tempBB);
+                         addBB(*tempBB);
                     } else {
                          // do nothing
                     }
 
-                    for (i = 0, max = edges.size(); i < max; ++i) {
-                         if (edges[i].fromaddr == bbs[curbb].beginaddr-1 && edges[i].toaddr == bbs[curbb].beginaddr) {
-                              edges[i].count++;
-                              break;
-                         }
-                    }
-                    if (i == max) {
+                    map<pair<ADDR64, ADDR64>, int>::iterator ei =
+                         edgemap.find(pair<ADDR64, ADDR64>(bbs[curbb].beginaddr-1, bbs[curbb].beginaddr));
+                    if (ei != edgemap.end()) {
+                         edges[ei->second].count++;
+                    } else {
                          tempEdge = new Edge(bbs[curbb].beginaddr-1, bbs[curbb].beginaddr, 2, 1);
-                         edges.push_back(*tempEdge);
+                         addEdge(*tempEdge);
                     }
                     break;
                }
                case 4:
                     tempBB = new BB(addr1, addr2);
-                    bbs.push_back(*tempBB);
+                    addBB(*tempBB);
                     break;
                case 0:
                     printf("others\n");
@@ -444,7 +805,8 @@ CFG::CFG(list<Inst> *L)
                     break;
                }
 
-               addr1 = next(it, 1)->addrn;
+               if (next(it, 1) != L->end())
+                    addr1 = next(it, 1)->addrn;
           } else {
                // other instructions, read them into instvec
           }
@@ -458,7 +820,7 @@ CFG::CFG(list<Inst> *L)
      if (!(isjump(it->opc, jmpset) || it->opcstr == "ret" || it->opcstr == "call")) {
           ADDR64 lastaddr = it->addrn;
           BB *lastBB = new BB(addr1, lastaddr);
-          bbs.push_back(*lastBB);
+          addBB(*lastBB);
      }
 
      // Add edges
@@ -490,17 +852,13 @@ CFG::CFG(list<Inst> *L)
                continue;        // do nothing on other instructions
           }
 
-          int i, max;
-          for (i = 0, max = edges.size(); i < max; ++i) {
-               if (edges[i].fromaddr == curaddr && edges[i].toaddr == targetaddr) {
-                    edges[i].count++;
-                    break;
-               }
-          }
-
-          if (i == max) {       // not in current edges, add a new edge
+          map<pair<ADDR64, ADDR64>, int>::iterator ei =
+               edgemap.find(pair<ADDR64, ADDR64>(curaddr, targetaddr));
+          if (ei != edgemap.end()) {
+               edges[ei->second].count++;
+          } else {              // not in current edges, add a new edge
                Edge newedge(curaddr, targetaddr, jumpty, 1);
-               edges.push_back(newedge);
+               addEdge(newedge);
           }
      }
 
@@ -510,23 +868,17 @@ CFG::CFG(list<Inst> *L)
           addr1 = edges[i].fromaddr;
           addr2 = edges[i].toaddr;
 
-          int frombb, tobb, j, maxbbs;
-          for (j = 0, maxbbs = bbs.size(); j < maxbbs; ++j) {
-               if (bbs[j].endaddr == addr1) {
-                    frombb = j;
-                    break;
-               }
-          }
-          if (j == maxbbs)
-               printf("error: no endaddr == %x\n", addr1);
-          for (j = 0, maxbbs = bbs.size(); j < maxbbs; ++j) {
-               if (bbs[j].beginaddr == addr2) {
-                    tobb = j;
-                    break;
-               }
-          }
-          if (j == maxbbs)
-               printf("error: no beginaddr == %x\n", addr2);
+          int frombb = 0, tobb = 0, j;
+          map<ADDR64, int>::iterator bi = bbendmap.find(addr1);
+          if (bi != bbendmap.end())
+               frombb = bi->second;
+          else
+               printf("error: no endaddr == %llx\n", (unsigned long long)addr1);
+          bi = bbmap.find(addr2);
+          if (bi != bbmap.end())
+               tobb = bi->second;
+          else
+               printf("error: no beginaddr == %llx\n", (unsigned long long)addr2);
 
           edges[i].from = frombb;
           edges[i].to = tobb;
@@ -755,6 +1107,205 @@ void CFG::showTrace(list<Inst> *L)
      fclose(fp);
 }
 
+// Rank all bbs as dispatcher candidates and return the best one, or -1 if
+// no bb dispatches to more than one target. A dispatcher ends with an indirect
+// jump to many handlers, is entered from many places and runs most often, so
+// bbs are ordered by indirect-jump fan-out, then in-degree, then execution count.
+int CFG::findDispatcher(list<Inst> *L, FILE *fp)
+{
+     struct BBStat {
+          int id;
+          int indeg;            // number of distinct incoming edges
+          int fanout;           // number of distinct indirect jump targets
+          int execnum;          // number of times the bb is entered
+
+          BBStat(int a) : id(a), indeg(0), fanout(0), execnum(0) {}
+          bool operator<(const BBStat &other) const {
+               if (fanout != other.fanout) return fanout > other.fanout;
+               if (indeg != other.indeg) return indeg > other.indeg;
+               return execnum > other.execnum;
+          }
+     };
+
+     vector<BBStat> stats;
+     for (int i = 0, max = bbs.size(); i < max; ++i) {
+          stats.push_back(BBStat(i));
+     }
+     for (int i = 0, max = edges.size(); i < max; ++i) {
+          stats[edges[i].to].indeg++;
+          if (edges[i].ty == 1)
+               stats[edges[i].from].fanout++;
+     }
+     for (list<Inst>::iterator it = L->begin(); it != L->end(); ++it) {
+          map<ADDR64, int>::iterator bi = bbmap.find(it->addrn);
+          if (bi != bbmap.end())
+               stats[bi->second].execnum++;
+     }
+
+     sort(stats.begin(), stats.end());
+
+     fprintf(fp, "Dispatcher candidates:\n");
+     for (int i = 0, max = stats.size(); i < max && i < 10; ++i) {
+          BB &bb = bbs[stats[i].id];
+          fprintf(fp, "BB%d: %llx, %llx, fanout %d, indegree %d, executed %d\n", stats[i].id,
+                  (unsigned long long)bb.beginaddr, (unsigned long long)bb.endaddr,
+                  stats[i].fanout, stats[i].indeg, stats[i].execnum);
+     }
+     fprintf(fp, "\n");
+
+     if (stats.empty() || stats[0].fanout < 2)
+          return -1;
+     return stats[0].id;
+}
+
+// Cut the trace into handler instances: each one starts at the target of the
+// dispatcher's indirect jump and runs until control is back in the dispatcher.
+// Memory-indirect dispatch jumps also give the handler table slot in raddr.
+void CFG::collectHandlers(list<Inst> *L, int disp, map<ADDR64, VMHandler> *handlers,
+                          map<ADDR64, ADDR64> *table)
+{
+     ADDR64 dbegin = bbs[disp].beginaddr;
+     ADDR64 dend = bbs[disp].endaddr;
+     VMHandler *cur = NULL;
+     list<Inst>::iterator curbegin;
+
+     for (list<Inst>::iterator it = L->begin(); it != L->end(); ++it) {
+          if (cur != NULL && (it->addrn == dbegin || it->addrn == dend)) {
+               cur->instances.push_back(pair<list<Inst>::iterator, list<Inst>::iterator>(curbegin, it));
+               cur = NULL;
+          }
+          if (it->addrn == dend && isjump(it->opc, jmpset)) {
+               list<Inst>::iterator nit = next(it, 1);
+               if (nit == L->end()) break;
+
+               cur = &(*handlers)[nit->addrn];
+               cur->entry = nit->addrn;
+               cur->count++;
+               curbegin = nit;
+               if (it->raddr != 0)
+                    (*table)[it->raddr] = nit->addrn;
+          }
+     }
+     if (cur != NULL)
+          cur->instances.push_back(pair<list<Inst>::iterator, list<Inst>::iterator>(curbegin, L->end()));
+}
+
+// Group handler instances by their address sequence. Instances are hashed
+// and only compared in full against the variants with the same hash.
+void dedupHandlers(map<ADDR64, VMHandler> *handlers, vector<HandlerVariant> *variants)
+{
+     map<uint64_t, vector<int> > hashmap;
+
+     for (map<ADDR64, VMHandler>::iterator it = handlers->begin(); it != handlers->end(); ++it) {
+          VMHandler &h = it->second;
+          for (int i = 0, max = h.instances.size(); i < max; ++i) {
+               list<Inst>::iterator b = h.instances[i].first, e = h.instances[i].second;
+               if (b == e)
+                    continue;
+               uint64_t hash = hashAddrSeq(b, e);
+               vector<int> &cand = hashmap[hash];
+
+               int v, vmax;
+               for (v = 0, vmax = cand.size(); v < vmax; ++v) {
+                    HandlerVariant &hv = (*variants)[cand[v]];
+                    if (sameAddrSeq(hv.begin, hv.end, b, e)) break;
+               }
+               if (v == vmax) {
+                    HandlerVariant hv;
+                    hv.id = variants->size() + 1;
+                    hv.entry = h.entry;
+                    hv.hash = hash;
+                    hv.length = distance(b, e);
+                    hv.begin = b;
+                    hv.end = e;
+                    cand.push_back(variants->size());
+                    variants->push_back(hv);
+                    v = cand.size() - 1;
+               }
+               (*variants)[cand[v]].instances.push_back(pair<int, int>(b->id, prev(e)->id));
+          }
+     }
+}
+
+// Write every distinct handler variant once to handlerN.txt, so mgse and
+// slicer only process each of them once, and the list of instances of each
+// variant to handlerinstances.txt for applying the result back to the trace.
+// handlerranges.txt has the id range of every instance for mgse -r, which
+// executes each variant once and reuses the result for its other instances.
+void outputHandlerVariants(vector<HandlerVariant> *variants)
+{
+     FILE *ifp = fopen("handlerinstances.txt", "w");
+     FILE *rfp = fopen("handlerranges.txt", "w");
+
+     for (vector<HandlerVariant>::iterator it = variants->begin(); it != variants->end(); ++it) {
+          string hfile = "handler" + to_string(it->id) + ".txt";
+          FILE *fp = fopen(hfile.c_str(), "w");
+          outputTraceRange(fp, it->begin, it->end);
+          fclose(fp);
+
+          fprintf(ifp, "handler%d: %llx, %d instructions, %d instances, hash %016llx\n",
+                  it->id, (unsigned long long)it->entry, it->length, (int)it->instances.size(),
+                  (unsigned long long)it->hash);
+          for (int i = 0, max = it->instances.size(); i < max; ++i) {
+               fprintf(ifp, "%d%c", it->instances[i].first, (i + 1 == max) ? '\n' : ' ');
+               fprintf(rfp, "handler%d: %d %d\n", it->id, it->instances[i].first,
+                       it->instances[i].second);
+          }
+     }
+
+     fclose(ifp);
+     fclose(rfp);
+}
+
+// Identify the VM dispatcher and its handlers on the CFG, and write the
+// ranking, the handler table and every handler's instructions to vmhandlers.txt
+void findVMHandlers(list<Inst> *L, map<ADDR64, VMHandler> *handlers,
+                    vector<HandlerVariant> *variants)
+{
+     CFG cfg(L);
+     FILE *fp = fopen("vmhandlers.txt", "w");
+
+     int disp = cfg.findDispatcher(L, fp);
+     if (disp < 0) {
+          fprintf(fp, "No dispatcher found.\n");
+          fclose(fp);
+          return;
+     }
+
+     map<ADDR64, ADDR64> table;
+     cfg.collectHandlers(L, disp, handlers, &table);
+     dedupHandlers(handlers, variants);
+
+     fprintf(fp, "Dispatcher: BB%d, %d handlers\n", disp, (int)handlers->size());
+     if (!table.empty()) {
+          fprintf(fp, "Handler table: %llx - %llx\n", (unsigned long long)table.begin()->first,
+                  (unsigned long long)table.rbegin()->first);
+          for (map<ADDR64, ADDR64>::iterator it = table.begin(); it != table.end(); ++it) {
+               fprintf(fp, "  %llx -> %llx\n", (unsigned long long)it->first,
+                       (unsigned long long)it->second);
+          }
+     }
+     fprintf(fp, "\n");
+
+     int n = 1;
+     for (map<ADDR64, VMHandler>::iterator it = handlers->begin(); it != handlers->end(); ++it, ++n) {
+          VMHandler &h = it->second;
+          fprintf(fp, "Handler %d: %llx, %d invocations\n", n, (unsigned long long)h.entry, h.count);
+          for (vector<HandlerVariant>::iterator v = variants->begin(); v != variants->end(); ++v) {
+               if (v->entry != h.entry) continue;
+               fprintf(fp, "  handler%d.txt: %d instances\n", v->id, (int)v->instances.size());
+               for (list<Inst>::iterator ii = v->begin; ii != v->end; ++ii) {
+                    fprintf(fp, "     %s %s\n", ii->addr.c_str(), ii->assembly.c_str());
+               }
+          }
+          fprintf(fp, "\n");
+     }
+
+     fclose(fp);
+     cout << "dispatcher found, " << handlers->size() << " handlers, "
+          << variants->size() << " distinct handler paths" << endl;
+}
+
 void preprocess(list<Inst> *L)
 {
      // build global instruction enum based on the instlist
@@ -778,12 +1329,16 @@ void preprocess(list<Inst> *L)
 
 
 int main(int argc, char **argv) {
-     if (argc != 2) {
-          fprintf(stderr, "usage: %s <tracefile>\n", argv[0]);
+     bool rangeonly = false;
+     if (argc == 3 && string(argv[1]) == "-r") {
+          rangeonly = true;
+     } else if (argc != 2) {
+          fprintf(stderr, "usage: %s [-r] <tracefile>\n", argv[0]);
+          fprintf(stderr, "  -r  write VM snippet id ranges to vmranges.txt instead of vmN.txt\n");
           return 1;
      }
 
-     ifstream infile(argv[1]);
+     ifstream infile(argv[argc-1]);
      if (!infile.is_open()) {
           fprintf(stderr, "Open file error!\n");
           return 1;
@@ -799,7 +1354,25 @@ int main(int argc, char **argv) {
 
      vmextract(&instlist);
 
-     outputvm(&ctxswh);
+     outputvm(&ctxswh, rangeonly);
+
+     map<ADDR64, VMHandler> handlers;
+     vector<HandlerVariant> variants;
+     findVMHandlers(&instlist, &handlers, &variants);
+     outputHandlerVariants(&variants);
+
+     vector<Loop> loops;
+     vector<TraceSeg> folded;
+     foldLoops(&instlist, &loops, &folded);
+     outputFoldedTrace(&loops, &folded);
+     cout << instlist.size() << " instructions folded into " << folded.size()
+          << " segments, " << loops.size() << " loops" << endl;
+
+     vector<FuncBody> calltree;
+     map<ADDR64, list<FuncBody *> *> *funcmap = buildFuncList(&instlist, &calltree);
+     countFuncLoops(&calltree, &loops);
+     outputCallTree(&calltree);
+     printFuncmap(funcmap);
 
      return 0;
 }